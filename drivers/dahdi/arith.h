@@ -306,20 +306,424 @@ static inline void SCSS(short *dst, short *src)
 
 #endif	/* DAHDI_CHUNKSIZE */
 
+#if defined(CONFIG_DAHDI_SIMD) && defined(__x86_64__)
+/*
+ * SSE2 and, where both the CPU and the assembler have it, AVX2 versions of
+ * the convolutions and of the batched chunk add/subtract below.  What the
+ * CPU can do is found out at load time (dahdi_simd), but the vector unit
+ * may only be touched between dahdi_simd_begin() and dahdi_simd_end(), so
+ * the dispatchers check whether this CPU is in such a section and use the
+ * plain C code otherwise.  An interrupt coming in during a section is not
+ * in it, so the section also remembers the interrupt context it began in.
+ */
+#define DAHDI_ARITH_SIMD
+
+#ifdef __KERNEL__
+#include <linux/version.h>
+#include <linux/percpu.h>
+#include <linux/smp.h>
+#include <linux/hardirq.h>
+#include <asm/cpufeature.h>
+#include <asm/i387.h>
+
+#if defined(CONFIG_AS_AVX2) && defined(X86_FEATURE_AVX2)
+#define DAHDI_ARITH_AVX2
+#endif
+#else
+/* Userspace (ecbench): the vector unit is always ours to use */
+#define DECLARE_PER_CPU(type, name) extern type name
+#define per_cpu(var, cpu) (var)
+#define smp_processor_id() 0
+#define irq_count() 0
+#define in_interrupt() 0
+#define kernel_fpu_begin() do { } while (0)
+#define kernel_fpu_end() do { } while (0)
+
+#ifdef CONFIG_AS_AVX2
+#define DAHDI_ARITH_AVX2
+#endif
+#endif
+
+#define DAHDI_SIMD_NONE	0
+#define DAHDI_SIMD_SSE2	1
+#define DAHDI_SIMD_AVX2	2
+
+extern int dahdi_simd;
+DECLARE_PER_CPU(int, dahdi_simd_on);
+DECLARE_PER_CPU(unsigned long, dahdi_simd_ctx);
+
+/* Claim the vector unit, if we have one and may use it right now */
+static inline int dahdi_simd_begin(void)
+{
+	if (dahdi_simd == DAHDI_SIMD_NONE)
+		return 0;
+#if defined(__KERNEL__) && LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,36)
+	if (!irq_fpu_usable())
+		return 0;
+#else
+	if (in_interrupt())
+		return 0;
+#endif
+	kernel_fpu_begin();
+	per_cpu(dahdi_simd_ctx, smp_processor_id()) = irq_count();
+	per_cpu(dahdi_simd_on, smp_processor_id()) = dahdi_simd;
+	return 1;
+}
+
+static inline void dahdi_simd_end(void)
+{
+	per_cpu(dahdi_simd_on, smp_processor_id()) = DAHDI_SIMD_NONE;
+	kernel_fpu_end();
+}
+
+static inline int dahdi_simd_active(void)
+{
+	if (per_cpu(dahdi_simd_ctx, smp_processor_id()) != irq_count())
+		return DAHDI_SIMD_NONE;
+	return per_cpu(dahdi_simd_on, smp_processor_id());
+}
+
+#ifdef DAHDI_CHUNKSIZE
+static inline void __ACSS_sse2(short *dst, const short *src)
+{
+	__asm__ __volatile__ (
+		"movdqu 0(%0), %%xmm0;\n"
+		"movdqu 0(%1), %%xmm1;\n"
+		"paddsw %%xmm1, %%xmm0;\n"
+		"movdqu %%xmm0, 0(%0);\n"
+		:
+		: "r" (dst), "r" (src)
+		: "memory"
+	);
+}
+
+static inline void __SCSS_sse2(short *dst, const short *src)
+{
+	__asm__ __volatile__ (
+		"movdqu 0(%0), %%xmm0;\n"
+		"movdqu 0(%1), %%xmm1;\n"
+		"psubsw %%xmm1, %%xmm0;\n"
+		"movdqu %%xmm0, 0(%0);\n"
+		:
+		: "r" (dst), "r" (src)
+		: "memory"
+	);
+}
+
+#ifdef DAHDI_ARITH_AVX2
+static inline void __ACSS_avx2(short *dst, const short *src)
+{
+	__asm__ __volatile__ (
+		"vmovdqu 0(%0), %%ymm0;\n"
+		"vpaddsw 0(%1), %%ymm0, %%ymm0;\n"
+		"vmovdqu %%ymm0, 0(%0);\n"
+		"vzeroupper;\n"
+		:
+		: "r" (dst), "r" (src)
+		: "memory"
+	);
+}
+
+static inline void __SCSS_avx2(short *dst, const short *src)
+{
+	__asm__ __volatile__ (
+		"vmovdqu 0(%0), %%ymm0;\n"
+		"vpsubsw 0(%1), %%ymm0, %%ymm0;\n"
+		"vmovdqu %%ymm0, 0(%0);\n"
+		"vzeroupper;\n"
+		:
+		: "r" (dst), "r" (src)
+		: "memory"
+	);
+}
+#endif
+
+/* Whole chunks, inside a vector section */
+static inline void __ACSS_simd(short *dst, const short *src)
+{
+	int x = 0;
+#if defined(DAHDI_ARITH_AVX2) && !(DAHDI_CHUNKSIZE % 16)
+	if (dahdi_simd == DAHDI_SIMD_AVX2) {
+		for (; x < DAHDI_CHUNKSIZE; x += 16)
+			__ACSS_avx2(dst + x, src + x);
+		return;
+	}
+#endif
+	for (; x < DAHDI_CHUNKSIZE; x += 8)
+		__ACSS_sse2(dst + x, src + x);
+}
+
+static inline void __SCSS_simd(short *dst, const short *src)
+{
+	int x = 0;
+#if defined(DAHDI_ARITH_AVX2) && !(DAHDI_CHUNKSIZE % 16)
+	if (dahdi_simd == DAHDI_SIMD_AVX2) {
+		for (; x < DAHDI_CHUNKSIZE; x += 16)
+			__SCSS_avx2(dst + x, src + x);
+		return;
+	}
+#endif
+	for (; x < DAHDI_CHUNKSIZE; x += 8)
+		__SCSS_sse2(dst + x, src + x);
+}
+#endif	/* DAHDI_CHUNKSIZE */
+
+/* Convolutions over "blocks" runs of 8 (SSE2) or 16 (AVX2) taps */
+static inline int __CONVOLVE_sse2(const int *coeffs, const short *hist, long blocks)
+{
+	int sum;
+	/* Shift eight coefficients down to shorts, then multiply/add them
+	   with eight history samples into four running sums in xmm2 */
+	__asm__ __volatile__ (
+		"pxor %%xmm2, %%xmm2;\n"
+		"1:"
+			"movdqu  0(%1), %%xmm0;\n"
+			"movdqu 16(%1), %%xmm1;\n"
+			"psrad $16, %%xmm0;\n"
+			"psrad $16, %%xmm1;\n"
+			"packssdw %%xmm1, %%xmm0;\n"
+			"movdqu 0(%2), %%xmm1;\n"
+			"pmaddwd %%xmm1, %%xmm0;\n"
+			"paddd %%xmm0, %%xmm2;\n"
+			"add $32, %1;\n"
+			"add $16, %2;\n"
+			"dec %3;\n"
+		"jnz 1b;\n"
+		"pshufd $0x4e, %%xmm2, %%xmm0;\n"
+		"paddd %%xmm0, %%xmm2;\n"
+		"pshufd $0xb1, %%xmm2, %%xmm0;\n"
+		"paddd %%xmm0, %%xmm2;\n"
+		"movd %%xmm2, %0;\n"
+		: "=r" (sum), "+r" (coeffs), "+r" (hist), "+r" (blocks)
+		:
+		: "memory", "cc"
+	);
+	return sum;
+}
+
+static inline int __CONVOLVE2_sse2(const short *coeffs, const short *hist, long blocks)
+{
+	int sum;
+	__asm__ __volatile__ (
+		"pxor %%xmm2, %%xmm2;\n"
+		"1:"
+			"movdqu 0(%1), %%xmm0;\n"
+			"movdqu 0(%2), %%xmm1;\n"
+			"pmaddwd %%xmm1, %%xmm0;\n"
+			"paddd %%xmm0, %%xmm2;\n"
+			"add $16, %1;\n"
+			"add $16, %2;\n"
+			"dec %3;\n"
+		"jnz 1b;\n"
+		"pshufd $0x4e, %%xmm2, %%xmm0;\n"
+		"paddd %%xmm0, %%xmm2;\n"
+		"pshufd $0xb1, %%xmm2, %%xmm0;\n"
+		"paddd %%xmm0, %%xmm2;\n"
+		"movd %%xmm2, %0;\n"
+		: "=r" (sum), "+r" (coeffs), "+r" (hist), "+r" (blocks)
+		:
+		: "memory", "cc"
+	);
+	return sum;
+}
+
+/* Four convolutions of the same taps with hist, hist+1, hist+2 and hist+3,
+   so each load of the taps is used four times */
+static inline void __CONVOLVE2_4_sse2(const short *coeffs, const short *hist, long blocks, int *sums)
+{
+	__asm__ __volatile__ (
+		"pxor %%xmm2, %%xmm2;\n"
+		"pxor %%xmm3, %%xmm3;\n"
+		"pxor %%xmm4, %%xmm4;\n"
+		"pxor %%xmm5, %%xmm5;\n"
+		"1:"
+			"movdqu 0(%0), %%xmm0;\n"
+			"movdqu 0(%1), %%xmm1;\n"
+			"pmaddwd %%xmm0, %%xmm1;\n"
+			"paddd %%xmm1, %%xmm2;\n"
+			"movdqu 2(%1), %%xmm1;\n"
+			"pmaddwd %%xmm0, %%xmm1;\n"
+			"paddd %%xmm1, %%xmm3;\n"
+			"movdqu 4(%1), %%xmm1;\n"
+			"pmaddwd %%xmm0, %%xmm1;\n"
+			"paddd %%xmm1, %%xmm4;\n"
+			"movdqu 6(%1), %%xmm1;\n"
+			"pmaddwd %%xmm0, %%xmm1;\n"
+			"paddd %%xmm1, %%xmm5;\n"
+			"add $16, %0;\n"
+			"add $16, %1;\n"
+			"dec %2;\n"
+		"jnz 1b;\n"
+		/* Transpose and add, leaving the four sums in xmm2 */
+		"movdqa %%xmm2, %%xmm0;\n"
+		"punpckldq %%xmm3, %%xmm2;\n"
+		"punpckhdq %%xmm3, %%xmm0;\n"
+		"paddd %%xmm0, %%xmm2;\n"
+		"movdqa %%xmm4, %%xmm0;\n"
+		"punpckldq %%xmm5, %%xmm4;\n"
+		"punpckhdq %%xmm5, %%xmm0;\n"
+		"paddd %%xmm0, %%xmm4;\n"
+		"movdqa %%xmm2, %%xmm0;\n"
+		"punpcklqdq %%xmm4, %%xmm2;\n"
+		"punpckhqdq %%xmm4, %%xmm0;\n"
+		"paddd %%xmm0, %%xmm2;\n"
+		"movdqu %%xmm2, 0(%3);\n"
+		: "+r" (coeffs), "+r" (hist), "+r" (blocks)
+		: "r" (sums)
+		: "memory", "cc"
+	);
+}
+
+#ifdef DAHDI_ARITH_AVX2
+static inline int __CONVOLVE_avx2(const int *coeffs, const short *hist, long blocks)
+{
+	int sum;
+	/* vpackssdw packs within each 128 bit lane, so put the quadwords
+	   back in order with vpermq before multiplying */
+	__asm__ __volatile__ (
+		"vpxor %%ymm2, %%ymm2, %%ymm2;\n"
+		"1:"
+			"vmovdqu  0(%1), %%ymm0;\n"
+			"vmovdqu 32(%1), %%ymm1;\n"
+			"vpsrad $16, %%ymm0, %%ymm0;\n"
+			"vpsrad $16, %%ymm1, %%ymm1;\n"
+			"vpackssdw %%ymm1, %%ymm0, %%ymm0;\n"
+			"vpermq $0xd8, %%ymm0, %%ymm0;\n"
+			"vpmaddwd 0(%2), %%ymm0, %%ymm0;\n"
+			"vpaddd %%ymm0, %%ymm2, %%ymm2;\n"
+			"add $64, %1;\n"
+			"add $32, %2;\n"
+			"dec %3;\n"
+		"jnz 1b;\n"
+		"vextracti128 $1, %%ymm2, %%xmm0;\n"
+		"vpaddd %%xmm0, %%xmm2, %%xmm2;\n"
+		"vpshufd $0x4e, %%xmm2, %%xmm0;\n"
+		"vpaddd %%xmm0, %%xmm2, %%xmm2;\n"
+		"vpshufd $0xb1, %%xmm2, %%xmm0;\n"
+		"vpaddd %%xmm0, %%xmm2, %%xmm2;\n"
+		"vmovd %%xmm2, %0;\n"
+		"vzeroupper;\n"
+		: "=r" (sum), "+r" (coeffs), "+r" (hist), "+r" (blocks)
+		:
+		: "memory", "cc"
+	);
+	return sum;
+}
+
+static inline int __CONVOLVE2_avx2(const short *coeffs, const short *hist, long blocks)
+{
+	int sum;
+	__asm__ __volatile__ (
+		"vpxor %%ymm2, %%ymm2, %%ymm2;\n"
+		"1:"
+			"vmovdqu 0(%1), %%ymm0;\n"
+			"vpmaddwd 0(%2), %%ymm0, %%ymm0;\n"
+			"vpaddd %%ymm0, %%ymm2, %%ymm2;\n"
+			"add $32, %1;\n"
+			"add $32, %2;\n"
+			"dec %3;\n"
+		"jnz 1b;\n"
+		"vextracti128 $1, %%ymm2, %%xmm0;\n"
+		"vpaddd %%xmm0, %%xmm2, %%xmm2;\n"
+		"vpshufd $0x4e, %%xmm2, %%xmm0;\n"
+		"vpaddd %%xmm0, %%xmm2, %%xmm2;\n"
+		"vpshufd $0xb1, %%xmm2, %%xmm0;\n"
+		"vpaddd %%xmm0, %%xmm2, %%xmm2;\n"
+		"vmovd %%xmm2, %0;\n"
+		"vzeroupper;\n"
+		: "=r" (sum), "+r" (coeffs), "+r" (hist), "+r" (blocks)
+		:
+		: "memory", "cc"
+	);
+	return sum;
+}
+
+static inline void __CONVOLVE2_4_avx2(const short *coeffs, const short *hist, long blocks, int *sums)
+{
+	/* The unpacks work within each 128 bit lane, so the lanes are only
+	   added together at the very end */
+	__asm__ __volatile__ (
+		"vpxor %%ymm2, %%ymm2, %%ymm2;\n"
+		"vpxor %%ymm3, %%ymm3, %%ymm3;\n"
+		"vpxor %%ymm4, %%ymm4, %%ymm4;\n"
+		"vpxor %%ymm5, %%ymm5, %%ymm5;\n"
+		"1:"
+			"vmovdqu 0(%0), %%ymm0;\n"
+			"vpmaddwd 0(%1), %%ymm0, %%ymm1;\n"
+			"vpaddd %%ymm1, %%ymm2, %%ymm2;\n"
+			"vpmaddwd 2(%1), %%ymm0, %%ymm1;\n"
+			"vpaddd %%ymm1, %%ymm3, %%ymm3;\n"
+			"vpmaddwd 4(%1), %%ymm0, %%ymm1;\n"
+			"vpaddd %%ymm1, %%ymm4, %%ymm4;\n"
+			"vpmaddwd 6(%1), %%ymm0, %%ymm1;\n"
+			"vpaddd %%ymm1, %%ymm5, %%ymm5;\n"
+			"add $32, %0;\n"
+			"add $32, %1;\n"
+			"dec %2;\n"
+		"jnz 1b;\n"
+		"vpunpckldq %%ymm3, %%ymm2, %%ymm0;\n"
+		"vpunpckhdq %%ymm3, %%ymm2, %%ymm2;\n"
+		"vpaddd %%ymm0, %%ymm2, %%ymm2;\n"
+		"vpunpckldq %%ymm5, %%ymm4, %%ymm0;\n"
+		"vpunpckhdq %%ymm5, %%ymm4, %%ymm4;\n"
+		"vpaddd %%ymm0, %%ymm4, %%ymm4;\n"
+		"vpunpcklqdq %%ymm4, %%ymm2, %%ymm0;\n"
+		"vpunpckhqdq %%ymm4, %%ymm2, %%ymm2;\n"
+		"vpaddd %%ymm0, %%ymm2, %%ymm2;\n"
+		"vextracti128 $1, %%ymm2, %%xmm0;\n"
+		"vpaddd %%xmm0, %%xmm2, %%xmm2;\n"
+		"vmovdqu %%xmm2, 0(%3);\n"
+		"vzeroupper;\n"
+		: "+r" (coeffs), "+r" (hist), "+r" (blocks)
+		: "r" (sums)
+		: "memory", "cc"
+	);
+}
+#endif	/* DAHDI_ARITH_AVX2 */
+#endif	/* CONFIG_DAHDI_SIMD && __x86_64__ */
+
 static inline int CONVOLVE(const int *coeffs, const short *hist, int len)
 {
-	int x;
+	int x = 0;
 	int sum = 0;
-	for (x=0;x<len;x++)
+#ifdef DAHDI_ARITH_SIMD
+	switch (dahdi_simd_active()) {
+#ifdef DAHDI_ARITH_AVX2
+	case DAHDI_SIMD_AVX2:
+		if ((x = len & ~15))
+			sum = __CONVOLVE_avx2(coeffs, hist, x >> 4);
+		break;
+#endif
+	case DAHDI_SIMD_SSE2:
+		if ((x = len & ~7))
+			sum = __CONVOLVE_sse2(coeffs, hist, x >> 3);
+		break;
+	}
+#endif
+	for (;x<len;x++)
 		sum += (coeffs[x] >> 16) * hist[x];
 	return sum;
 }
 
 static inline int CONVOLVE2(const short *coeffs, const short *hist, int len)
 {
-	int x;
+	int x = 0;
 	int sum = 0;
-	for (x=0;x<len;x++)
+#ifdef DAHDI_ARITH_SIMD
+	switch (dahdi_simd_active()) {
+#ifdef DAHDI_ARITH_AVX2
+	case DAHDI_SIMD_AVX2:
+		if ((x = len & ~15))
+			sum = __CONVOLVE2_avx2(coeffs, hist, x >> 4);
+		break;
+#endif
+	case DAHDI_SIMD_SSE2:
+		if ((x = len & ~7))
+			sum = __CONVOLVE2_sse2(coeffs, hist, x >> 3);
+		break;
+	}
+#endif
+	for (;x<len;x++)
 		sum += coeffs[x] * hist[x];
 	return sum;
 }
@@ -361,4 +765,76 @@ static inline short MAX16(const short *y, int len, int *pos)
 }
 
 #endif	/* MMX */
+
+/*
+ * sums[j] = CONVOLVE2(coeffs, hist + j, len) for j = 0 .. n-1, i.e. the
+ * filter output for n consecutive samples of a history laid out newest
+ * first.  The vector versions do four outputs per pass over the taps.
+ */
+static inline void CONVOLVE2_BLOCK(const short *coeffs, const short *hist, int len, int *sums, int n)
+{
+	int j = 0;
+#ifdef DAHDI_ARITH_SIMD
+	int x = 0;
+	int k;
+
+	switch (dahdi_simd_active()) {
+#ifdef DAHDI_ARITH_AVX2
+	case DAHDI_SIMD_AVX2:
+		if ((x = len & ~15))
+			for (; j + 4 <= n; j += 4)
+				__CONVOLVE2_4_avx2(coeffs, hist + j, x >> 4, sums + j);
+		break;
+#endif
+	case DAHDI_SIMD_SSE2:
+		if ((x = len & ~7))
+			for (; j + 4 <= n; j += 4)
+				__CONVOLVE2_4_sse2(coeffs, hist + j, x >> 3, sums + j);
+		break;
+	}
+	for (k = 0; k < j; k++) {
+		int y;
+		for (y = x; y < len; y++)
+			sums[k] += coeffs[y] * hist[k + y];
+	}
+#endif
+	for (; j < n; j++)
+		sums[j] = CONVOLVE2(coeffs, hist + j, len);
+}
+
+#ifdef DAHDI_CHUNKSIZE
+/*
+ * Add (subtract) each of n source chunks into (from) its destination
+ * chunk, in order, with saturation.  With CONFIG_DAHDI_SIMD the whole run
+ * is done in a single vector section; with CONFIG_DAHDI_MMX the caller
+ * has to be in kernel_fpu_begin() already, as for ACSS/SCSS.
+ */
+static inline void ACSS_BATCH(short * const *dst, short * const *src, int n)
+{
+	int x = 0;
+#if defined(DAHDI_ARITH_SIMD) && !(DAHDI_CHUNKSIZE % 8)
+	if (n && dahdi_simd_begin()) {
+		for (; x < n; x++)
+			__ACSS_simd(dst[x], src[x]);
+		dahdi_simd_end();
+	}
+#endif
+	for (; x < n; x++)
+		ACSS(dst[x], src[x]);
+}
+
+static inline void SCSS_BATCH(short * const *dst, short * const *src, int n)
+{
+	int x = 0;
+#if defined(DAHDI_ARITH_SIMD) && !(DAHDI_CHUNKSIZE % 8)
+	if (n && dahdi_simd_begin()) {
+		for (; x < n; x++)
+			__SCSS_simd(dst[x], src[x]);
+		dahdi_simd_end();
+	}
+#endif
+	for (; x < n; x++)
+		SCSS(dst[x], src[x]);
+}
+#endif	/* DAHDI_CHUNKSIZE */
 #endif	/* _DAHDI_ARITH_H */
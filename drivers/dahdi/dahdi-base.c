@@ -46,20 +46,22 @@
 #include <linux/version.h>
 #include <linux/ctype.h>
 #include <linux/kmod.h>
+#include <linux/file.h>
 #include <linux/moduleparam.h>
 
-#ifdef CONFIG_DAHDI_NET
+/* Always needed: net and PPP frames are queued as skbs */
 #include <linux/netdevice.h>
-#endif /* CONFIG_DAHDI_NET */
 
 #include <linux/ppp_defs.h>
 #ifdef CONFIG_DAHDI_PPP
-#include <linux/netdevice.h>
 #include <linux/if.h>
 #include <linux/if_ppp.h>
 #endif
 
 #include <asm/atomic.h>
+#include <linux/mm.h>
+#include <linux/page-flags.h>
+#include <asm/io.h>
 
 #ifndef CONFIG_OLD_HDLC_API
 #define NEW_HDLC_INTERFACE
@@ -85,7 +87,7 @@
 
 /* Get helper arithmetic */
 #include "arith.h"
-#if defined(CONFIG_DAHDI_MMX) || defined(ECHO_CAN_FP)
+#ifdef CONFIG_DAHDI_MMX
 #include <asm/i387.h>
 #endif
 
@@ -133,13 +135,17 @@ EXPORT_SYMBOL(dahdi_alarm_notify);
 EXPORT_SYMBOL(dahdi_set_dynamic_ioctl);
 EXPORT_SYMBOL(dahdi_ec_chunk);
 EXPORT_SYMBOL(dahdi_ec_span);
+EXPORT_SYMBOL(dahdi_ec_receive);
 EXPORT_SYMBOL(dahdi_hdlc_abort);
 EXPORT_SYMBOL(dahdi_hdlc_finish);
 EXPORT_SYMBOL(dahdi_hdlc_getbuf);
 EXPORT_SYMBOL(dahdi_hdlc_putbuf);
+EXPORT_SYMBOL(dahdi_fcs);
 EXPORT_SYMBOL(dahdi_alarm_channel);
 EXPORT_SYMBOL(dahdi_register_chardev);
 EXPORT_SYMBOL(dahdi_unregister_chardev);
+EXPORT_SYMBOL(dahdi_register_echocan);
+EXPORT_SYMBOL(dahdi_unregister_echocan);
 
 #ifdef CONFIG_PROC_FS
 static struct proc_dir_entry *proc_entries[DAHDI_MAX_SPANS]; 
@@ -190,6 +196,10 @@ static sumtype sums[(DAHDI_MAX_CONF + 1) * 3];
 static short confalias[DAHDI_MAX_CONF + 1];
 static short confrev[DAHDI_MAX_CONF + 1];
 
+/* Conference aliases currently in use.  Only these can have anything summed
+   into them, so they are the only sums rotate_sums() has to clear. */
+static DECLARE_BITMAP(active_confs, DAHDI_MAX_CONF + 1);
+
 static sumtype *conf_sums_next;
 static sumtype *conf_sums;
 static sumtype *conf_sums_prev;
@@ -204,6 +214,65 @@ static struct
 	int	dst;	/* dst conf number */
 } conf_links[DAHDI_MAX_CONF + 1];
 
+/* Channels the master tick has to service: every pseudo channel, and every
+   real channel with a conference mode set.  Protected by active_lock. */
+static LIST_HEAD(active_pseudo_chans);
+static LIST_HEAD(active_conf_chans);
+
+/* Indexes of the conf_links[] entries in use, kept by recalc_maxlinks() */
+static short active_links[DAHDI_MAX_CONF + 1];
+static int nactive_links;
+
+/* The sums each active link adds up this tick, handed to ACSS_BATCH() */
+static short *link_dst[DAHDI_MAX_CONF + 1];
+static short *link_src[DAHDI_MAX_CONF + 1];
+
+#ifdef CONFIG_DAHDI_CONF_SHARDS
+#include <linux/workqueue.h>
+
+/* With conference shards, the pseudo/conferenced channel work of the
+master tick (steps 3 to 6 below, plus the conference receives of step 1 for
+the following chunk) is partitioned by conference and run in parallel, one
+shard per CPU.  Conferences joined by a conference link are always put into
+the same shard, so the only step that still needs every shard to be done is
+rotate_sums(), and the master tick does that before kicking the next pass.
+If the previous pass is not done yet, the tick is owed and the last shard to
+finish rotates the sums and kicks the late pass itself. */
+#define DAHDI_MAX_CONF_SHARDS	16
+
+struct dahdi_conf_shard {
+	struct work_struct work;
+	int cpu;
+	int pseudo_start;	/* Range in conf_shard_pseudo[] */
+	int pseudo_end;
+	int real_start;		/* Range in conf_shard_real[] */
+	int real_end;
+	int link_start;		/* Range in conf_shard_link[] */
+	int link_end;
+};
+
+static struct dahdi_conf_shard conf_shards[DAHDI_MAX_CONF_SHARDS];
+static int conf_nshards;
+static struct workqueue_struct *conf_shard_wq;
+static atomic_t conf_shards_pending = ATOMIC_INIT(0);
+static unsigned int conf_shard_overruns;
+/* Passes whose tick came while the previous pass was still running.  The
+   last shard of that pass runs them late.  Protected by bigzaplock. */
+static int conf_shard_owed;
+#define DAHDI_CONF_SHARD_MAXOWED	4
+
+/* Work lists of the pass in progress, rebuilt by the master tick */
+static struct dahdi_chan *conf_shard_pseudo[DAHDI_MAX_CHANNELS];
+static struct dahdi_chan *conf_shard_real[DAHDI_MAX_CHANNELS];
+static short conf_shard_link[DAHDI_MAX_CONF + 1];
+static struct dahdi_chan *conf_shard_tmp[DAHDI_MAX_CHANNELS];
+static signed char conf_shard_tmpkey[DAHDI_MAX_CHANNELS];
+
+/* Lowest conference number linked (directly or not) with each conference */
+static short conf_group[DAHDI_MAX_CONF + 1];
+static int conf_groups_dirty = 1;
+#endif
+
 
 /* There are three sets of conference sum accumulators. One for the current
 sample chunk (conf_sums), one for the next sample chunk (conf_sums_next), and
@@ -259,25 +328,85 @@ static struct dahdi_dialparams global_dialparams = {
 
 static int dahdi_chan_ioctl(struct inode *inode, struct file *file, unsigned int cmd, unsigned long data, int unit);
 
-#if defined(CONFIG_DAHDI_MMX) || defined(ECHO_CAN_FP)
+#ifdef CONFIG_DAHDI_MMX
 #define dahdi_kernel_fpu_begin kernel_fpu_begin
 #endif	
 
-static struct dahdi_timer {
-	int ms;			/* Countdown */
-	int pos;		/* Position */
+#ifdef DAHDI_ARITH_SIMD
+/* Vector instructions arith.h may use, whether each CPU is in a
+   dahdi_simd_begin() section right now, and the interrupt context the
+   section began in */
+int dahdi_simd = DAHDI_SIMD_NONE;
+DEFINE_PER_CPU(int, dahdi_simd_on);
+DEFINE_PER_CPU(unsigned long, dahdi_simd_ctx);
+EXPORT_SYMBOL(dahdi_simd);
+EXPORT_PER_CPU_SYMBOL(dahdi_simd_on);
+EXPORT_PER_CPU_SYMBOL(dahdi_simd_ctx);
+
+static void dahdi_simd_init(void)
+{
+#ifdef DAHDI_ARITH_AVX2
+	if (boot_cpu_has(X86_FEATURE_AVX) && boot_cpu_has(X86_FEATURE_AVX2)) {
+		dahdi_simd = DAHDI_SIMD_AVX2;
+		printk(KERN_INFO "DAHDI: Using AVX2 chunk arithmetic\n");
+		return;
+	}
+#endif
+	if (boot_cpu_has(X86_FEATURE_XMM2)) {
+		dahdi_simd = DAHDI_SIMD_SSE2;
+		printk(KERN_INFO "DAHDI: Using SSE2 chunk arithmetic\n");
+	}
+}
+#endif
+
+/* Armed timers are grouped by period and next expiry, and the groups
+   hang off a hashed timing wheel, in the slot of the tick they next trip
+   on.  Each tick only looks at the groups in one slot, and bumps one
+   counter per group rather than one per timer.  The wake ups themselves
+   are left to timer_tasklet, out of the master tick, which does them
+   without zaptimerlock, holding a reference to each timer instead. */
+#define DAHDI_TIMER_WHEEL	256	/* Slots, must be a power of two */
+
+struct dahdi_timer_group {
+	int period;		/* Period, in ticks */
+	unsigned long expires;	/* Tick we next trip on */
+	unsigned long trips;	/* Times we have tripped */
+	int count;		/* Timers in the group */
+	struct list_head list;	/* Wheel slot */
+	struct list_head timers;	/* Our timers */
+	struct list_head pending;	/* On timer_pending, if waiting for a wake up */
+};
+
+struct dahdi_timer {
+	atomic_t refcount;	/* The file, and timer_tasklet while waking us */
+	int ms;			/* Period, in samples */
 	int ping;		/* Whether we've been ping'd */
 	int tripped;	/* Whether we're tripped */
-	struct dahdi_timer *next;	/* Linked list */
+	struct dahdi_timer_group *group;	/* NULL if not armed */
+	unsigned long gtrips;	/* group->trips already counted in tripped */
+	struct list_head list;	/* Group membership */
+	struct list_head wake;	/* On the wake list of timer_tasklet */
 	wait_queue_head_t sel;
-} *zaptimers = NULL;
+};
+
+static struct list_head timer_wheel[DAHDI_TIMER_WHEEL];
+static LIST_HEAD(timer_pending);
+static unsigned long timer_ticks;
+static int timer_count;			/* Open timers */
+static int timer_armed;			/* Timers in a group */
+static int timer_groups;		/* Groups on the wheel */
+static unsigned long timer_expirations;	/* Total timer trips */
+static unsigned long timer_lastexp;	/* timer_expirations a second ago */
+static unsigned int timer_rate;		/* Timer trips in the last second */
 
 #ifdef DEFINE_SPINLOCK
 static DEFINE_SPINLOCK(zaptimerlock);
 static DEFINE_SPINLOCK(bigzaplock);
+static DEFINE_SPINLOCK(active_lock);
 #else
 static spinlock_t zaptimerlock = SPIN_LOCK_UNLOCKED;
 static spinlock_t bigzaplock = SPIN_LOCK_UNLOCKED;
+static spinlock_t active_lock = SPIN_LOCK_UNLOCKED;
 #endif
 
 struct dahdi_zone {
@@ -319,6 +448,32 @@ u_char __dahdi_lin2a[16384];
 
 static u_char defgain[256];
 
+/* Work out which audio stages a channel needs; called with chan->lock
+   held whenever its echo canceller, gains, law, conference mode or rx
+   tone detection change */
+static void dahdi_pipeline_update(struct dahdi_chan *chan)
+{
+	int pipeline = 0;
+	int x;
+
+	if (chan->ec)
+		pipeline |= DAHDI_PIPE_EC;
+	if ((chan->rxgain != defgain) || (chan->txgain != defgain))
+		pipeline |= DAHDI_PIPE_GAIN;
+	/* Custom gains carry room for the composite table after them */
+	if (chan->gainalloc) {
+		chan->rxgainlin = (short *)(chan->rxgain + 512);
+		for (x = 0; x < 256; x++)
+			chan->rxgainlin[x] = chan->xlaw[chan->rxgain[x]];
+	} else
+		chan->rxgainlin = chan->xlaw;
+	if (chan->confmode & DAHDI_CONF_MODE_MASK)
+		pipeline |= DAHDI_PIPE_CONF;
+	if (chan->rxp1 && chan->rxp2 && chan->rxp3)
+		pipeline |= DAHDI_PIPE_RXTONE;
+	chan->pipeline = pipeline;
+}
+
 #ifdef DEFINE_RWLOCK
 static DEFINE_RWLOCK(zone_lock);
 static DEFINE_RWLOCK(chan_lock);
@@ -327,35 +482,165 @@ static rwlock_t zone_lock = RW_LOCK_UNLOCKED;
 static rwlock_t chan_lock = RW_LOCK_UNLOCKED;
 #endif
 
+#ifdef CONFIG_DAHDI_CONF_SHARDS
+/* Held for reading by running conference shards.  Anything changing the
+   conference setup takes it for writing, before bigzaplock: the shards run
+   with interrupts enabled, so a master tick may interrupt a reader and spin
+   on bigzaplock. */
+#ifdef DEFINE_RWLOCK
+static DEFINE_RWLOCK(conf_shard_lock);
+#else
+static rwlock_t conf_shard_lock = RW_LOCK_UNLOCKED;
+#endif
+#endif
+
 static struct dahdi_zone *tone_zones[DAHDI_TONE_ZONE_MAX];
 
 #define NUM_SIGS	10	
 
 
-/* Echo cancellation */
+/* Echo cancellation.  The software echo cancellers are modules of their
+   own (dahdi_echocan_*.c) that register with dahdi_register_echocan(),
+   except for HPEC which is linked into this one. */
 #if defined(ECHO_CAN_HPEC)
 #include "hpec/hpec_dahdi.h"
+#endif
+
+/* The canceller used on channels that have none attached */
+#if defined(ECHO_CAN_HPEC)
+#define DEFAULT_ECHOCAN "hpec"
 #elif defined(ECHO_CAN_STEVE)
-#include "sec.h"
+#define DEFAULT_ECHOCAN "sec"
 #elif defined(ECHO_CAN_STEVE2)
-#include "sec-2.h"
+#define DEFAULT_ECHOCAN "sec2"
 #elif defined(ECHO_CAN_KB1)
-#include "kb1ec.h"
+#define DEFAULT_ECHOCAN "kb1"
 #elif defined(ECHO_CAN_MG2)
-#include "mg2ec.h"
+#define DEFAULT_ECHOCAN "mg2"
 #elif defined(ECHO_CAN_JP1)
-#include "jpah.h"
+#define DEFAULT_ECHOCAN "jpah"
+#else
+#define DEFAULT_ECHOCAN ""
+#endif
+
+static char *default_echocan = DEFAULT_ECHOCAN;
+
+static LIST_HEAD(ecfactory_list);
+#ifdef DEFINE_RWLOCK
+static DEFINE_RWLOCK(ecfactory_list_lock);
+#else
+static rwlock_t ecfactory_list_lock = RW_LOCK_UNLOCKED;
+#endif
+
+int dahdi_register_echocan(struct dahdi_echocan *ec)
+{
+	struct dahdi_echocan *cur;
+
+	write_lock(&ecfactory_list_lock);
+	list_for_each_entry(cur, &ecfactory_list, list) {
+		if (!strcmp(cur->name, ec->name)) {
+			write_unlock(&ecfactory_list_lock);
+			printk(KERN_ERR "DAHDI: Echo canceller '%s' is already registered\n", ec->name);
+			return -EBUSY;
+		}
+	}
+	list_add_tail(&ec->list, &ecfactory_list);
+	write_unlock(&ecfactory_list_lock);
+
+	return 0;
+}
+
+void dahdi_unregister_echocan(struct dahdi_echocan *ec)
+{
+	write_lock(&ecfactory_list_lock);
+	list_del(&ec->list);
+	write_unlock(&ecfactory_list_lock);
+}
+
+/* Look up a registered canceller (the first one, for an empty name) and
+   take a reference on its module */
+static struct dahdi_echocan *find_echocan(const char *name)
+{
+	struct dahdi_echocan *cur, *ec = NULL;
+
+	read_lock(&ecfactory_list_lock);
+	list_for_each_entry(cur, &ecfactory_list, list) {
+		if (!name[0] || !strcmp(cur->name, name)) {
+			if (try_module_get(cur->owner))
+				ec = cur;
+			break;
+		}
+	}
+	read_unlock(&ecfactory_list_lock);
+
+	return ec;
+}
+
+/* The canceller to create for a channel that asked for "name", loading
+   its module if it is not there yet */
+static struct dahdi_echocan *dahdi_get_echocan(const char *name)
+{
+	struct dahdi_echocan *ec;
+
+	if (!name[0] && default_echocan)
+		name = default_echocan;
+	if ((ec = find_echocan(name)))
+		return ec;
+	if (name[0]) {
+		request_module("dahdi_echocan_%s", name);
+		ec = find_echocan(name);
+	}
+	return ec;
+}
+
+/* Free a canceller taken off a channel, and drop its module reference */
+static void dahdi_echocan_free(struct dahdi_echocan *ecf, struct echo_can_state *ec)
+{
+	ecf->echo_can_free(ec);
+	module_put(ecf->owner);
+}
+
+/* Names of the registered cancellers, for DAHDI_GETVERSION */
+static void dahdi_echocan_identify(char *buf, size_t len)
+{
+	struct dahdi_echocan *cur;
+	size_t used = 0;
+
+	buf[0] = '\0';
+	read_lock(&ecfactory_list_lock);
+	list_for_each_entry(cur, &ecfactory_list, list) {
+		used += snprintf(buf + used, len - used, "%s%s", used ? " " : "", cur->name);
+		if (used >= len)
+			break;
+	}
+	read_unlock(&ecfactory_list_lock);
+}
+
+#if defined(ECHO_CAN_HPEC)
+static struct dahdi_echocan hpec_echocan = {
+	.name = "hpec",
+	.owner = THIS_MODULE,
+	.echo_can_create = echo_can_create,
+	.echo_can_free = echo_can_free,
+	.echo_can_array_update = echo_can_array_update,
+	.echo_can_traintap = echo_can_traintap,
+};
 #endif
 
 static inline void rotate_sums(void)
 {
 	/* Rotate where we sum and so forth */
 	static int pos = 0;
+	int x;
 	conf_sums_prev = sums + (DAHDI_MAX_CONF + 1) * pos;
 	conf_sums = sums + (DAHDI_MAX_CONF + 1) * ((pos + 1) % 3);
 	conf_sums_next = sums + (DAHDI_MAX_CONF + 1) * ((pos + 2) % 3);
 	pos = (pos + 1) % 3;
-	memset(conf_sums_next, 0, maxconfs * sizeof(sumtype));
+	/* Alias 0 is where a conferenced channel without a conference sums */
+	memset(conf_sums_next[0], 0, sizeof(sumtype));
+	for (x = find_first_bit(active_confs, maxconfs); x < maxconfs;
+	     x = find_next_bit(active_confs, maxconfs, x + 1))
+		memset(conf_sums_next[x], 0, sizeof(sumtype));
 }
 
   /* return quiescent (idle) signalling states, for the various signalling types */
@@ -523,6 +808,9 @@ static int dahdi_proc_read(char *page, char **start, off_t off, int count, int *
 		len += sprintf(page + len, "\tIRQ misses: %d\n", spans[span]->irqmisses);
 	if (spans[span]->timingslips)
 		len += sprintf(page + len, "\tTiming slips: %d\n", spans[span]->timingslips);
+	if (spans[span]->fastchunks || spans[span]->slowchunks)
+		len += sprintf(page + len, "\tAudio chunks: %u copied, %u processed\n",
+			spans[span]->fastchunks, spans[span]->slowchunks);
 	len += sprintf(page + len, "\n");
 
 
@@ -596,6 +884,11 @@ static void recalc_maxconfs(void)
 static void recalc_maxlinks(void)
 {
 	int x;
+	nactive_links = 0;
+	for (x=1;x<=DAHDI_MAX_CONF;x++) {
+		if (conf_links[x].src && conf_links[x].dst)
+			active_links[nactive_links++] = x;
+	}
 	for (x=DAHDI_MAX_CONF-1;x>0;x--) {
 		if (conf_links[x].src || conf_links[x].dst) {
 			maxlinks = x+1;
@@ -605,6 +898,27 @@ static void recalc_maxlinks(void)
 	maxlinks = 0;
 }
 
+/* Put a channel on the master tick list it belongs on, or take it off.
+   Must not be called with any channel lock held. */
+static void dahdi_update_active(struct dahdi_chan *chan)
+{
+	struct list_head *want = NULL;
+	unsigned long flags;
+
+	spin_lock_irqsave(&active_lock, flags);
+	if ((chan->channo > 0) && (chans[chan->channo] == chan)) {
+		if (chan->flags & DAHDI_FLAG_PSEUDO)
+			want = &active_pseudo_chans;
+		else if (chan->confmode)
+			want = &active_conf_chans;
+	}
+	if (!want)
+		list_del_init(&chan->active_node);
+	else if (list_empty(&chan->active_node))
+		list_add_tail(&chan->active_node, want);
+	spin_unlock_irqrestore(&active_lock, flags);
+}
+
 static int dahdi_first_empty_conference(void)
 {
 	/* Find the first conference which has no alias */
@@ -627,6 +941,14 @@ static int dahdi_get_conf_alias(int x)
 	a = dahdi_first_empty_alias();
 	confalias[x] = a;
 	confrev[a] = x;
+	if (a > 0) {
+		/* Sums of unused aliases are not cleared by rotate_sums(), so
+		   start this one off clean in all three sets */
+		memset(sums[a], 0, sizeof(sumtype));
+		memset(sums[(DAHDI_MAX_CONF + 1) + a], 0, sizeof(sumtype));
+		memset(sums[(DAHDI_MAX_CONF + 1) * 2 + a], 0, sizeof(sumtype));
+		set_bit(a, active_confs);
+	}
 
 	/* Highest conference may have changed */
 	recalc_maxconfs();
@@ -653,6 +975,7 @@ static void dahdi_check_conf(int x)
 	}
 	/* If we get here, nobody is in the conference anymore.  Clear it out
 	   both forward and reverse */
+	clear_bit(confalias[x], active_confs);
 	confrev[confalias[x]] = 0;
 	confalias[x] = 0;
 
@@ -660,6 +983,27 @@ static void dahdi_check_conf(int x)
 	recalc_maxconfs();
 }
 
+#ifdef CONFIG_PROC_FS
+static int dahdi_conf_proc_read(char *page, char **start, off_t off, int count, int *eof, void *data)
+{
+	int len = 0;
+
+	len += sprintf(page + len, "Conferences: %d active, highest %d\n",
+		bitmap_weight(active_confs, DAHDI_MAX_CONF + 1), maxconfs);
+	len += sprintf(page + len, "Links: %d active, highest %d\n",
+		nactive_links, maxlinks);
+	if (len <= off) {
+		*eof = 1;
+		return 0;
+	}
+	*start = page + off;
+	len -= off;
+	if (len > count) len = count;
+	else *eof = 1;
+	return len;
+}
+#endif
+
 /* enqueue an event on a channel */
 static void __qevent(struct dahdi_chan *chan, int event)
 {
@@ -709,23 +1053,107 @@ static int schluffen(wait_queue_head_t *q)
 	return(0);
 }
 
+/* CRC-16/CCITT as used for the HDLC FCS, slicing-by-8: dahdi_fcstab[0] is
+   the usual byte table, and dahdi_fcstab[n] advances a byte's CRC over n
+   more zero bytes, so eight bytes fold in with eight lookups and no
+   dependency between them */
+static u16 dahdi_fcstab[8][256];
+
+static void __init dahdi_fcs_init(void)
+{
+	unsigned int c;
+	int x, y;
+
+	for (x = 0; x < 256; x++) {
+		c = x;
+		for (y = 0; y < 8; y++)
+			c = (c & 1) ? (c >> 1) ^ 0x8408 : (c >> 1);
+		dahdi_fcstab[0][x] = c;
+	}
+	for (y = 1; y < 8; y++) {
+		for (x = 0; x < 256; x++) {
+			c = dahdi_fcstab[y - 1][x];
+			dahdi_fcstab[y][x] = (c >> 8) ^ dahdi_fcstab[0][c & 0xff];
+		}
+	}
+}
+
+/* Same as running PPP_FCS() over each byte in turn */
+unsigned int dahdi_fcs(unsigned int fcs, const unsigned char *data, int len)
+{
+	fcs &= 0xffff;
+	while (len >= 8) {
+		fcs = dahdi_fcstab[7][(fcs ^ data[0]) & 0xff] ^
+			dahdi_fcstab[6][((fcs >> 8) ^ data[1]) & 0xff] ^
+			dahdi_fcstab[5][data[2]] ^ dahdi_fcstab[4][data[3]] ^
+			dahdi_fcstab[3][data[4]] ^ dahdi_fcstab[2][data[5]] ^
+			dahdi_fcstab[1][data[6]] ^ dahdi_fcstab[0][data[7]];
+		data += 8;
+		len -= 8;
+	}
+	while (len-- > 0)
+		fcs = (fcs >> 8) ^ dahdi_fcstab[0][(fcs ^ *data++) & 0xff];
+	return fcs;
+}
+
 static inline void calc_fcs(struct dahdi_chan *ss, int inwritebuf)
 {
-	int x;
-	unsigned int fcs=PPP_INITFCS;
+	unsigned int fcs;
 	unsigned char *data = ss->writebuf[inwritebuf];
 	int len = ss->writen[inwritebuf];
 	/* Not enough space to do FCS calculation */
 	if (len < 2)
 		return;
-	for (x=0;x<len-2;x++)
-		fcs = PPP_FCS(fcs, data[x]);
+	fcs = dahdi_fcs(PPP_INITFCS, data, len - 2);
 	fcs ^= 0xffff;
 	/* Send out the FCS */
 	data[len-2] = (fcs & 0xff);
 	data[len-1] = (fcs >> 8) & 0xff;
 }
 
+/* Drop any net/PPP frames still waiting to go out.  Called with
+   chan->lock held, or before the channel is in use */
+static void __dahdi_free_writeskbs(struct dahdi_chan *chan)
+{
+	int x;
+
+	for (x = 0; x < DAHDI_MAX_NUM_BUFS; x++) {
+		if (chan->writeskb[x]) {
+			dev_kfree_skb_any(chan->writeskb[x]);
+			chan->writeskb[x] = NULL;
+		}
+	}
+}
+
+/* Queue skb as the frame in write buffer oldbuf instead of copying it
+   there.  Only the FCS goes in writebuf, and the transmit side moves on
+   to it once it has run off the end of the skb.  Our net devices don't
+   do scatter/gather, so skb->data holds the whole frame.  Called with
+   ss->lock held */
+static void __dahdi_queue_writeskb(struct dahdi_chan *ss, int oldbuf, struct sk_buff *skb)
+{
+	unsigned int fcs;
+
+	fcs = dahdi_fcs(PPP_INITFCS, skb->data, skb->len);
+	/* Invert it */
+	fcs ^= 0xffff;
+	/* Send it out LSB first */
+	ss->writebuf[oldbuf][0] = (fcs & 0xff);
+	ss->writebuf[oldbuf][1] = (fcs >> 8) & 0xff;
+	ss->writeskb[oldbuf] = skb;
+	ss->writen[oldbuf] = skb->len + 2;
+	ss->writeidx[oldbuf] = 0;
+}
+
+/* Done with write buffer buf.  Called with ms->lock held */
+static inline void __dahdi_free_writeskb(struct dahdi_chan *ms, int buf)
+{
+	if (ms->writeskb[buf]) {
+		dev_kfree_skb_any(ms->writeskb[buf]);
+		ms->writeskb[buf] = NULL;
+	}
+}
+
 static int dahdi_reallocbufs(struct dahdi_chan *ss, int j, int numbufs)
 {
 	unsigned char *newbuf, *oldbuf;
@@ -750,6 +1178,7 @@ static int dahdi_reallocbufs(struct dahdi_chan *ss, int j, int numbufs)
 	ss->blocksize = j; /* set the blocksize */
 	oldbuf = ss->readbuf[0]; /* Keep track of the old buffer */
 	ss->readbuf[0] = NULL;
+	__dahdi_free_writeskbs(ss);
 	if (newbuf) {
 		for (x=0;x<numbufs;x++) {
 			ss->readbuf[x] = newbuf + x * j;
@@ -768,17 +1197,10 @@ static int dahdi_reallocbufs(struct dahdi_chan *ss, int j, int numbufs)
 		ss->readn[x]=
 		ss->readidx[x] = 0;
 	
-	/* Keep track of where our data goes (if it goes
-	   anywhere at all) */
-	if (newbuf) {
-		ss->inreadbuf = 0;
-		ss->inwritebuf = 0;
-	} else {
-		ss->inreadbuf = -1;
-		ss->inwritebuf = -1;
-	}
-	ss->outreadbuf = -1;
-	ss->outwritebuf = -1;
+	/* Start both rings empty.  Without buffers, dahdi_inreadbuf() and
+	   dahdi_inwritebuf() say there is nowhere for data to go */
+	ss->readhead = ss->readtail = 0;
+	ss->writehead = ss->writetail = 0;
 	ss->numbufs = numbufs;
 	if (ss->txbufpolicy == DAHDI_POLICY_WHEN_FULL)
 		ss->txdisable = 1;
@@ -796,6 +1218,20 @@ static int dahdi_reallocbufs(struct dahdi_chan *ss, int j, int numbufs)
 	return 0;
 }
 
+/* dahdi_reallocbufs() on a channel that may be open, where read(),
+   write() and their vector versions don't take chan->lock */
+static int dahdi_resizebufs(struct dahdi_chan *ss, int j, int numbufs)
+{
+	int res;
+
+	down(&ss->readsem);
+	down(&ss->writesem);
+	res = dahdi_reallocbufs(ss, j, numbufs);
+	up(&ss->writesem);
+	up(&ss->readsem);
+	return res;
+}
+
 static int dahdi_hangup(struct dahdi_chan *chan);
 static void dahdi_set_law(struct dahdi_chan *chan, int law);
 
@@ -914,6 +1350,108 @@ static void reset_conf(struct dahdi_chan *chan)
 }
 
 
+/* The rings a channel shares with userspace through mmap().  The channel
+   holds one reference while the rings are in use, and every mapping of
+   them holds another, so that they outlive a channel closed or
+   unregistered under a process that still has them mapped.  When the last
+   mapping goes away the rings are detached from the channel too. */
+struct dahdi_mmap_area {
+	atomic_t refcount;
+	atomic_t mappings;
+	/* The channel using the rings, protected by dahdi_mmap_lock */
+	struct dahdi_chan *chan;
+	struct dahdi_mmap_header *hdr;
+	/* Our own copies of the indices we move; the ones in hdr
+	   are only for userspace to look at */
+	unsigned int rxhead;
+	unsigned int txtail;
+};
+
+#ifdef DEFINE_SPINLOCK
+static DEFINE_SPINLOCK(dahdi_mmap_lock);
+#else
+static spinlock_t dahdi_mmap_lock = SPIN_LOCK_UNLOCKED;
+#endif
+
+static struct dahdi_mmap_area *dahdi_mmap_alloc(void)
+{
+	struct dahdi_mmap_area *area;
+	struct dahdi_mmap_header *hdr;
+	struct page *page;
+
+	if (!(area = kmalloc(sizeof(*area), GFP_KERNEL)))
+		return NULL;
+	hdr = (struct dahdi_mmap_header *) __get_free_pages(GFP_KERNEL, get_order(sizeof(*hdr)));
+	if (!hdr) {
+		kfree(area);
+		return NULL;
+	}
+	memset(area, 0, sizeof(*area));
+	memset(hdr, 0, sizeof(*hdr));
+	atomic_set(&area->refcount, 1);
+	area->hdr = hdr;
+	hdr->magic = DAHDI_MMAP_MAGIC;
+	hdr->ringsize = DAHDI_MMAP_RINGSIZE;
+	hdr->rxthreshold = DAHDI_MMAP_THRESHOLD;
+	hdr->txthreshold = DAHDI_MMAP_THRESHOLD;
+	for (page = virt_to_page(hdr);
+	     page < virt_to_page((unsigned long) hdr + PAGE_ALIGN(sizeof(*hdr)));
+	     page++)
+		SetPageReserved(page);
+	return area;
+}
+
+static void dahdi_mmap_put(struct dahdi_mmap_area *area)
+{
+	struct dahdi_mmap_header *hdr;
+	struct page *page;
+
+	if (!area || !atomic_dec_and_test(&area->refcount))
+		return;
+	hdr = area->hdr;
+	for (page = virt_to_page(hdr);
+	     page < virt_to_page((unsigned long) hdr + PAGE_ALIGN(sizeof(*hdr)));
+	     page++)
+		ClearPageReserved(page);
+	free_pages((unsigned long) hdr, get_order(sizeof(*hdr)));
+	kfree(area);
+}
+
+/* The channel is done with the rings, don't let the mappings find it */
+static void dahdi_mmap_orphan(struct dahdi_mmap_area *area)
+{
+	spin_lock(&dahdi_mmap_lock);
+	area->chan = NULL;
+	spin_unlock(&dahdi_mmap_lock);
+}
+
+/* Drop the reference of a mapping, and take the rings away from the
+   channel if it was the last one */
+static void dahdi_mmap_unmap(struct dahdi_mmap_area *area)
+{
+	struct dahdi_chan *chan;
+	unsigned long flags;
+	int detach = 0;
+
+	if (atomic_dec_and_test(&area->mappings)) {
+		spin_lock(&dahdi_mmap_lock);
+		if ((chan = area->chan)) {
+			spin_lock_irqsave(&chan->lock, flags);
+			/* Unless it got mapped again meanwhile */
+			if ((chan->mmap == area) && !atomic_read(&area->mappings)) {
+				chan->mmap = NULL;
+				area->chan = NULL;
+				detach = 1;
+			}
+			spin_unlock_irqrestore(&chan->lock, flags);
+		}
+		spin_unlock(&dahdi_mmap_lock);
+		if (detach)
+			dahdi_mmap_put(area);
+	}
+	dahdi_mmap_put(area);
+}
+
 static inline int hw_echocancel_off(struct dahdi_chan *chan)
 {
 	struct dahdi_echocanparams ecp;
@@ -935,8 +1473,10 @@ static void close_channel(struct dahdi_chan *chan)
 	unsigned long flags;
 	void *rxgain = NULL;
 	struct echo_can_state *ec = NULL;
+	struct dahdi_echocan *ecf = NULL;
 	int oldconf;
 	short *readchunkpreec;
+	struct dahdi_mmap_area *mmap;
 #ifdef CONFIG_DAHDI_PPP
 	struct ppp_channel *ppp;
 #endif
@@ -945,12 +1485,17 @@ static void close_channel(struct dahdi_chan *chan)
 	if (!(chan->flags & DAHDI_FLAG_NOSTDTXRX))
 		dahdi_reallocbufs(chan, 0, 0); 
 	spin_lock_irqsave(&chan->lock, flags);
+	__dahdi_free_writeskbs(chan);
+	mmap = chan->mmap;
+	chan->mmap = NULL;
 #ifdef CONFIG_DAHDI_PPP
 	ppp = chan->ppp;
 	chan->ppp = NULL;
 #endif
 	ec = chan->ec;
 	chan->ec = NULL;
+	ecf = chan->ec_factory;
+	chan->ec_factory = NULL;
 	readchunkpreec = chan->readchunkpreec;
 	chan->readchunkpreec = NULL;
 	chan->curtone = NULL;
@@ -995,6 +1540,7 @@ static void close_channel(struct dahdi_chan *chan)
 	chan->rxgain = defgain;
 	chan->txgain = defgain;
 	chan->gainalloc = 0;
+	dahdi_pipeline_update(chan);
 	chan->eventinidx = chan->eventoutidx = 0;
 	chan->flags &= ~(DAHDI_FLAG_LOOPED | DAHDI_FLAG_LINEAR | DAHDI_FLAG_PPP | DAHDI_FLAG_SIGFREEZE);
 
@@ -1009,14 +1555,20 @@ static void close_channel(struct dahdi_chan *chan)
 
 	spin_unlock_irqrestore(&chan->lock, flags);
 
+	dahdi_update_active(chan);
+
 	hw_echocancel_off(chan);
 
 	if (rxgain)
 		kfree(rxgain);
 	if (ec)
-		echo_can_free(ec);
+		dahdi_echocan_free(ecf, ec);
 	if (readchunkpreec)
 		kfree(readchunkpreec);
+	if (mmap) {
+		dahdi_mmap_orphan(mmap);
+		dahdi_mmap_put(mmap);
+	}
 
 #ifdef CONFIG_DAHDI_PPP
 	if (ppp) {
@@ -1241,6 +1793,7 @@ static void dahdi_set_law(struct dahdi_chan *chan, int law)
 		chan->lin2x = __dahdi_lin2mu;
 #endif
 	}
+	dahdi_pipeline_update(chan);
 }
 
 static int dahdi_chan_reg(struct dahdi_chan *chan)
@@ -1253,6 +1806,9 @@ static int dahdi_chan_reg(struct dahdi_chan *chan)
 	for (x=1;x<DAHDI_MAX_CHANNELS;x++) {
 		if (!chans[x]) {
 			spin_lock_init(&chan->lock);
+			sema_init(&chan->readsem, 1);
+			sema_init(&chan->writesem, 1);
+			INIT_LIST_HEAD(&chan->active_node);
 			chans[x] = chan;
 			if (maxchans < x + 1)
 				maxchans = x + 1;
@@ -1327,6 +1883,9 @@ static int dahdi_net_open(hdlc_device *hdlc)
 	fasthdlc_init(&ms->txhdlc);
 	ms->infcs = PPP_INITFCS;
 
+#ifdef DAHDI_NET_NAPI
+	napi_enable(&ms->hdlcnetdev->napi);
+#endif
 	netif_start_queue(ztchan_to_dev(ms));
 
 #ifdef CONFIG_DAHDI_DEBUG
@@ -1335,6 +1894,47 @@ static int dahdi_net_open(hdlc_device *hdlc)
 	return 0;
 }
 
+#ifdef NEW_HDLC_INTERFACE
+static inline void dahdi_net_rx(struct net_device *dev, struct sk_buff *skb)
+{
+#if LINUX_VERSION_CODE <= KERNEL_VERSION(2,6,22)
+	skb->mac.raw = skb->data;
+#else
+	skb_reset_mac_header(skb);
+#endif
+	skb->dev = dev;
+#ifdef DAHDI_HDLC_TYPE_TRANS
+	skb->protocol = hdlc_type_trans(skb, dev);
+#else
+	skb->protocol = htons (ETH_P_HDLC);
+#endif
+}
+#endif
+
+#ifdef DAHDI_NET_NAPI
+/* Pass up the frames __putbuf_chunk() queued, outside of the span's
+   interrupt */
+static int dahdi_net_poll(struct napi_struct *napi, int budget)
+{
+	struct dahdi_hdlc *hdlc = container_of(napi, struct dahdi_hdlc, napi);
+	struct sk_buff *skb;
+	int work = 0;
+
+	while ((work < budget) && (skb = skb_dequeue(&hdlc->rxq))) {
+		dahdi_net_rx(hdlc->netdev, skb);
+		napi_gro_receive(napi, skb);
+		work++;
+	}
+	if (work < budget) {
+		napi_complete(napi);
+		/* Catch a frame queued while we were still scheduled */
+		if (!skb_queue_empty(&hdlc->rxq))
+			napi_schedule(napi);
+	}
+	return work;
+}
+#endif
+
 static int dahdi_register_hdlc_device(struct net_device *dev, const char *dev_name)
 {
 	int result;
@@ -1385,6 +1985,11 @@ static void dahdi_net_close(hdlc_device *hdlc)
 	/* Not much to do here.  Just deallocate the buffers */
         netif_stop_queue(ztchan_to_dev(ms));
 	dahdi_reallocbufs(ms, 0, 0);
+#ifdef DAHDI_NET_NAPI
+	/* Nothing more can be received, so drop what the poll hasn't had */
+	napi_disable(&ms->hdlcnetdev->napi);
+	skb_queue_purge(&ms->hdlcnetdev->rxq);
+#endif
 	hdlc_close(dev);
 #ifdef NEW_HDLC_INTERFACE
 	return 0;
@@ -1449,9 +2054,10 @@ static int dahdi_xmit(hdlc_device *hdlc, struct sk_buff *skb)
 	struct net_device_stats *stats = &ss->hdlcnetdev->netdev.stats;
 #endif
 	int retval = 1;
-	int x,oldbuf;
-	unsigned int fcs;
-	unsigned char *data;
+	int oldbuf;
+#ifdef CONFIG_DAHDI_DEBUG
+	int x;
+#endif
 	unsigned long flags;
 	/* See if we have any buffers */
 	spin_lock_irqsave(&ss->lock, flags);
@@ -1459,49 +2065,27 @@ static int dahdi_xmit(hdlc_device *hdlc, struct sk_buff *skb)
 		printk(KERN_ERR "dahdi_xmit(%s): skb is too large (%d > %d)\n", dev->name, skb->len, ss->blocksize -2);
 		stats->tx_dropped++;
 		retval = 0;
-	} else if (ss->inwritebuf >= 0) {
-		/* We have a place to put this packet */
-		/* XXX We should keep the SKB and avoid the memcpy XXX */
-		data = ss->writebuf[ss->inwritebuf];
-		memcpy(data, skb->data, skb->len);
-		ss->writen[ss->inwritebuf] = skb->len;
-		ss->writeidx[ss->inwritebuf] = 0;
-		/* Calculate the FCS */
-		fcs = PPP_INITFCS;
-		for (x=0;x<skb->len;x++)
-			fcs = PPP_FCS(fcs, data[x]);
-		/* Invert it */
-		fcs ^= 0xffff;
-		/* Send it out LSB first */
-		data[ss->writen[ss->inwritebuf]++] = (fcs & 0xff);
-		data[ss->writen[ss->inwritebuf]++] = (fcs >> 8) & 0xff;
+	} else if ((oldbuf = dahdi_inwritebuf(ss)) >= 0) {
+		/* We have a place to put this packet, and keep the skb
+		   until it has gone out */
+		__dahdi_queue_writeskb(ss, oldbuf, skb);
 		/* Advance to next window */
-		oldbuf = ss->inwritebuf;
-		ss->inwritebuf = (ss->inwritebuf + 1) % ss->numbufs;
+		dahdi_ring_push(ss, &ss->writehead);
 
-		if (ss->inwritebuf == ss->outwritebuf) {
+		if (dahdi_inwritebuf(ss) < 0) {
 			/* Whoops, no more space.  */
-		    ss->inwritebuf = -1;
-
 		    netif_stop_queue(ztchan_to_dev(ss));
 		}
-		if (ss->outwritebuf < 0) {
-			/* Let the interrupt handler know there's
-			   some space for us */
-			ss->outwritebuf = oldbuf;
-		}
 		dev->trans_start = jiffies;
 		stats->tx_packets++;
 		stats->tx_bytes += ss->writen[oldbuf];
 #ifdef CONFIG_DAHDI_DEBUG
 		printk("Buffered %d bytes to go out in buffer %d\n", ss->writen[oldbuf], oldbuf);
-		for (x=0;x<ss->writen[oldbuf];x++)
-		     printk("%02x ", ss->writebuf[oldbuf][x]);
+		for (x=0;x<skb->len;x++)
+		     printk("%02x ", skb->data[x]);
 		printk("\n");
 #endif
 		retval = 0;
-		/* Free the SKB */
-		dev_kfree_skb_any(skb);
 	}
 	spin_unlock_irqrestore(&ss->lock, flags);
 	return retval;
@@ -1532,8 +2116,11 @@ static int dahdi_ppp_xmit(struct ppp_channel *ppp, struct sk_buff *skb)
 	 * 1 and never if we return 0
          */
 	struct dahdi_chan *ss = ppp->private;
-	int x,oldbuf;
-	unsigned int fcs;
+	struct sk_buff *nskb;
+	int oldbuf;
+#ifdef CONFIG_DAHDI_DEBUG
+	int x;
+#endif
 	unsigned char *data;
 	long flags;
 	int retval = 0;
@@ -1546,64 +2133,38 @@ static int dahdi_ppp_xmit(struct ppp_channel *ppp, struct sk_buff *skb)
 	} else if (skb->len > ss->blocksize - 4) {
 		printk(KERN_ERR "dahdi_ppp_xmit(%s): skb is too large (%d > %d)\n", ss->name, skb->len, ss->blocksize -2);
 		retval = 1;
-	} else if (ss->inwritebuf >= 0) {
-		/* We have a place to put this packet */
-		/* XXX We should keep the SKB and avoid the memcpy XXX */
-		data = ss->writebuf[ss->inwritebuf];
-		/* Start with header of two bytes */
-		/* Add "ALL STATIONS" and "UNNUMBERED" */
-		data[0] = 0xff;
-		data[1] = 0x03;
-		ss->writen[ss->inwritebuf] = 2;
-
-		/* Copy real data and increment amount written */
-		memcpy(data + 2, skb->data, skb->len);
-
-		ss->writen[ss->inwritebuf] += skb->len;
-
-		/* Re-set index back to zero */
-		ss->writeidx[ss->inwritebuf] = 0;
-
-		/* Calculate the FCS */
-		fcs = PPP_INITFCS;
-		for (x=0;x<skb->len + 2;x++)
-			fcs = PPP_FCS(fcs, data[x]);
-		/* Invert it */
-		fcs ^= 0xffff;
-
-		/* Point past the real data now */
-		data += (skb->len + 2);
-
-		/* Send FCS out LSB first */
-		data[0] = (fcs & 0xff);
-		data[1] = (fcs >> 8) & 0xff;
-
-		/* Account for FCS length */
-		ss->writen[ss->inwritebuf]+=2;
-
-		/* Advance to next window */
-		oldbuf = ss->inwritebuf;
-		ss->inwritebuf = (ss->inwritebuf + 1) % ss->numbufs;
-
-		if (ss->inwritebuf == ss->outwritebuf) {
-			/* Whoops, no more space.  */
-			ss->inwritebuf = -1;
-		}
-		if (ss->outwritebuf < 0) {
-			/* Let the interrupt handler know there's
-			   some space for us */
-			ss->outwritebuf = oldbuf;
-		}
+	} else if ((oldbuf = dahdi_inwritebuf(ss)) >= 0) {
+		/* We have a place to put this packet, and keep the skb
+		   until it has gone out.  ppp_generic leaves headroom for
+		   the header, so the copy here should never happen */
+		if (skb_cloned(skb) || (skb_headroom(skb) < 2)) {
+			nskb = skb_realloc_headroom(skb, 2);
+			dev_kfree_skb_any(skb);
+			skb = nskb;
+		}
+		if (skb) {
+			/* Start with header of two bytes */
+			/* Add "ALL STATIONS" and "UNNUMBERED" */
+			data = skb_push(skb, 2);
+			data[0] = 0xff;
+			data[1] = 0x03;
+			__dahdi_queue_writeskb(ss, oldbuf, skb);
+
+			/* Advance to next window */
+			dahdi_ring_push(ss, &ss->writehead);
 #ifdef CONFIG_DAHDI_DEBUG
-		printk("Buffered %d bytes (skblen = %d) to go out in buffer %d\n", ss->writen[oldbuf], skb->len, oldbuf);
-		for (x=0;x<ss->writen[oldbuf];x++)
-		     printk("%02x ", ss->writebuf[oldbuf][x]);
-		printk("\n");
+			printk("Buffered %d bytes (skblen = %d) to go out in buffer %d\n", ss->writen[oldbuf], skb->len, oldbuf);
+			for (x=0;x<skb->len;x++)
+			     printk("%02x ", skb->data[x]);
+			printk("\n");
 #endif
+			/* The skb is ours now */
+			skb = NULL;
+		}
 		retval = 1;
 	}
 	spin_unlock_irqrestore(&ss->lock, flags);
-	if (retval) {
+	if (retval && skb) {
 		/* Get rid of the SKB if we're returning non-zero */
 		/* N.B. this is called in process or BH context so
 		   dev_kfree_skb is OK. */
@@ -1664,7 +2225,10 @@ static void dahdi_chan_unreg(struct dahdi_chan *chan)
 				(chans[x]->confmode & DAHDI_CONF_MODE_MASK) == DAHDI_CONF_MONITOR_TX_PREECHO ||
 				(chans[x]->confmode & DAHDI_CONF_MODE_MASK) == DAHDI_CONF_MONITORBOTH_PREECHO ||
 				(chans[x]->confmode & DAHDI_CONF_MODE_MASK) == DAHDI_CONF_DIGITALMON)) {
-				/* Take them out of conference with us */
+				/* Take them out of conference with us, under
+				   their lock as DAHDI_SETCONF does; interrupts
+				   are already off for chan_lock */
+				spin_lock(&chans[x]->lock);
 				/* release conference resource if any */
 				if (chans[x]->confna) {
 					dahdi_check_conf(chans[x]->confna);
@@ -1674,18 +2238,26 @@ static void dahdi_chan_unreg(struct dahdi_chan *chan)
 				chans[x]->confna = 0;
 				chans[x]->_confn = 0;
 				chans[x]->confmode = 0;
+				dahdi_pipeline_update(chans[x]);
+				spin_unlock(&chans[x]->lock);
+				dahdi_update_active(chans[x]);
 			}
 		}
+	dahdi_update_active(chan);
 	chan->channo = -1;
+	spin_lock(&dahdi_mmap_lock);
+	if (chan->mmap)
+		chan->mmap->chan = NULL;
+	spin_unlock(&dahdi_mmap_lock);
 	write_unlock_irqrestore(&chan_lock, flags);
 }
 
-static ssize_t dahdi_chan_read(struct file *file, char *usrbuf, size_t count, int unit)
+static ssize_t dahdi_chan_read(unsigned int f_flags, char *usrbuf, size_t count, int unit)
 {
 	struct dahdi_chan *chan = chans[unit];
 	int amnt;
 	int res, rv;
-	int oldbuf,x;
+	int tail,x;
 	unsigned long flags;
 	/* Make sure count never exceeds 65k, and make sure it's unsigned */
 	count &= 0xffff;
@@ -1693,18 +2265,22 @@ static ssize_t dahdi_chan_read(struct file *file, char *usrbuf, size_t count, in
 		return -EINVAL;
 	if (count < 1)
 		return -EINVAL;
+	/* With readsem we are the only consumer of the read ring, so none
+	   of this needs chan->lock; the span keeps filling buffers
+	   meanwhile.  It isn't held while we sleep. */
 	for(;;) {
-		spin_lock_irqsave(&chan->lock, flags);
+		down(&chan->readsem);
 		if (chan->eventinidx != chan->eventoutidx) {
-			spin_unlock_irqrestore(&chan->lock, flags);
+			up(&chan->readsem);
 			return -ELAST /* - chan->eventbuf[chan->eventoutidx]*/;
 		}
-		res = chan->outreadbuf;
+		tail = chan->readtail;
+		res = dahdi_ring_out(chan, chan->readhead, tail);
 		if (chan->rxdisable)
 			res = -1;
-		spin_unlock_irqrestore(&chan->lock, flags);
 		if (res >= 0) break;
-		if (file->f_flags & O_NONBLOCK)
+		up(&chan->readsem);
+		if (f_flags & O_NONBLOCK)
 			return -EAGAIN;
 		rv = schluffen(&chan->readbufq);
 		if (rv) return (rv);
@@ -1718,7 +2294,7 @@ static ssize_t dahdi_chan_read(struct file *file, char *usrbuf, size_t count, in
 		if (amnt > chan->readn[res])
 			myamnt = chan->readn[res];
 		printk("dahdi_chan_read(unit: %d, inwritebuf: %d, outwritebuf: %d amnt: %d\n", 
-			unit, chan->inwritebuf, chan->outwritebuf, myamnt);
+			unit, dahdi_inwritebuf(chan), dahdi_outwritebuf(chan), myamnt);
 		printk("\t("); for (x = 0; x < myamnt; x++) printk((x ? " %02x" : "%02x"), (unsigned char)usrbuf[x]);
 		printk(")\n");
 	}
@@ -1740,8 +2316,10 @@ static ssize_t dahdi_chan_read(struct file *file, char *usrbuf, size_t count, in
 					pass = 128;
 				for (x=0;x<pass;x++)
 					lindata[x] = DAHDI_XLAW(chan->readbuf[res][x + pos], chan);
-				if (copy_to_user(usrbuf + (pos << 1), lindata, pass << 1))
+				if (copy_to_user(usrbuf + (pos << 1), lindata, pass << 1)) {
+					up(&chan->readsem);
 					return -EFAULT;
+				}
 				left -= pass;
 				pos += pass;
 			}
@@ -1750,59 +2328,66 @@ static ssize_t dahdi_chan_read(struct file *file, char *usrbuf, size_t count, in
 		if (amnt > chan->readn[res])
 			amnt = chan->readn[res];
 		if (amnt) {
-			if (copy_to_user(usrbuf, chan->readbuf[res], amnt))
+			if (copy_to_user(usrbuf, chan->readbuf[res], amnt)) {
+				up(&chan->readsem);
 				return -EFAULT;
+			}
 		}
 	}
-	spin_lock_irqsave(&chan->lock, flags);
 	chan->readidx[res] = 0;
 	chan->readn[res] = 0;
-	oldbuf = res;
-	chan->outreadbuf = (res + 1) % chan->numbufs;
-	if (chan->outreadbuf == chan->inreadbuf) {
-		/* Out of stuff */
-		chan->outreadbuf = -1;
-		if (chan->rxbufpolicy == DAHDI_POLICY_WHEN_FULL)
+	/* Hand the buffer back to the interrupt handler.  If a flush
+	   emptied the ring under us, the tail has already moved and is
+	   left alone */
+	cmpxchg(&chan->readtail, tail, dahdi_ring_next(chan, tail));
+	up(&chan->readsem);
+	if ((chan->rxbufpolicy == DAHDI_POLICY_WHEN_FULL) && (dahdi_outreadbuf(chan) < 0)) {
+		/* Out of stuff.  The span only re-enables us with the lock
+		   held, so look again under it before disabling */
+		spin_lock_irqsave(&chan->lock, flags);
+		if (dahdi_outreadbuf(chan) < 0)
 			chan->rxdisable = 1;
+		spin_unlock_irqrestore(&chan->lock, flags);
 	}
-	if (chan->inreadbuf < 0) {
-		/* Notify interrupt handler that we have some space now */
-		chan->inreadbuf = oldbuf;
-	}
-	spin_unlock_irqrestore(&chan->lock, flags);
 	
 	return amnt;
 }
 
-static ssize_t dahdi_chan_write(struct file *file, const char *usrbuf, size_t count, int unit)
+static ssize_t dahdi_chan_write(unsigned int f_flags, const char *usrbuf, size_t count, int unit)
 {
 	unsigned long flags;
 	struct dahdi_chan *chan = chans[unit];
-	int res, amnt, oldbuf, rv,x;
+	int res, amnt, rv,x;
 	/* Make sure count never exceeds 65k, and make sure it's unsigned */
 	count &= 0xffff;
 	if (!chan) 
 		return -EINVAL;
 	if (count < 1)
 		return -EINVAL;
+	/* With writesem we are the only producer for the write ring (on
+	   NETDEV and PPP channels the network layer fills it instead, under
+	   chan->lock), so the lock is only needed to stop a tone or pulse
+	   dial.  writesem isn't held while we sleep. */
 	for(;;) {
-		spin_lock_irqsave(&chan->lock, flags);
+		down(&chan->writesem);
 		if ((chan->curtone || chan->pdialcount) && !(chan->flags & DAHDI_FLAG_PSEUDO)) {
+			spin_lock_irqsave(&chan->lock, flags);
 			chan->curtone = NULL;
 			chan->tonep = 0;
 			chan->dialing = 0;
 			chan->txdialbuf[0] = '\0';
 			chan->pdialcount = 0;
+			spin_unlock_irqrestore(&chan->lock, flags);
 		}
 		if (chan->eventinidx != chan->eventoutidx) {
-			spin_unlock_irqrestore(&chan->lock, flags);
+			up(&chan->writesem);
 			return -ELAST;
 		}
-		res = chan->inwritebuf;
-		spin_unlock_irqrestore(&chan->lock, flags);
+		res = dahdi_inwritebuf(chan);
 		if (res >= 0) 
 			break;
-		if (file->f_flags & O_NONBLOCK)
+		up(&chan->writesem);
+		if (f_flags & O_NONBLOCK)
 			return -EAGAIN;
 		/* Wait for something to be available */
 		rv = schluffen(&chan->writebufq);
@@ -1821,13 +2406,13 @@ static ssize_t dahdi_chan_write(struct file *file, const char *usrbuf, size_t co
 
 #ifdef CONFIG_DAHDI_DEBUG
 	printk("dahdi_chan_write(unit: %d, res: %d, outwritebuf: %d amnt: %d\n",
-		unit, chan->res, chan->outwritebuf, amnt);
+		unit, res, dahdi_outwritebuf(chan), amnt);
 #endif
 #if 0
  	if ((unit == 24) || (unit == 48) || (unit == 16) || (unit == 47)) { 
  		int x;
  		printk("dahdi_chan_write/in(unit: %d, res: %d, outwritebuf: %d amnt: %d, txdisable: %d)\n",
- 			unit, res, chan->outwritebuf, amnt, chan->txdisable);
+ 			unit, res, dahdi_outwritebuf(chan), amnt, chan->txdisable);
  		printk("\t("); for (x = 0; x < amnt; x++) printk((x ? " %02x" : "%02x"), (unsigned char)usrbuf[x]);
  		printk(")\n");
  	}
@@ -1845,8 +2430,10 @@ static ssize_t dahdi_chan_write(struct file *file, const char *usrbuf, size_t co
 				pass = left;
 				if (pass > 128)
 					pass = 128;
-				if (copy_from_user(lindata, usrbuf + (pos << 1), pass << 1))
+				if (copy_from_user(lindata, usrbuf + (pos << 1), pass << 1)) {
+					up(&chan->writesem);
 					return -EFAULT;
+				}
 				left -= pass;
 				for (x=0;x<pass;x++)
 					chan->writebuf[res][x + pos] = DAHDI_LIN2X(lindata[x], chan);
@@ -1854,32 +2441,30 @@ static ssize_t dahdi_chan_write(struct file *file, const char *usrbuf, size_t co
 			}
 			chan->writen[res] = amnt >> 1;
 		} else {
-			if (copy_from_user(chan->writebuf[res], usrbuf, amnt))
+			if (copy_from_user(chan->writebuf[res], usrbuf, amnt)) {
+				up(&chan->writesem);
 				return -EFAULT;
+			}
 			chan->writen[res] = amnt;
 		}
 		chan->writeidx[res] = 0;
 		if (chan->flags & DAHDI_FLAG_FCS)
 			calc_fcs(chan, res);
-		oldbuf = res;
-		spin_lock_irqsave(&chan->lock, flags);
-		chan->inwritebuf = (res + 1) % chan->numbufs;
-		if (chan->inwritebuf == chan->outwritebuf) {
-			/* Don't stomp on the transmitter, just wait for them to 
-			   wake us up */
-			chan->inwritebuf = -1;
-			/* Make sure the transmitter is transmitting in case of POLICY_WHEN_FULL */
+		/* Okay, give the interrupt handler the buffer */
+		dahdi_ring_push(chan, &chan->writehead);
+		if ((chan->txbufpolicy == DAHDI_POLICY_WHEN_FULL) && (dahdi_inwritebuf(chan) < 0)) {
+			/* Don't stomp on the transmitter, just make sure it is
+			   transmitting now that we are full.  Taking the lock
+			   orders this after it disabling itself on empty */
+			spin_lock_irqsave(&chan->lock, flags);
 			chan->txdisable = 0;
+			spin_unlock_irqrestore(&chan->lock, flags);
 		}
-		if (chan->outwritebuf < 0) {
-			/* Okay, the interrupt handler has been waiting for us.  Give them a buffer */
-			chan->outwritebuf = oldbuf;
-		}
-		spin_unlock_irqrestore(&chan->lock, flags);
 
 		if (chan->flags & DAHDI_FLAG_NOSTDTXRX && chan->span->hdlc_hard_xmit)
 			chan->span->hdlc_hard_xmit(chan);
 	}
+	up(&chan->writesem);
 	return amnt;
 }
 
@@ -2079,15 +2664,12 @@ static int dahdi_hangup(struct dahdi_chan *chan)
 		chan->readn[x]=
 		chan->readidx[x] = 0;
 	}	
-	if (chan->readbuf[0]) {
-		chan->inreadbuf = 0;
-		chan->inwritebuf = 0;
-	} else {
-		chan->inreadbuf = -1;
-		chan->inwritebuf = -1;
-	}
-	chan->outreadbuf = -1;
-	chan->outwritebuf = -1;
+	/* Drop whatever is queued.  Each ring is emptied from the
+	   consumer's end, so a read() or write() running now can't
+	   leave it in a mess */
+	chan->readtail = chan->readhead;
+	chan->writetail = chan->writehead;
+	__dahdi_free_writeskbs(chan);
 	chan->dialing = 0;
 	chan->afterdialingtimer = 0;
 	chan->curtone = NULL;
@@ -2103,6 +2685,7 @@ static int initialize_channel(struct dahdi_chan *chan)
 	unsigned long flags;
 	void *rxgain=NULL;
 	struct echo_can_state *ec=NULL;
+	struct dahdi_echocan *ecf=NULL;
 	if ((res = dahdi_reallocbufs(chan, DAHDI_DEFAULT_BLOCKSIZE, DAHDI_DEFAULT_NUM_BUFS)))
 		return res;
 
@@ -2114,6 +2697,8 @@ static int initialize_channel(struct dahdi_chan *chan)
 	/* Free up the echo canceller if there is one */
 	ec = chan->ec;
 	chan->ec = NULL;
+	ecf = chan->ec_factory;
+	chan->ec_factory = NULL;
 	chan->echocancel = 0;
 	chan->echostate = ECHO_STATE_IDLE;
 	chan->echolastupdate = 0;
@@ -2188,6 +2773,7 @@ static int initialize_channel(struct dahdi_chan *chan)
 	chan->rxgain = defgain;
 	chan->txgain = defgain;
 	chan->gainalloc = 0;
+	dahdi_pipeline_update(chan);
 	chan->eventinidx = chan->eventoutidx = 0;
 	dahdi_set_law(chan,0);
 	dahdi_hangup(chan);
@@ -2211,6 +2797,7 @@ static int initialize_channel(struct dahdi_chan *chan)
 	}
 
 	spin_unlock_irqrestore(&chan->lock, flags);
+	dahdi_update_active(chan);
 	set_tone_zone(chan, -1);
 
 	hw_echocancel_off(chan);
@@ -2218,7 +2805,7 @@ static int initialize_channel(struct dahdi_chan *chan)
 	if (rxgain)
 		kfree(rxgain);
 	if (ec)
-		echo_can_free(ec);
+		dahdi_echocan_free(ecf, ec);
 	return 0;
 }
 
@@ -2231,42 +2818,131 @@ static int dahdi_timing_open(struct inode *inode, struct file *file)
 		return -ENOMEM;
 	/* Allocate a new timer */
 	memset(t, 0, sizeof(struct dahdi_timer));
+	atomic_set(&t->refcount, 1);
 	init_waitqueue_head(&t->sel);
+	INIT_LIST_HEAD(&t->list);
+	INIT_LIST_HEAD(&t->wake);
 	file->private_data = t;
 	spin_lock_irqsave(&zaptimerlock, flags);
-	t->next = zaptimers;
-	zaptimers = t;
+	timer_count++;
 	spin_unlock_irqrestore(&zaptimerlock, flags);
 	return 0;
 }
 
-static int dahdi_timer_release(struct inode *inode, struct file *file)
+/* Bring t->tripped up to date with its group.  Called with zaptimerlock held */
+static int __dahdi_timer_tripped(struct dahdi_timer *t)
 {
-	struct dahdi_timer *t, *cur, *prev;
-	unsigned long flags;
-	t = file->private_data;
-	if (t) {
-		spin_lock_irqsave(&zaptimerlock, flags);
-		prev = NULL;
-		cur = zaptimers;
-		while(cur) {
-			if (t == cur)
-				break;
-			prev = cur;
-			cur = cur->next;
-		}
-		if (cur) {
-			if (prev)
-				prev->next = cur->next;
-			else
-				zaptimers = cur->next;
-		}
-		spin_unlock_irqrestore(&zaptimerlock, flags);
-		if (!cur) {
-			printk("DAHDI Timer: Not on list??\n");
-			return 0;
-		}
+	if (t->group) {
+		t->tripped += t->group->trips - t->gtrips;
+		t->gtrips = t->group->trips;
+	}
+	return t->tripped;
+}
+
+/* Take a timer out of its group, and the group off the wheel if that
+   was the last one.  Called with zaptimerlock held */
+static void __dahdi_timer_disarm(struct dahdi_timer *t)
+{
+	struct dahdi_timer_group *g = t->group;
+
+	if (!g)
+		return;
+	__dahdi_timer_tripped(t);
+	list_del_init(&t->list);
+	t->group = NULL;
+	timer_armed--;
+	if (!--g->count) {
+		list_del(&g->list);
+		if (!list_empty(&g->pending))
+			list_del(&g->pending);
+		timer_groups--;
+		kfree(g);
+	}
+}
+
+/* (Re)start a timer with a period of t->ms.  With a phase (in ticks) it
+   trips on the ticks that are phase past a multiple of the period,
+   otherwise a period from now.  *spare is used, and cleared, if a new
+   group is needed.  Called with zaptimerlock held */
+static void __dahdi_timer_arm(struct dahdi_timer *t, int phase, struct dahdi_timer_group **spare)
+{
+	struct dahdi_timer_group *g;
+	struct list_head *slot;
+	unsigned long expires;
+	int period;
+
+	__dahdi_timer_disarm(t);
+	if (!t->ms)
+		return;
+	/* The old countdown took DAHDI_CHUNKSIZE off every tick and
+	   tripped once it got to zero */
+	period = (t->ms + DAHDI_CHUNKSIZE - 1) / DAHDI_CHUNKSIZE;
+	if (phase < 0) {
+		expires = timer_ticks + period;
+	} else {
+		expires = timer_ticks - (timer_ticks % period) + (phase % period);
+		if ((long)(expires - timer_ticks) <= 0)
+			expires += period;
+	}
+	slot = &timer_wheel[expires & (DAHDI_TIMER_WHEEL - 1)];
+	list_for_each_entry(g, slot, list) {
+		if ((g->expires == expires) && (g->period == period))
+			goto join;
+	}
+	g = *spare;
+	*spare = NULL;
+	memset(g, 0, sizeof(*g));
+	g->period = period;
+	g->expires = expires;
+	INIT_LIST_HEAD(&g->timers);
+	INIT_LIST_HEAD(&g->pending);
+	list_add_tail(&g->list, slot);
+	timer_groups++;
+join:
+	t->group = g;
+	t->gtrips = g->trips;
+	list_add_tail(&t->list, &g->timers);
+	g->count++;
+	timer_armed++;
+}
+
+static int dahdi_timer_config(struct dahdi_timer *t, int samples, int phase)
+{
+	struct dahdi_timer_group *spare = NULL;
+	unsigned long flags;
+
+	if (samples < 0)
+		samples = 0;
+	if (samples) {
+		spare = kmalloc(sizeof(*spare), GFP_KERNEL);
+		if (!spare)
+			return -ENOMEM;
+	}
+	spin_lock_irqsave(&zaptimerlock, flags);
+	t->ms = samples;
+	__dahdi_timer_arm(t, phase, &spare);
+	spin_unlock_irqrestore(&zaptimerlock, flags);
+	kfree(spare);
+	return 0;
+}
+
+static void dahdi_timer_put(struct dahdi_timer *t)
+{
+	if (atomic_dec_and_test(&t->refcount))
 		kfree(t);
+}
+
+static int dahdi_timer_release(struct inode *inode, struct file *file)
+{
+	struct dahdi_timer *t;
+	unsigned long flags;
+	t = file->private_data;
+	if (t) {
+		spin_lock_irqsave(&zaptimerlock, flags);
+		__dahdi_timer_disarm(t);
+		timer_count--;
+		spin_unlock_irqrestore(&zaptimerlock, flags);
+		dahdi_timer_put(t);
 	}
 	return 0;
 }
@@ -2363,6 +3039,10 @@ static void dahdi_free_pseudo(struct dahdi_chan *pseudo)
 		spin_lock_irqsave(&bigzaplock, flags);
 		dahdi_chan_unreg(pseudo);
 		spin_unlock_irqrestore(&bigzaplock, flags);
+#ifdef CONFIG_DAHDI_CONF_SHARDS
+		/* A conference pass may still be using it */
+		flush_workqueue(conf_shard_wq);
+#endif
 		kfree(pseudo);
 	}
 }
@@ -2450,7 +3130,7 @@ static ssize_t dahdi_read(struct file *file, char *usrbuf, size_t count, loff_t
 		chan = file->private_data;
 		if (!chan)
 			return -EINVAL;
-		return dahdi_chan_read(file, usrbuf, count, chan->channo);
+		return dahdi_chan_read(file->f_flags, usrbuf, count, chan->channo);
 	}
 	
 	if (unit == 255) {
@@ -2459,12 +3139,12 @@ static ssize_t dahdi_read(struct file *file, char *usrbuf, size_t count, loff_t
 			printk("No pseudo channel structure to read?\n");
 			return -EINVAL;
 		}
-		return dahdi_chan_read(file, usrbuf, count, chan->channo);
+		return dahdi_chan_read(file->f_flags, usrbuf, count, chan->channo);
 	}
 	if (count < 0)
 		return -EINVAL;
 
-	return dahdi_chan_read(file, usrbuf, count, unit);
+	return dahdi_chan_read(file->f_flags, usrbuf, count, unit);
 }
 
 static ssize_t dahdi_write(struct file *file, const char *usrbuf, size_t count, loff_t *ppos)
@@ -2482,7 +3162,7 @@ static ssize_t dahdi_write(struct file *file, const char *usrbuf, size_t count,
 		chan = file->private_data;
 		if (!chan)
 			return -EINVAL;
-		return dahdi_chan_write(file, usrbuf, count, chan->channo);
+		return dahdi_chan_write(file->f_flags, usrbuf, count, chan->channo);
 	}
 	if (unit == 255) {
 		chan = file->private_data;
@@ -2490,9 +3170,9 @@ static ssize_t dahdi_write(struct file *file, const char *usrbuf, size_t count,
 			printk("No pseudo channel structure to read?\n");
 			return -EINVAL;
 		}
-		return dahdi_chan_write(file, usrbuf, count, chan->channo);
+		return dahdi_chan_write(file->f_flags, usrbuf, count, chan->channo);
 	}
-	return dahdi_chan_write(file, usrbuf, count, unit);
+	return dahdi_chan_write(file->f_flags, usrbuf, count, unit);
 	
 }
 
@@ -3022,21 +3702,23 @@ void dahdi_alarm_notify(struct dahdi_span *span)
 
 static int dahdi_timer_ioctl(struct inode *node, struct file *file, unsigned int cmd, unsigned long data, struct dahdi_timer *timer)
 {
+	struct dahdi_timerconf tc;
 	int j;
 	unsigned long flags;
 	switch(cmd) {
 	case DAHDI_TIMERCONFIG:
 		get_user(j, (int *)data);
-		if (j < 0)
-			j = 0;
-		spin_lock_irqsave(&zaptimerlock, flags);
-		timer->ms = timer->pos = j;
-		spin_unlock_irqrestore(&zaptimerlock, flags);
-		break;
+		return dahdi_timer_config(timer, j, -1);
+	case DAHDI_TIMERCONFIG_PHASE:
+		if (copy_from_user(&tc, (struct dahdi_timerconf *)data, sizeof(tc)))
+			return -EFAULT;
+		if (tc.phase < 0)
+			return -EINVAL;
+		return dahdi_timer_config(timer, tc.samples, tc.phase / DAHDI_CHUNKSIZE);
 	case DAHDI_TIMERACK:
 		get_user(j, (int *)data);
 		spin_lock_irqsave(&zaptimerlock, flags);
-		if ((j < 1) || (j > timer->tripped))
+		if ((j < 1) || (j > __dahdi_timer_tripped(timer)))
 			j = timer->tripped;
 		timer->tripped -= j;
 		spin_unlock_irqrestore(&zaptimerlock, flags);
@@ -3045,7 +3727,7 @@ static int dahdi_timer_ioctl(struct inode *node, struct file *file, unsigned int
 		j = DAHDI_EVENT_NONE;
 		spin_lock_irqsave(&zaptimerlock, flags);
 		  /* set up for no event */
-		if (timer->tripped)
+		if (__dahdi_timer_tripped(timer))
 			j = DAHDI_EVENT_TIMER_EXPIRED;
 		if (timer->ping)
 			j = DAHDI_EVENT_TIMER_PING;
@@ -3055,8 +3737,8 @@ static int dahdi_timer_ioctl(struct inode *node, struct file *file, unsigned int
 	case DAHDI_TIMERPING:
 		spin_lock_irqsave(&zaptimerlock, flags);
 		timer->ping = 1;
-		wake_up_interruptible(&timer->sel);
 		spin_unlock_irqrestore(&zaptimerlock, flags);
+		wake_up_interruptible(&timer->sel);
 		break;
 	case DAHDI_TIMERPONG:
 		spin_lock_irqsave(&zaptimerlock, flags);
@@ -3230,7 +3912,8 @@ static int dahdi_common_ioctl(struct inode *node, struct file *file, unsigned in
 		if ((i < 0) || (i > DAHDI_MAX_CHANNELS) || !chans[i]) return(-EINVAL);
 		if (!(chans[i]->flags & DAHDI_FLAG_AUDIO)) return (-EINVAL);
 
-		rxgain = kmalloc(512, GFP_KERNEL);
+		/* rx and tx tables, then the rx composite table */
+		rxgain = kmalloc(512 + 256 * sizeof(short), GFP_KERNEL);
 		if (!rxgain)
 			return -ENOMEM;
 
@@ -3252,6 +3935,7 @@ static int dahdi_common_ioctl(struct inode *node, struct file *file, unsigned in
 			chans[i]->gainalloc = 0;
 			chans[i]->rxgain = defgain;
 			chans[i]->txgain = defgain;
+			dahdi_pipeline_update(chans[i]);
 			spin_unlock_irqrestore(&chans[i]->lock, flags);
 		} else {
 			/* This is a custom gain setting */
@@ -3261,6 +3945,7 @@ static int dahdi_common_ioctl(struct inode *node, struct file *file, unsigned in
 			chans[i]->gainalloc = 1;
 			chans[i]->rxgain = rxgain;
 			chans[i]->txgain = txgain;
+			dahdi_pipeline_update(chans[i]);
 			spin_unlock_irqrestore(&chans[i]->lock, flags);
 		}
 		if (copy_to_user((struct dahdi_gains *) data,&stack.gain,sizeof(stack.gain)))
@@ -3345,7 +4030,7 @@ static int dahdi_common_ioctl(struct inode *node, struct file *file, unsigned in
 		printk(KERN_INFO "span: %08lx, sig: %x hex, sigcap: %x hex\n",
 			(long)mychan->span, mychan->sig, mychan->sigcap);
 		printk(KERN_INFO "inreadbuf: %d, outreadbuf: %d, inwritebuf: %d, outwritebuf: %d\n",
-			mychan->inreadbuf, mychan->outreadbuf, mychan->inwritebuf, mychan->outwritebuf);
+			dahdi_inreadbuf(mychan), dahdi_outreadbuf(mychan), dahdi_inwritebuf(mychan), dahdi_outwritebuf(mychan));
 		printk(KERN_INFO "blocksize: %d, numbufs: %d, txbufpolicy: %d, txbufpolicy: %d\n",
 			mychan->blocksize, mychan->numbufs, mychan->txbufpolicy, mychan->rxbufpolicy);
 		printk(KERN_INFO "txdisable: %d, rxdisable: %d, iomask: %d\n",
@@ -3417,6 +4102,66 @@ static void recalc_slaves(struct dahdi_chan *chan)
 #endif
 }
 
+/* The channel file is open on, as long as it is open there.  The caller
+   holds a reference to file, so it can't be closed under us */
+static struct dahdi_chan *dahdi_file_chan(struct file *file)
+{
+	struct dahdi_chan *chan = NULL;
+	unsigned long flags;
+	int unit;
+
+	if (file->f_op != &dahdi_fops)
+		return NULL;
+	unit = UNIT(file);
+	read_lock_irqsave(&chan_lock, flags);
+	if ((unit == 254) || (unit == 255))
+		chan = file->private_data;
+	else if ((unit > 0) && (unit < 250))
+		chan = chans[unit];
+	if (chan && ((chan->file != file) || !test_bit(DAHDI_FLAGBIT_OPEN, &chan->flags)))
+		chan = NULL;
+	read_unlock_irqrestore(&chan_lock, flags);
+	return chan;
+}
+
+static int dahdi_ioctl_bufvecs(unsigned long data, int write)
+{
+	struct dahdi_bufvecs bv;
+	struct dahdi_bufvec v;
+	struct dahdi_chan *chan;
+	struct file *file;
+	int x, done = 0;
+
+	if (copy_from_user(&bv, (struct dahdi_bufvecs *)data, sizeof(bv)))
+		return -EFAULT;
+	if ((bv.count < 0) || (bv.count > DAHDI_MAX_BUFVEC))
+		return -EINVAL;
+	for (x = 0; x < bv.count; x++) {
+		if (copy_from_user(&v, &bv.vec[x], sizeof(v)))
+			return -EFAULT;
+		/* Same as read()/write() on the caller's own fd, but never
+		   sleep; one idle channel mustn't hold up the rest */
+		if (!(file = fget(v.fd)))
+			v.res = -EBADF;
+		else {
+			if (!(chan = dahdi_file_chan(file)))
+				v.res = -EBADF;
+			else if (v.len < 0)
+				v.res = -EINVAL;
+			else if (write)
+				v.res = dahdi_chan_write(O_NONBLOCK, v.buf, v.len, chan->channo);
+			else
+				v.res = dahdi_chan_read(O_NONBLOCK, v.buf, v.len, chan->channo);
+			fput(file);
+		}
+		if (v.res > 0)
+			done++;
+		if (put_user(v.res, &bv.vec[x].res))
+			return -EFAULT;
+	}
+	return done;
+}
+
 static int dahdi_ctl_ioctl(struct inode *inode, struct file *file, unsigned int cmd, unsigned long data)
 {
 	/* I/O CTL's for control interface */
@@ -3437,6 +4182,10 @@ static int dahdi_ctl_ioctl(struct inode *inode, struct file *file, unsigned int
 		VALID_CHANNEL(ind.chan);
 		return dahdi_chan_ioctl(inode, file, ind.op, (unsigned long) ind.data, ind.chan);
 	}
+	case DAHDI_READV:
+		return dahdi_ioctl_bufvecs(data, 0);
+	case DAHDI_WRITEV:
+		return dahdi_ioctl_bufvecs(data, 1);
 	case DAHDI_SPANCONFIG:
 	{
 		struct dahdi_lineconfig lc;
@@ -3623,6 +4372,10 @@ static int dahdi_ctl_ioctl(struct inode *inode, struct file *file, unsigned int
 					chans[ch.chan]->hdlcnetdev->netdev->stop = dahdi_net_stop;
 					dev_to_hdlc(chans[ch.chan]->hdlcnetdev->netdev)->attach = dahdi_net_attach;
 					dev_to_hdlc(chans[ch.chan]->hdlcnetdev->netdev)->xmit = dahdi_xmit;
+#ifdef DAHDI_NET_NAPI
+					skb_queue_head_init(&chans[ch.chan]->hdlcnetdev->rxq);
+					netif_napi_add(chans[ch.chan]->hdlcnetdev->netdev, &chans[ch.chan]->hdlcnetdev->napi, dahdi_net_poll, DAHDI_NET_WEIGHT);
+#endif
 					spin_unlock_irqrestore(&chans[ch.chan]->lock, flags);
 					/* Briefly restore interrupts while we register the device */
 					res = dahdi_register_hdlc_device(chans[ch.chan]->hdlcnetdev->netdev, ch.netdev_name);
@@ -3660,7 +4413,9 @@ static int dahdi_ctl_ioctl(struct inode *inode, struct file *file, unsigned int
 #ifdef CONFIG_DAHDI_DEBUG
 		printk("Configured channel %s, flags %04x, sig %04x\n", chans[ch.chan]->name, chans[ch.chan]->flags, chans[ch.chan]->sig);
 #endif			
+		dahdi_pipeline_update(chans[ch.chan]);
 		spin_unlock_irqrestore(&chans[ch.chan]->lock, flags);
+		dahdi_update_active(chans[ch.chan]);
 		return res;
 	}
 	case DAHDI_SFCONFIG:
@@ -3691,6 +4446,7 @@ static int dahdi_ctl_ioctl(struct inode *inode, struct file *file, unsigned int
 				set_txtone(chans[sf.chan],0,0,0);
 			}
 		}
+		dahdi_pipeline_update(chans[sf.chan]);
 		spin_unlock_irqrestore(&chans[sf.chan]->lock, flags);
 		return res;
 	}
@@ -3768,7 +4524,7 @@ static int dahdi_ctl_ioctl(struct inode *inode, struct file *file, unsigned int
 
 		memset(&vi, 0, sizeof(vi));
 		dahdi_copy_string(vi.version, DAHDI_VERSION, sizeof(vi.version));
-		echo_can_identify(vi.echo_canceller, sizeof(vi.echo_canceller) - 1);
+		dahdi_echocan_identify(vi.echo_canceller, sizeof(vi.echo_canceller) - 1);
 		if (copy_to_user((struct dahdi_versioninfo *) data, &vi, sizeof(vi)))
 			return -EFAULT;
 		break;
@@ -3827,6 +4583,30 @@ static int dahdi_ctl_ioctl(struct inode *inode, struct file *file, unsigned int
 				return dahdi_dynamic_ioctl(cmd, data);
 		}
 		return -ENOSYS;
+	case DAHDI_ATTACH_ECHOCAN:
+	{
+		struct dahdi_attach_echocan ae;
+		struct dahdi_echocan *ecf;
+		char *c;
+
+		if (copy_from_user(&ae, (struct dahdi_attach_echocan *) data, sizeof(ae)))
+			return -EFAULT;
+		VALID_CHANNEL(ae.chan);
+		ae.echocan[sizeof(ae.echocan) - 1] = '\0';
+		for (c = ae.echocan; *c; c++)
+			*c = tolower(*c);
+		/* Make sure it exists (and is loaded) now rather than when the
+		   echo canceller gets turned on */
+		if (ae.echocan[0]) {
+			if (!(ecf = dahdi_get_echocan(ae.echocan)))
+				return -EINVAL;
+			module_put(ecf->owner);
+		}
+		spin_lock_irqsave(&chans[ae.chan]->lock, flags);
+		memcpy(chans[ae.chan]->echocan_name, ae.echocan, sizeof(ae.echocan));
+		spin_unlock_irqrestore(&chans[ae.chan]->lock, flags);
+		break;
+	}
 #if defined(ECHO_CAN_HPEC)
 	case DAHDI_EC_LICENSE_CHALLENGE:
 	case DAHDI_EC_LICENSE_RESPONSE:
@@ -3941,7 +4721,7 @@ static int dahdi_chanandpseudo_ioctl(struct inode *inode, struct file *file, uns
 			return -EINVAL;
 		chan->rxbufpolicy = stack.bi.rxbufpolicy & 0x1;
 		chan->txbufpolicy = stack.bi.txbufpolicy & 0x1;
-		if ((rv = dahdi_reallocbufs(chan,  stack.bi.bufsize, stack.bi.numbufs)))
+		if ((rv = dahdi_resizebufs(chan,  stack.bi.bufsize, stack.bi.numbufs)))
 			return (rv);
 		break;
 	case DAHDI_GET_BLOCKSIZE:  /* get blocksize */
@@ -3955,7 +4735,7 @@ static int dahdi_chanandpseudo_ioctl(struct inode *inode, struct file *file, uns
 		if (j < 16) return(-EINVAL);
 		  /* allocate a single kernel buffer which we then
 		     sub divide into four pieces */
-		if ((rv = dahdi_reallocbufs(chan, j, chan->numbufs)))
+		if ((rv = dahdi_resizebufs(chan, j, chan->numbufs)))
 			return (rv);
 		break;
 	case DAHDI_FLUSH:  /* flush input buffer, output buffer, and/or event queue */
@@ -3964,8 +4744,7 @@ static int dahdi_chanandpseudo_ioctl(struct inode *inode, struct file *file, uns
 		if (i & DAHDI_FLUSH_READ)  /* if for read (input) */
 		   {
 			  /* initialize read buffers and pointers */
-			chan->inreadbuf = 0;
-			chan->outreadbuf = -1;
+			chan->readtail = chan->readhead;
 			for (j=0;j<chan->numbufs;j++) {
 				/* Do we need this? */
 				chan->readn[j] = 0;
@@ -3977,8 +4756,8 @@ static int dahdi_chanandpseudo_ioctl(struct inode *inode, struct file *file, uns
 		if (i & DAHDI_FLUSH_WRITE) /* if for write (output) */
 		   {
 			  /* initialize write buffers and pointers */
-			chan->outwritebuf = -1;
-			chan->inwritebuf = 0;
+			chan->writetail = chan->writehead;
+			__dahdi_free_writeskbs(chan);
 			for (j=0;j<chan->numbufs;j++) {
 				/* Do we need this? */
 				chan->writen[j] = 0;
@@ -4003,7 +4782,7 @@ static int dahdi_chanandpseudo_ioctl(struct inode *inode, struct file *file, uns
 		   {
 			spin_lock_irqsave(&chan->lock, flags);
 			  /* Know if there is a write pending */
-			i = (chan->outwritebuf > -1);
+			i = (dahdi_outwritebuf(chan) > -1);
 			spin_unlock_irqrestore(&chan->lock, flags);
 			if (!i) break; /* skip if none */
 			rv = schluffen(&chan->writebufq);
@@ -4022,13 +4801,13 @@ static int dahdi_chanandpseudo_ioctl(struct inode *inode, struct file *file, uns
 			if (chan->iomask & DAHDI_IOMUX_READ)
 			   {
 				/* if read available */
-				if ((chan->outreadbuf > -1)  && !chan->rxdisable)
+				if ((dahdi_outreadbuf(chan) > -1)  && !chan->rxdisable)
 					ret |= DAHDI_IOMUX_READ;
 			   }
 			  /* if looking for write avail */
 			if (chan->iomask & DAHDI_IOMUX_WRITE)
 			   {
-				if (chan->inwritebuf > -1)
+				if (dahdi_inwritebuf(chan) > -1)
 					ret |= DAHDI_IOMUX_WRITE;
 			   }
 			  /* if looking for write empty */
@@ -4036,7 +4815,7 @@ static int dahdi_chanandpseudo_ioctl(struct inode *inode, struct file *file, uns
 			   {
 				  /* if everything empty -- be sure the transmitter is enabled */
 				chan->txdisable = 0;
-				if (chan->outwritebuf < 0)
+				if (dahdi_outwritebuf(chan) < 0)
 					ret |= DAHDI_IOMUX_WRITEEMPTY;
 			   }
 			  /* if looking for signalling event */
@@ -4148,6 +4927,9 @@ static int dahdi_chanandpseudo_ioctl(struct inode *inode, struct file *file, uns
 		  /* likewise if 0 mode must have no conf */
 		if ((!stack.conf.confmode) && stack.conf.confno) return (-EINVAL);
 		stack.conf.chan = i;  /* return with real channel # */
+#ifdef CONFIG_DAHDI_CONF_SHARDS
+		write_lock(&conf_shard_lock);
+#endif
 		spin_lock_irqsave(&bigzaplock, flagso);
 		spin_lock_irqsave(&chan->lock, flags);
 		if (stack.conf.confno == -1) 
@@ -4156,6 +4938,9 @@ static int dahdi_chanandpseudo_ioctl(struct inode *inode, struct file *file, uns
 			/* No more empty conferences */
 			spin_unlock_irqrestore(&chan->lock, flags);
 			spin_unlock_irqrestore(&bigzaplock, flagso);
+#ifdef CONFIG_DAHDI_CONF_SHARDS
+			write_unlock(&conf_shard_lock);
+#endif
 			return -EBUSY;
 		}
 		  /* if changing confs, clear last added info */
@@ -4168,6 +4953,7 @@ static int dahdi_chanandpseudo_ioctl(struct inode *inode, struct file *file, uns
 		chans[i]->confna = stack.conf.confno;   /* set conference number */
 		chans[i]->confmode = stack.conf.confmode;  /* set conference mode */
 		chans[i]->_confn = 0;		     /* Clear confn */
+		dahdi_pipeline_update(chans[i]);
 		dahdi_check_conf(j);
 		dahdi_check_conf(stack.conf.confno);
 		if (chans[i]->span && chans[i]->span->dacs) {
@@ -4208,7 +4994,11 @@ static int dahdi_chanandpseudo_ioctl(struct inode *inode, struct file *file, uns
 		}
 
 		spin_unlock_irqrestore(&chan->lock, flags);
+		dahdi_update_active(chans[i]);
 		spin_unlock_irqrestore(&bigzaplock, flagso);
+#ifdef CONFIG_DAHDI_CONF_SHARDS
+		write_unlock(&conf_shard_lock);
+#endif
 		if (copy_to_user((struct dahdi_confinfo *) data,&stack.conf,sizeof(stack.conf)))
 			return -EFAULT;
 		break;
@@ -4221,6 +5011,9 @@ static int dahdi_chanandpseudo_ioctl(struct inode *inode, struct file *file, uns
 		if ((stack.conf.confno < 0) || (stack.conf.confno > DAHDI_MAX_CONF)) return(-EINVAL);
 		  /* cant listen to self!! */
 		if (stack.conf.chan && (stack.conf.chan == stack.conf.confno)) return(-EINVAL);
+#ifdef CONFIG_DAHDI_CONF_SHARDS
+		write_lock(&conf_shard_lock);
+#endif
 		spin_lock_irqsave(&bigzaplock, flagso);
 		spin_lock_irqsave(&chan->lock, flags);
 		  /* if to clear all links */
@@ -4229,8 +5022,14 @@ static int dahdi_chanandpseudo_ioctl(struct inode *inode, struct file *file, uns
 			   /* clear all the links */
 			memset(conf_links,0,sizeof(conf_links));
 			recalc_maxlinks();
+#ifdef CONFIG_DAHDI_CONF_SHARDS
+			conf_groups_dirty = 1;
+#endif
 			spin_unlock_irqrestore(&chan->lock, flags);
 			spin_unlock_irqrestore(&bigzaplock, flagso);
+#ifdef CONFIG_DAHDI_CONF_SHARDS
+			write_unlock(&conf_shard_lock);
+#endif
 			break;
 		   }
 		rv = 0;  /* clear return value */
@@ -4280,8 +5079,14 @@ static int dahdi_chanandpseudo_ioctl(struct inode *inode, struct file *file, uns
 			   }
 		   }
 		recalc_maxlinks();
+#ifdef CONFIG_DAHDI_CONF_SHARDS
+		conf_groups_dirty = 1;
+#endif
 		spin_unlock_irqrestore(&chan->lock, flags);
 		spin_unlock_irqrestore(&bigzaplock, flagso);
+#ifdef CONFIG_DAHDI_CONF_SHARDS
+		write_unlock(&conf_shard_lock);
+#endif
 		return(rv);
 	case DAHDI_CONFDIAG:  /* output diagnostic info to console */
 		if (!(chan->flags & DAHDI_FLAG_AUDIO)) return (-EINVAL);
@@ -4323,7 +5128,9 @@ static int dahdi_chanandpseudo_ioctl(struct inode *inode, struct file *file, uns
 		get_user(j, (int *)data);
 		if ((j < 0) || (j > DAHDI_LAW_ALAW))
 			return -EINVAL;
+		spin_lock_irqsave(&chan->lock, flags);
 		dahdi_set_law(chan, j);
+		spin_unlock_irqrestore(&chan->lock, flags);
 		break;
 	case DAHDI_SETLINEAR:
 		get_user(j, (int *)data);
@@ -4395,6 +5202,7 @@ static void do_ppp_calls(unsigned long data)
 {
 	struct dahdi_chan *chan = (struct dahdi_chan *) data;
 	struct sk_buff *skb;
+	int work = 0;
 
 	if (!chan->ppp)
 		return;
@@ -4402,8 +5210,12 @@ static void do_ppp_calls(unsigned long data)
 		chan->do_ppp_wakeup = 0;
 		ppp_output_wakeup(chan->ppp);
 	}
-	while ((skb = skb_dequeue(&chan->ppp_rq)) != NULL)
+	/* Don't hog the CPU when a lot has come in at once; come back
+	   for the rest */
+	while ((work++ < DAHDI_NET_WEIGHT) && (skb = skb_dequeue(&chan->ppp_rq)) != NULL)
 		ppp_input(chan->ppp, skb);
+	if (!skb_queue_empty(&chan->ppp_rq))
+		tasklet_schedule(&chan->ppp_calls);
 	if (chan->do_ppp_error) {
 		chan->do_ppp_error = 0;
 		ppp_input_error(chan->ppp, 0);
@@ -4414,7 +5226,9 @@ static void do_ppp_calls(unsigned long data)
 static int ioctl_echocancel(struct dahdi_chan *chan, struct dahdi_echocanparams *ecp, void *data)
 {
 	struct echo_can_state *ec = NULL, *tec;
+	struct dahdi_echocan *ecf, *tecf;
 	struct dahdi_echocanparam *params;
+	char name[DAHDI_MAX_ECHOCANNAME];
 	int ret;
 	unsigned long flags;
 
@@ -4426,14 +5240,17 @@ static int ioctl_echocancel(struct dahdi_chan *chan, struct dahdi_echocanparams
 		spin_lock_irqsave(&chan->lock, flags);
 		tec = chan->ec;
 		chan->ec = NULL;
+		tecf = chan->ec_factory;
+		chan->ec_factory = NULL;
 		chan->echocancel = 0;
 		chan->echostate = ECHO_STATE_IDLE;
 		chan->echolastupdate = 0;
 		chan->echotimer = 0;
+		dahdi_pipeline_update(chan);
 		spin_unlock_irqrestore(&chan->lock, flags);
 		hw_echocancel_off(chan);
 		if (tec)
-			echo_can_free(tec);
+			dahdi_echocan_free(tecf, tec);
 
 		return 0;
 	}
@@ -4459,10 +5276,14 @@ static int ioctl_echocancel(struct dahdi_chan *chan, struct dahdi_echocanparams
 	spin_lock_irqsave(&chan->lock, flags);
 	tec = chan->ec;
 	chan->ec = NULL;
+	tecf = chan->ec_factory;
+	chan->ec_factory = NULL;
+	dahdi_pipeline_update(chan);
+	memcpy(name, chan->echocan_name, sizeof(name));
 	spin_unlock_irqrestore(&chan->lock, flags);
 	
 	if (tec)
-		echo_can_free(tec);
+		dahdi_echocan_free(tecf, tec);
 
 	ret = -ENODEV;
 	
@@ -4488,17 +5309,24 @@ static int ioctl_echocancel(struct dahdi_chan *chan, struct dahdi_echocanparams
 			ecp->tap_length = deftaps;
 		}
 		
-		if ((ret = echo_can_create(ecp, params, &ec)))
+		if (!(ecf = dahdi_get_echocan(name)))
 			goto exit_with_free;
+
+		if ((ret = ecf->echo_can_create(ecp, params, &ec))) {
+			module_put(ecf->owner);
+			goto exit_with_free;
+		}
 		
 		spin_lock_irqsave(&chan->lock, flags);
 		chan->echocancel = ecp->tap_length;
 		chan->ec = ec;
+		chan->ec_factory = ecf;
 		chan->echostate = ECHO_STATE_IDLE;
 		chan->echolastupdate = 0;
 		chan->echotimer = 0;
 		echo_can_disable_detector_init(&chan->txecdis);
 		echo_can_disable_detector_init(&chan->rxecdis);
+		dahdi_pipeline_update(chan);
 		spin_unlock_irqrestore(&chan->lock, flags);
 	}
 
@@ -4516,6 +5344,7 @@ static int dahdi_chan_ioctl(struct inode *inode, struct file *file, unsigned int
 	int oldconf;
 	void *rxgain=NULL;
 	struct echo_can_state *ec;
+	struct dahdi_echocan *ecf;
 
 	if (!chan)
 		return -ENOSYS;
@@ -4569,6 +5398,8 @@ static int dahdi_chan_ioctl(struct inode *inode, struct file *file, unsigned int
 			memset(chan->conflast2, 0, sizeof(chan->conflast2));
 			ec = chan->ec;
 			chan->ec = NULL;
+			ecf = chan->ec_factory;
+			chan->ec_factory = NULL;
 			/* release conference resource, if any to release */
 			reset_conf(chan);
 			if (chan->gainalloc && chan->rxgain)
@@ -4579,15 +5410,17 @@ static int dahdi_chan_ioctl(struct inode *inode, struct file *file, unsigned int
 			chan->rxgain = defgain;
 			chan->txgain = defgain;
 			chan->gainalloc = 0;
+			dahdi_pipeline_update(chan);
 			/* Disable any native echo cancellation as well */
 			spin_unlock_irqrestore(&chan->lock, flags);
+			dahdi_update_active(chan);
 
 			hw_echocancel_off(chan);
 
 			if (rxgain)
 				kfree(rxgain);
 			if (ec)
-				echo_can_free(ec);
+				dahdi_echocan_free(ecf, ec);
 			if (oldconf) dahdi_check_conf(oldconf);
 		}
 		break;
@@ -4600,6 +5433,7 @@ static int dahdi_chan_ioctl(struct inode *inode, struct file *file, unsigned int
 				chan->ppp = kmalloc(sizeof(struct ppp_channel), GFP_KERNEL);
 				if (chan->ppp) {
 					struct echo_can_state *tec;
+					struct dahdi_echocan *tecf;
 					memset(chan->ppp, 0, sizeof(struct ppp_channel));
 					chan->ppp->private = chan;
 					chan->ppp->ops = &ztppp_ops;
@@ -4622,6 +5456,8 @@ static int dahdi_chan_ioctl(struct inode *inode, struct file *file, unsigned int
 					}
 					tec = chan->ec;
 					chan->ec = NULL;
+					tecf = chan->ec_factory;
+					chan->ec_factory = NULL;
 					chan->echocancel = 0;
 					chan->echostate = ECHO_STATE_IDLE;
 					chan->echolastupdate = 0;
@@ -4632,12 +5468,13 @@ static int dahdi_chan_ioctl(struct inode *inode, struct file *file, unsigned int
 					chan->rxgain = defgain;
 					chan->txgain = defgain;
 					chan->gainalloc = 0;
+					dahdi_pipeline_update(chan);
 					chan->flags &= ~DAHDI_FLAG_AUDIO;
 					chan->flags |= (DAHDI_FLAG_PPP | DAHDI_FLAG_HDLC | DAHDI_FLAG_FCS);
 					hw_echocancel_off(chan);
 					
 					if (tec)
-						echo_can_free(tec);
+						dahdi_echocan_free(tecf, tec);
 				} else
 					return -ENOMEM;
 			}
@@ -5041,6 +5878,9 @@ int dahdi_unregister(struct dahdi_span *span)
 	span->flags &= ~DAHDI_FLAG_REGISTERED;
 	for (x=0;x<span->channels;x++)
 		dahdi_chan_unreg(&span->chans[x]);
+#ifdef CONFIG_DAHDI_CONF_SHARDS
+	flush_workqueue(conf_shard_wq);
+#endif
 	new_maxspans = 0;
 	new_master = master; /* FIXME: locking */
 	if (master == span)
@@ -5217,7 +6057,8 @@ static void  __init dahdi_conv_init(void)
 #endif
 }
 
-static inline void __dahdi_process_getaudio_chunk(struct dahdi_chan *ss, unsigned char *txb)
+/* Returns 1 if the chunk only needed copying, 0 if it took the full path */
+static inline int __dahdi_process_getaudio_chunk(struct dahdi_chan *ss, unsigned char *txb)
 {
 	/* We transmit data from our master channel */
 	/* Called with ss->lock held */
@@ -5226,6 +6067,18 @@ static inline void __dahdi_process_getaudio_chunk(struct dahdi_chan *ss, unsigne
 	short getlin[DAHDI_CHUNKSIZE], k[DAHDI_CHUNKSIZE];
 	int x;
 
+	if (!ms->pipeline && !ms->confmute &&
+	    !(ms->echostate & __ECHO_STATE_MUTE) &&
+	    !(ms->v1_1 || ms->v2_1 || ms->v3_1)) {
+		/* Nothing to change; just keep the copies that other
+		   channels monitor and conference from */
+		memcpy(ms->getlin_lastchunk, ms->getlin, DAHDI_CHUNKSIZE * sizeof(short));
+		for (x=0;x<DAHDI_CHUNKSIZE;x++)
+			ms->getlin[x] = DAHDI_XLAW(txb[x], ms);
+		memcpy(ms->getraw, txb, DAHDI_CHUNKSIZE);
+		return 1;
+	}
+
 	/* Okay, now we've got something to transmit */
 	for (x=0;x<DAHDI_CHUNKSIZE;x++)
 		getlin[x] = DAHDI_XLAW(txb[x], ms);
@@ -5239,8 +6092,10 @@ static inline void __dahdi_process_getaudio_chunk(struct dahdi_chan *ss, unsigne
 				ms->echostate = ECHO_STATE_IDLE;
 				ms->echolastupdate = 0;
 				ms->echotimer = 0;
-				echo_can_free(ms->ec);
+				dahdi_echocan_free(ms->ec_factory, ms->ec);
 				ms->ec = NULL;
+				ms->ec_factory = NULL;
+				dahdi_pipeline_update(ms);
 				__qevent(ss, DAHDI_EVENT_EC_DISABLED);
 				break;
 			}
@@ -5449,15 +6304,87 @@ static inline void __dahdi_process_getaudio_chunk(struct dahdi_chan *ss, unsigne
 	/* if to make tx tone */
 	if (ms->v1_1 || ms->v2_1 || ms->v3_1)
 	{
+		/* This is what to send (after having applied gain) */
 		for (x=0;x<DAHDI_CHUNKSIZE;x++)
 		{
 			getlin[x] += dahdi_txtone_nextsample(ms);
-			txb[x] = DAHDI_LIN2X(getlin[x], ms);
+			txb[x] = ms->txgain[DAHDI_LIN2X(getlin[x], ms)];
 		}
+	} else if (ms->pipeline & DAHDI_PIPE_GAIN) {
+		/* This is what to send (after having applied gain) */
+		for (x=0;x<DAHDI_CHUNKSIZE;x++)
+			txb[x] = ms->txgain[txb[x]];
 	}
-	/* This is what to send (after having applied gain) */
-	for (x=0;x<DAHDI_CHUNKSIZE;x++)
-		txb[x] = ms->txgain[txb[x]];
+	return 0;
+}
+
+static void __dahdi_mmap_putbuf(struct dahdi_chan *ms, unsigned char *rxb, int bytes)
+{
+	/* Called with ms->lock held */
+	struct dahdi_mmap_area *area = ms->mmap;
+	struct dahdi_mmap_header *hdr = area->hdr;
+	unsigned int head = area->rxhead;
+	unsigned int fill, room, pos, left, thresh;
+
+	/* Everything in hdr can be scribbled on by userspace, so read
+	   each field once and never trust it to stay in range */
+	fill = head - hdr->rxtail;
+	thresh = hdr->rxthreshold;
+	smp_mb();
+	if (fill > DAHDI_MMAP_RINGSIZE)
+		fill = DAHDI_MMAP_RINGSIZE;
+	room = DAHDI_MMAP_RINGSIZE - fill;
+	if (bytes > room) {
+		hdr->rxoverruns += bytes - room;
+		bytes = room;
+	}
+	pos = head & (DAHDI_MMAP_RINGSIZE - 1);
+	left = DAHDI_MMAP_RINGSIZE - pos;
+	if (left > bytes)
+		left = bytes;
+	memcpy(hdr->rxdata + pos, rxb, left);
+	memcpy(hdr->rxdata, rxb + left, bytes - left);
+	smp_wmb();
+	area->rxhead = head + bytes;
+	hdr->rxhead = area->rxhead;
+	/* Only wake up poll() when we cross the threshold */
+	if (!thresh)
+		thresh = 1;
+	if ((fill < thresh) && (fill + bytes >= thresh))
+		wake_up_interruptible(&ms->sel);
+}
+
+static int __dahdi_mmap_getbuf(struct dahdi_chan *ms, unsigned char *txb, int bytes)
+{
+	/* Called with ms->lock held */
+	struct dahdi_mmap_area *area = ms->mmap;
+	struct dahdi_mmap_header *hdr = area->hdr;
+	unsigned int tail = area->txtail;
+	unsigned int fill, pos, left, thresh;
+
+	fill = hdr->txhead - tail;
+	thresh = hdr->txthreshold;
+	smp_rmb();
+	if (!fill)
+		return 0;
+	if (fill > DAHDI_MMAP_RINGSIZE)
+		fill = DAHDI_MMAP_RINGSIZE;
+	if (fill < bytes) {
+		hdr->txunderruns++;
+		bytes = fill;
+	}
+	pos = tail & (DAHDI_MMAP_RINGSIZE - 1);
+	left = DAHDI_MMAP_RINGSIZE - pos;
+	if (left > bytes)
+		left = bytes;
+	memcpy(txb, hdr->txdata + pos, left);
+	memcpy(txb + left, hdr->txdata, bytes - left);
+	smp_mb();
+	area->txtail = tail + bytes;
+	hdr->txtail = area->txtail;
+	if ((fill >= thresh) && (fill - bytes < thresh))
+		wake_up_interruptible(&ms->sel);
+	return bytes;
 }
 
 static inline void __dahdi_getbuf_chunk(struct dahdi_chan *ss, unsigned char *txb)
@@ -5474,47 +6401,63 @@ static inline void __dahdi_getbuf_chunk(struct dahdi_chan *ss, unsigned char *tx
 	/* How many bytes we need to process */
 	int bytes = DAHDI_CHUNKSIZE, left;
 	int x;
+	/* Frame queued by the network side, if any */
+	struct sk_buff *skb;
 
 	/* Let's pick something to transmit.  First source to
 	   try is our write-out buffer.  Always check it first because
 	   its our 'fast path' for whatever that's worth. */
 	while(bytes) {
-		if ((ms->outwritebuf > -1) && !ms->txdisable) {
-			buf= ms->writebuf[ms->outwritebuf];
-			left = ms->writen[ms->outwritebuf] - ms->writeidx[ms->outwritebuf];
+		if (ms->mmap && !(ms->flags & DAHDI_FLAG_HDLC) &&
+		    (left = __dahdi_mmap_getbuf(ms, txb, bytes))) {
+			/* The mmap()ed ring comes first when there is one */
+			txb += left;
+			bytes -= left;
+		} else if (((oldbuf = dahdi_outwritebuf(ms)) > -1) && !ms->txdisable) {
+			buf= ms->writebuf[oldbuf];
+			left = ms->writen[oldbuf] - ms->writeidx[oldbuf];
 			if (left > bytes)
 				left = bytes;
 			if (ms->flags & DAHDI_FLAG_HDLC) {
-				/* If this is an HDLC channel we only send a byte of
-				   HDLC. */
-				for(x=0;x<left;x++) {
-					if (ms->txhdlc.bits < 8)
-						/* Load a byte of data only if needed */
-						fasthdlc_tx_load_nocheck(&ms->txhdlc, buf[ms->writeidx[ms->outwritebuf]++]);
-					*(txb++) = fasthdlc_tx_run_nocheck(&ms->txhdlc);
+				/* Encode as much of the frame as fits, a piece
+				   at a time when it is a queued skb and its FCS */
+				skb = ms->writeskb[oldbuf];
+				if (skb && (ms->writeidx[oldbuf] < skb->len)) {
+					buf = skb->data + ms->writeidx[oldbuf];
+					left = skb->len - ms->writeidx[oldbuf];
+				} else {
+					/* The FCS of a queued skb is at the start
+					   of writebuf, past skb->len in the frame */
+					if (skb)
+						buf += ms->writeidx[oldbuf] - skb->len;
+					else
+						buf += ms->writeidx[oldbuf];
+					left = ms->writen[oldbuf] - ms->writeidx[oldbuf];
 				}
-				bytes -= left;
+				x = fasthdlc_tx_bulk(&ms->txhdlc, buf, left, txb, bytes, &left);
+				ms->writeidx[oldbuf] += left;
+				txb += x;
+				bytes -= x;
 			} else {
-				memcpy(txb, buf + ms->writeidx[ms->outwritebuf], left);
-				ms->writeidx[ms->outwritebuf]+=left;
+				memcpy(txb, buf + ms->writeidx[oldbuf], left);
+				ms->writeidx[oldbuf]+=left;
 				txb += left;
 				bytes -= left;
 			}
 			/* Check buffer status */
-			if (ms->writeidx[ms->outwritebuf] >= ms->writen[ms->outwritebuf]) {
+			if (ms->writeidx[oldbuf] >= ms->writen[oldbuf]) {
 				/* We've reached the end of our buffer.  Go to the next. */
-				oldbuf = ms->outwritebuf;
 				/* Clear out write index and such */
 				ms->writeidx[oldbuf] = 0;
-				ms->outwritebuf = (ms->outwritebuf + 1) % ms->numbufs;
 
 				if (!(ms->flags & DAHDI_FLAG_MTP2)) {
 					ms->writen[oldbuf] = 0;
-					if (ms->outwritebuf == ms->inwritebuf) {
-						/* Whoopsies, we're run out of buffers.  Mark ours
-						as -1 and wait for the filler to notify us that
-						there is something to write */
-						ms->outwritebuf = -1;
+					__dahdi_free_writeskb(ms, oldbuf);
+					/* Give the buffer back to the filler */
+					dahdi_ring_pop(ms, &ms->writetail);
+					if (dahdi_outwritebuf(ms) < 0) {
+						/* Whoopsies, we're run out of buffers.  Wait
+						for the filler to give us something to write */
 						if (ms->iomask & (DAHDI_IOMUX_WRITE | DAHDI_IOMUX_WRITEEMPTY))
 							wake_up_interruptible(&ms->eventbufq);
 						/* If we're only supposed to start when full, disable the transmitter */
@@ -5522,8 +6465,12 @@ static inline void __dahdi_getbuf_chunk(struct dahdi_chan *ss, unsigned char *tx
 							ms->txdisable = 1;
 					}
 				} else {
-					if (ms->outwritebuf == ms->inwritebuf) {
-						ms->outwritebuf = oldbuf;
+					/* MTP2 keeps sending the last buffer until
+					   there is another one behind it */
+					if (dahdi_ring_used(ms, ms->writehead, ms->writetail) > 1) {
+						__dahdi_free_writeskb(ms, oldbuf);
+						dahdi_ring_pop(ms, &ms->writetail);
+					} else {
 						if (ms->iomask & (DAHDI_IOMUX_WRITE | DAHDI_IOMUX_WRITEEMPTY))
 							wake_up_interruptible(&ms->eventbufq);
 						/* If we're only supposed to start when full, disable the transmitter */
@@ -5531,11 +6478,6 @@ static inline void __dahdi_getbuf_chunk(struct dahdi_chan *ss, unsigned char *tx
 							ms->txdisable = 1;
 					}
 				}
-				if (ms->inwritebuf < 0) {
-					/* The filler doesn't have a place to put data.  Now
-					that we're done with this buffer, notify them. */
-					ms->inwritebuf = oldbuf;
-				}
 /* In the very orignal driver, it was quite well known to me (Jim) that there
 was a possibility that a channel sleeping on a write block needed to
 be potentially woken up EVERY time a buffer was emptied, not just on the first
@@ -6031,11 +6973,9 @@ void dahdi_rbsbits(struct dahdi_chan *chan, int cursig)
 
 static inline void __dahdi_ec_chunk(struct dahdi_chan *ss, unsigned char *rxchunk, const unsigned char *txchunk)
 {
+	/* Called with ss->lock held */
 	short rxlin, txlin;
 	int x;
-	unsigned long flags;
-
-	spin_lock_irqsave(&ss->lock, flags);
 
 	if (ss->readchunkpreec) {
 		/* Save a copy of the audio before the echo can has its way with it */
@@ -6046,8 +6986,10 @@ static inline void __dahdi_ec_chunk(struct dahdi_chan *ss, unsigned char *rxchun
 
 	/* Perform echo cancellation on a chunk if necessary */
 	if (ss->ec) {
-#if defined(CONFIG_DAHDI_MMX) || defined(ECHO_CAN_FP)
+#ifdef CONFIG_DAHDI_MMX
 		dahdi_kernel_fpu_begin();
+#elif defined(DAHDI_ARITH_SIMD)
+		int simd = dahdi_simd_begin();
 #endif		
 		if (ss->echostate & __ECHO_STATE_MUTE) {
 			/* Special stuff for training the echo can */
@@ -6065,7 +7007,7 @@ static inline void __dahdi_ec_chunk(struct dahdi_chan *ss, unsigned char *rxchun
 					ss->echostate = ECHO_STATE_TRAINING;
 				}
 				if (ss->echostate == ECHO_STATE_TRAINING) {
-					if (echo_can_traintap(ss->ec, ss->echolastupdate++, rxlin)) {
+					if (ss->ec_factory->echo_can_traintap(ss->ec, ss->echolastupdate++, rxlin)) {
 #if 0
 						printk("Finished training (%d taps trained)!\n", ss->echolastupdate);
 #endif						
@@ -6075,43 +7017,55 @@ static inline void __dahdi_ec_chunk(struct dahdi_chan *ss, unsigned char *rxchun
 				rxlin = 0;
 				rxchunk[x] = DAHDI_LIN2X((int)rxlin, ss);
 			}
-		} else {
-#if !defined(DAHDI_EC_ARRAY_UPDATE)
-			for (x=0;x<DAHDI_CHUNKSIZE;x++) {
-				rxlin = DAHDI_XLAW(rxchunk[x], ss);
-				rxlin = echo_can_update(ss->ec, DAHDI_XLAW(txchunk[x], ss), rxlin);
-				rxchunk[x] = DAHDI_LIN2X((int) rxlin, ss);
-			}
-#else /* defined(DAHDI_EC_ARRAY_UPDATE) */
+		} else if (ss->ec_factory->echo_can_array_update) {
 			short rxlins[DAHDI_CHUNKSIZE], txlins[DAHDI_CHUNKSIZE];
 			for (x = 0; x < DAHDI_CHUNKSIZE; x++) {
 				rxlins[x] = DAHDI_XLAW(rxchunk[x], ss);
 				txlins[x] = DAHDI_XLAW(txchunk[x], ss);
 			}
-			echo_can_array_update(ss->ec, rxlins, txlins);
+			ss->ec_factory->echo_can_array_update(ss->ec, rxlins, txlins);
 			for (x = 0; x < DAHDI_CHUNKSIZE; x++)
 				rxchunk[x] = DAHDI_LIN2X((int) rxlins[x], ss);
-#endif /* defined(DAHDI_EC_ARRAY_UPDATE) */
+		} else {
+			for (x=0;x<DAHDI_CHUNKSIZE;x++) {
+				rxlin = DAHDI_XLAW(rxchunk[x], ss);
+				rxlin = ss->ec_factory->echo_can_update(ss->ec, DAHDI_XLAW(txchunk[x], ss), rxlin);
+				rxchunk[x] = DAHDI_LIN2X((int) rxlin, ss);
+			}
 		}
-#if defined(CONFIG_DAHDI_MMX) || defined(ECHO_CAN_FP)
+#ifdef CONFIG_DAHDI_MMX
 		kernel_fpu_end();
+#elif defined(DAHDI_ARITH_SIMD)
+		if (simd)
+			dahdi_simd_end();
 #endif		
 	}
-	spin_unlock_irqrestore(&ss->lock, flags);
 }
 
 void dahdi_ec_chunk(struct dahdi_chan *ss, unsigned char *rxchunk, const unsigned char *txchunk)
 {
+	unsigned long flags;
+
+	spin_lock_irqsave(&ss->lock, flags);
 	__dahdi_ec_chunk(ss, rxchunk, txchunk);
+	spin_unlock_irqrestore(&ss->lock, flags);
 }
 
 void dahdi_ec_span(struct dahdi_span *span)
 {
 	int x;
+	unsigned long flags;
+
+	/* One interrupt-off section for the whole span */
+	local_irq_save(flags);
 	for (x = 0; x < span->channels; x++) {
-		if (span->chans[x].ec)
+		if (span->chans[x].ec) {
+			spin_lock(&span->chans[x].lock);
 			__dahdi_ec_chunk(&span->chans[x], span->chans[x].readchunk, span->chans[x].writechunk);
+			spin_unlock(&span->chans[x].lock);
+		}
 	}
+	local_irq_restore(flags);
 }
 
 /* return 0 if nothing detected, 1 if lack of tone, 2 if presence of tone */
@@ -6163,7 +7117,8 @@ long x,y;
 	return(rv);		
 }
 
-static inline void __dahdi_process_putaudio_chunk(struct dahdi_chan *ss, unsigned char *rxb)
+/* Returns 1 if the chunk only needed copying, 0 if it took the full path */
+static inline int __dahdi_process_putaudio_chunk(struct dahdi_chan *ss, unsigned char *rxb)
 {
 	/* We transmit data from our master channel */
 	/* Called with ss->lock held */
@@ -6174,14 +7129,29 @@ static inline void __dahdi_process_putaudio_chunk(struct dahdi_chan *ss, unsigne
 
 	if (ms->dialing) ms->afterdialingtimer = 50;
 	else if (ms->afterdialingtimer) ms->afterdialingtimer--;
+	if (!ms->pipeline && !ms->confmute && !ms->afterdialingtimer) {
+		/* Straight through; pseudo channels keep putlin for
+		   themselves, as below */
+		if (!(ms->flags & DAHDI_FLAG_PSEUDO)) {
+			for (x=0;x<DAHDI_CHUNKSIZE;x++)
+				ms->putlin[x] = DAHDI_XLAW(rxb[x], ms);
+			memcpy(ms->putraw, rxb, DAHDI_CHUNKSIZE);
+		}
+		return 1;
+	}
 	if (ms->afterdialingtimer && (!(ms->flags & DAHDI_FLAG_PSEUDO))) {
 		/* Be careful since memset is likely a macro */
 		rxb[0] = DAHDI_LIN2X(0, ms);
 		memset(&rxb[1], rxb[0], DAHDI_CHUNKSIZE - 1);  /* receive as silence if dialing */
 	} 
-	for (x=0;x<DAHDI_CHUNKSIZE;x++) {
-		rxb[x] = ms->rxgain[rxb[x]];
-		putlin[x] = DAHDI_XLAW(rxb[x], ms);
+	if (ms->pipeline & DAHDI_PIPE_GAIN) {
+		for (x=0;x<DAHDI_CHUNKSIZE;x++) {
+			putlin[x] = ms->rxgainlin[rxb[x]];
+			rxb[x] = ms->rxgain[rxb[x]];
+		}
+	} else {
+		for (x=0;x<DAHDI_CHUNKSIZE;x++)
+			putlin[x] = DAHDI_XLAW(rxb[x], ms);
 	}
 
 #ifndef NO_ECHOCAN_DISABLE
@@ -6193,8 +7163,10 @@ static inline void __dahdi_process_putaudio_chunk(struct dahdi_chan *ss, unsigne
 				ms->echostate = ECHO_STATE_IDLE;
 				ms->echolastupdate = 0;
 				ms->echotimer = 0;
-				echo_can_free(ms->ec);
+				dahdi_echocan_free(ms->ec_factory, ms->ec);
 				ms->ec = NULL;
+				ms->ec_factory = NULL;
+				dahdi_pipeline_update(ms);
 				break;
 			}
 		}
@@ -6413,6 +7385,7 @@ static inline void __dahdi_process_putaudio_chunk(struct dahdi_chan *ss, unsigne
 			break;			
 		}
 	}
+	return 0;
 }
 
 /* HDLC (or other) receiver buffer functions for read side */
@@ -6431,7 +7404,13 @@ static inline void __putbuf_chunk(struct dahdi_chan *ss, unsigned char *rxb, int
 	int eof=0;
 	int abort=0;
 	int res;
-	int left, x;
+	int left, x, got;
+
+	if (ms->mmap && !(ms->flags & DAHDI_FLAG_HDLC)) {
+		/* Audio goes straight to the mmap()ed ring instead */
+		__dahdi_mmap_putbuf(ms, rxb, bytes);
+		return;
+	}
 
 	while(bytes) {
 #if defined(CONFIG_DAHDI_NET)  || defined(CONFIG_DAHDI_PPP)
@@ -6440,24 +7419,30 @@ static inline void __putbuf_chunk(struct dahdi_chan *ss, unsigned char *rxb, int
 		abort = 0;
 		eof = 0;
 		/* Next, figure out if we've got a buffer to receive into */
-		if (ms->inreadbuf > -1) {
+		if ((oldbuf = dahdi_inreadbuf(ms)) > -1) {
 			/* Read into the current buffer */
-			buf = ms->readbuf[ms->inreadbuf];
-			left = ms->blocksize - ms->readidx[ms->inreadbuf];
+			buf = ms->readbuf[oldbuf];
+			left = ms->blocksize - ms->readidx[oldbuf];
 			if (left > bytes)
 				left = bytes;
 			if (ms->flags & DAHDI_FLAG_HDLC) {
-				for (x=0;x<left;x++) {
-					/* Handle HDLC deframing */
-					fasthdlc_rx_load_nocheck(&ms->rxhdlc, *(rxb++));
-					bytes--;
-					res = fasthdlc_rx_run(&ms->rxhdlc);
-					/* If there is nothing there, continue */
-					if (res & RETURN_EMPTY_FLAG)
-						continue;
-					else if (res & RETURN_COMPLETE_FLAG) {
+				while (left > 0) {
+					/* Handle HDLC deframing, up to the next
+					   flag or abort */
+					res = fasthdlc_rx_bulk(&ms->rxhdlc, rxb, left,
+						buf + ms->readidx[oldbuf],
+						ms->blocksize - ms->readidx[oldbuf], &x, &got);
+					rxb += x;
+					left -= x;
+					bytes -= x;
+					ms->readidx[oldbuf] += got;
+					if (res & RETURN_COMPLETE_FLAG) {
 						/* Only count this if it's a non-empty frame */
-						if (ms->readidx[ms->inreadbuf]) {
+						if (ms->readidx[oldbuf]) {
+							/* The whole frame is in buf, so check
+							   its FCS in one go */
+							if (ms->flags & DAHDI_FLAG_FCS)
+								ms->infcs = dahdi_fcs(ms->infcs, buf, ms->readidx[oldbuf]);
 							if ((ms->flags & DAHDI_FLAG_FCS) && (ms->infcs != PPP_GOODFCS)) {
 								abort = DAHDI_EVENT_BADFCS;
 							} else
@@ -6468,36 +7453,30 @@ static inline void __putbuf_chunk(struct dahdi_chan *ss, unsigned char *rxb, int
 					} else if (res & RETURN_DISCARD_FLAG) {
 						/* This could be someone idling with 
 						  "idle" instead of "flag" */
-						if (!ms->readidx[ms->inreadbuf])
+						if (!ms->readidx[oldbuf])
 							continue;
 						abort = DAHDI_EVENT_ABORT;
 						break;
-					} else {
-						unsigned char rxc;
-						rxc = res;
-						ms->infcs = PPP_FCS(ms->infcs, rxc);
-						buf[ms->readidx[ms->inreadbuf]++] = rxc;
+					} else if (ms->readidx[oldbuf] >= ms->blocksize) {
 						/* Pay attention to the possibility of an overrun */
-						if (ms->readidx[ms->inreadbuf] >= ms->blocksize) {
-							if (!ss->span->alarms) 
-								printk(KERN_WARNING "HDLC Receiver overrun on channel %s (master=%s)\n", ss->name, ss->master->name);
-							abort=DAHDI_EVENT_OVERRUN;
-							/* Force the HDLC state back to frame-search mode */
-							ms->rxhdlc.state = 0;
-							ms->rxhdlc.bits = 0;
-							ms->readidx[ms->inreadbuf]=0;
-							break;
-						}
+						if (!ss->span->alarms) 
+							printk(KERN_WARNING "HDLC Receiver overrun on channel %s (master=%s)\n", ss->name, ss->master->name);
+						abort=DAHDI_EVENT_OVERRUN;
+						/* Force the HDLC state back to frame-search mode */
+						ms->rxhdlc.state = 0;
+						ms->rxhdlc.bits = 0;
+						ms->readidx[oldbuf]=0;
+						break;
 					}
 				}
 			} else {
 				/* Not HDLC */
-				memcpy(buf + ms->readidx[ms->inreadbuf], rxb, left);
+				memcpy(buf + ms->readidx[oldbuf], rxb, left);
 				rxb += left;
-				ms->readidx[ms->inreadbuf] += left;
+				ms->readidx[oldbuf] += left;
 				bytes -= left;
 				/* End of frame is decided by block size of 'N' */
-				eof = (ms->readidx[ms->inreadbuf] >= ms->blocksize);
+				eof = (ms->readidx[oldbuf] >= ms->blocksize);
 				if (eof && (ss->flags & DAHDI_FLAG_NOSTDTXRX)) {
 					eof = 0;
 					abort = DAHDI_EVENT_OVERRUN;
@@ -6505,11 +7484,10 @@ static inline void __putbuf_chunk(struct dahdi_chan *ss, unsigned char *rxb, int
 			}
 			if (eof)  {
 				/* Finished with this buffer, try another. */
-				oldbuf = ms->inreadbuf;
 				ms->infcs = PPP_INITFCS;
-				ms->readn[ms->inreadbuf] = ms->readidx[ms->inreadbuf];
+				ms->readn[oldbuf] = ms->readidx[oldbuf];
 #ifdef CONFIG_DAHDI_DEBUG
-				printk("EOF, len is %d\n", ms->readn[ms->inreadbuf]);
+				printk("EOF, len is %d\n", ms->readn[oldbuf]);
 #endif
 #if defined(CONFIG_DAHDI_NET) || defined(CONFIG_DAHDI_PPP)
 				if (ms->flags & (DAHDI_FLAG_NETDEV | DAHDI_FLAG_PPP)) {
@@ -6518,23 +7496,23 @@ static inline void __putbuf_chunk(struct dahdi_chan *ss, unsigned char *rxb, int
 					/* Our network receiver logic is MUCH
 					  different.  We actually only use a single
 					  buffer */
-					if (ms->readn[ms->inreadbuf] > 1) {
+					if (ms->readn[oldbuf] > 1) {
 						/* Drop the FCS */
-						ms->readn[ms->inreadbuf] -= 2;
+						ms->readn[oldbuf] -= 2;
 						/* Allocate an SKB */
 #ifdef CONFIG_DAHDI_PPP
 						if (!ms->do_ppp_error)
 #endif
-							skb = dev_alloc_skb(ms->readn[ms->inreadbuf]);
+							skb = dev_alloc_skb(ms->readn[oldbuf]);
 						if (skb) {
 							/* XXX Get rid of this memcpy XXX */
-							memcpy(skb->data, ms->readbuf[ms->inreadbuf], ms->readn[ms->inreadbuf]);
-							skb_put(skb, ms->readn[ms->inreadbuf]);
+							memcpy(skb->data, ms->readbuf[oldbuf], ms->readn[oldbuf]);
+							skb_put(skb, ms->readn[oldbuf]);
 #ifdef CONFIG_DAHDI_NET
 							if (ms->flags & DAHDI_FLAG_NETDEV) {
 								struct net_device_stats *stats = hdlc_stats(ms->hdlcnetdev->netdev);
 								stats->rx_packets++;
-								stats->rx_bytes += ms->readn[ms->inreadbuf];
+								stats->rx_bytes += ms->readn[oldbuf];
 							}
 #endif
 
@@ -6560,8 +7538,8 @@ static inline void __putbuf_chunk(struct dahdi_chan *ss, unsigned char *rxb, int
 					}
 					/* We don't cycle through buffers, just
 					reuse the same one */
-					ms->readn[ms->inreadbuf] = 0;
-					ms->readidx[ms->inreadbuf] = 0;
+					ms->readn[oldbuf] = 0;
+					ms->readidx[oldbuf] = 0;
 				} else 
 #endif
 				{
@@ -6573,32 +7551,29 @@ static inline void __putbuf_chunk(struct dahdi_chan *ss, unsigned char *rxb, int
 					int comparemessage;
 
 					if (ms->flags & DAHDI_FLAG_MTP2) {
-						comparemessage = (ms->inreadbuf - 1) & (ms->numbufs - 1);
+						comparemessage = (oldbuf ? oldbuf : ms->numbufs) - 1;
 
-						res = memcmp(ms->readbuf[comparemessage], ms->readbuf[ms->inreadbuf], ms->readn[ms->inreadbuf]);
+						res = memcmp(ms->readbuf[comparemessage], ms->readbuf[oldbuf], ms->readn[oldbuf]);
 					}
 
 					if ((ms->flags & DAHDI_FLAG_MTP2) && !res) {
 						/* Our messages are the same, so discard -
 						 * 	Don't advance buffers, reset indexes and buffer sizes. */
-						ms->readn[ms->inreadbuf] = 0;
-						ms->readidx[ms->inreadbuf] = 0;
+						ms->readn[oldbuf] = 0;
+						ms->readidx[oldbuf] = 0;
 					} else {
-						ms->inreadbuf = (ms->inreadbuf + 1) % ms->numbufs;
-						if (ms->inreadbuf == ms->outreadbuf) {
+						/* Hand the buffer over to the reader */
+						dahdi_ring_push(ms, &ms->readhead);
+						if (dahdi_inreadbuf(ms) < 0) {
 							/* Whoops, we're full, and have no where else
 							to store into at the moment.  We'll drop it
 							until there's a buffer available */
 #ifdef CONFIG_DAHDI_DEBUG
 							printk("Out of storage space\n");
 #endif
-							ms->inreadbuf = -1;
 							/* Enable the receiver in case they've got POLICY_WHEN_FULL */
 							ms->rxdisable = 0;
 						}
-						if (ms->outreadbuf < 0) { /* start out buffer if not already */
-							ms->outreadbuf = oldbuf;
-						}
 /* In the very orignal driver, it was quite well known to me (Jim) that there
 was a possibility that a channel sleeping on a receive block needed to
 be potentially woken up EVERY time a buffer was filled, not just on the first
@@ -6625,7 +7600,7 @@ out in the later versions, and is put back now. */
 			}
 			if (abort) {
 				/* Start over reading frame */
-				ms->readidx[ms->inreadbuf] = 0;
+				ms->readidx[oldbuf] = 0;
 				ms->infcs = PPP_INITFCS;
 
 #ifdef CONFIG_DAHDI_NET
@@ -6659,19 +7634,15 @@ out in the later versions, and is put back now. */
 			break;
 #ifdef CONFIG_DAHDI_NET
 		if (skb && (ms->flags & DAHDI_FLAG_NETDEV))
-#ifdef NEW_HDLC_INTERFACE
+#if defined(DAHDI_NET_NAPI)
 		{
-#if LINUX_VERSION_CODE <= KERNEL_VERSION(2,6,22)
-			skb->mac.raw = skb->data;
-#else
-			skb_reset_mac_header(skb);
-#endif
-			skb->dev = ztchan_to_dev(ms);
-#ifdef DAHDI_HDLC_TYPE_TRANS
-			skb->protocol = hdlc_type_trans(skb, ztchan_to_dev(ms));
-#else
-			skb->protocol = htons (ETH_P_HDLC);
-#endif
+			/* dahdi_net_poll() passes it up */
+			skb_queue_tail(&ms->hdlcnetdev->rxq, skb);
+			napi_schedule(&ms->hdlcnetdev->napi);
+		}
+#elif defined(NEW_HDLC_INTERFACE)
+		{
+			dahdi_net_rx(ztchan_to_dev(ms), skb);
 			netif_rx(skb);
 		}
 #else
@@ -6705,8 +7676,9 @@ static inline void __dahdi_putbuf_chunk(struct dahdi_chan *ss, unsigned char *rx
 
 static void __dahdi_hdlc_abort(struct dahdi_chan *ss, int event)
 {
-	if (ss->inreadbuf >= 0)
-		ss->readidx[ss->inreadbuf] = 0;
+	int inbuf = dahdi_inreadbuf(ss);
+	if (inbuf >= 0)
+		ss->readidx[inbuf] = 0;
 	if ((ss->flags & DAHDI_FLAG_OPEN) && !ss->span->alarms)
 		__qevent(ss->master, event);
 }
@@ -6724,9 +7696,10 @@ extern void dahdi_hdlc_putbuf(struct dahdi_chan *ss, unsigned char *rxb, int byt
 	unsigned long flags;
 	int res;
 	int left;
+	int inbuf;
 
 	spin_lock_irqsave(&ss->lock, flags);
-	if (ss->inreadbuf < 0) {
+	if ((inbuf = dahdi_inreadbuf(ss)) < 0) {
 #ifdef CONFIG_DAHDI_DEBUG
 		printk("No place to receive HDLC frame\n");
 #endif
@@ -6734,13 +7707,13 @@ extern void dahdi_hdlc_putbuf(struct dahdi_chan *ss, unsigned char *rxb, int byt
 		return;
 	}
 	/* Read into the current buffer */
-	left = ss->blocksize - ss->readidx[ss->inreadbuf];
+	left = ss->blocksize - ss->readidx[inbuf];
 	if (left > bytes)
 		left = bytes;
 	if (left > 0) {
-		memcpy(ss->readbuf[ss->inreadbuf] + ss->readidx[ss->inreadbuf], rxb, left);
+		memcpy(ss->readbuf[inbuf] + ss->readidx[inbuf], rxb, left);
 		rxb += left;
-		ss->readidx[ss->inreadbuf] += left;
+		ss->readidx[inbuf] += left;
 		bytes -= left;
 	}
 	/* Something isn't fit into buffer */
@@ -6761,7 +7734,7 @@ extern void dahdi_hdlc_finish(struct dahdi_chan *ss)
 
 	spin_lock_irqsave(&ss->lock, flags);
 
-	if ((oldreadbuf = ss->inreadbuf) < 0) {
+	if ((oldreadbuf = dahdi_inreadbuf(ss)) < 0) {
 #ifdef CONFIG_DAHDI_DEBUG
 		printk("No buffers to finish\n");
 #endif
@@ -6769,7 +7742,7 @@ extern void dahdi_hdlc_finish(struct dahdi_chan *ss)
 		return;
 	}
 
-	if (!ss->readidx[ss->inreadbuf]) {
+	if (!ss->readidx[oldreadbuf]) {
 #ifdef CONFIG_DAHDI_DEBUG
 		printk("Empty HDLC frame received\n");
 #endif
@@ -6777,18 +7750,14 @@ extern void dahdi_hdlc_finish(struct dahdi_chan *ss)
 		return;
 	}
 
-	ss->readn[ss->inreadbuf] = ss->readidx[ss->inreadbuf];
-	ss->inreadbuf = (ss->inreadbuf + 1) % ss->numbufs;
-	if (ss->inreadbuf == ss->outreadbuf) {
-		ss->inreadbuf = -1;
+	ss->readn[oldreadbuf] = ss->readidx[oldreadbuf];
+	dahdi_ring_push(ss, &ss->readhead);
+	if (dahdi_inreadbuf(ss) < 0) {
 #ifdef CONFIG_DAHDI_DEBUG
 		printk("Notifying reader data in block %d\n", oldreadbuf);
 #endif
 		ss->rxdisable = 0;
 	}
-	if (ss->outreadbuf < 0) {
-		ss->outreadbuf = oldreadbuf;
-	}
 
 	if (!ss->rxdisable) {
 		wake_up_interruptible(&ss->readbufq);
@@ -6809,9 +7778,13 @@ extern int dahdi_hdlc_getbuf(struct dahdi_chan *ss, unsigned char *bufptr, unsig
 	int oldbuf;
 
 	spin_lock_irqsave(&ss->lock, flags);
-	if (ss->outwritebuf > -1) {
-		buf = ss->writebuf[ss->outwritebuf];
-		left = ss->writen[ss->outwritebuf] - ss->writeidx[ss->outwritebuf];
+	if ((oldbuf = dahdi_outwritebuf(ss)) > -1) {
+		/* A queued skb holds the whole frame but its CRC */
+		if (ss->writeskb[oldbuf])
+			buf = ss->writeskb[oldbuf]->data;
+		else
+			buf = ss->writebuf[oldbuf];
+		left = ss->writen[oldbuf] - ss->writeidx[oldbuf];
 		/* Strip off the empty HDLC CRC end */
 		left -= 2;
 		if (left <= *size) {
@@ -6820,17 +7793,16 @@ extern int dahdi_hdlc_getbuf(struct dahdi_chan *ss, unsigned char *bufptr, unsig
 		} else
 			res = 0;
 
-		memcpy(bufptr, &buf[ss->writeidx[ss->outwritebuf]], *size);
-		ss->writeidx[ss->outwritebuf] += *size;
+		memcpy(bufptr, &buf[ss->writeidx[oldbuf]], *size);
+		ss->writeidx[oldbuf] += *size;
 
 		if (res) {
 			/* Rotate buffers */
-			oldbuf = ss->outwritebuf;
 			ss->writeidx[oldbuf] = 0;
 			ss->writen[oldbuf] = 0;
-			ss->outwritebuf = (ss->outwritebuf + 1) % ss->numbufs;
-			if (ss->outwritebuf == ss->inwritebuf) {
-				ss->outwritebuf = -1;
+			__dahdi_free_writeskb(ss, oldbuf);
+			dahdi_ring_pop(ss, &ss->writetail);
+			if (dahdi_outwritebuf(ss) < 0) {
 				if (ss->iomask & (DAHDI_IOMUX_WRITE | DAHDI_IOMUX_WRITEEMPTY))
 					wake_up_interruptible(&ss->eventbufq);
 				/* If we're only supposed to start when full, disable the transmitter */
@@ -6839,9 +7811,6 @@ extern int dahdi_hdlc_getbuf(struct dahdi_chan *ss, unsigned char *bufptr, unsig
 				res = -1;
 			}
 
-			if (ss->inwritebuf < 0)
-				ss->inwritebuf = oldbuf;
-
 			if (!(ss->flags & (DAHDI_FLAG_NETDEV | DAHDI_FLAG_PPP))) {
 				wake_up_interruptible(&ss->writebufq);
 				wake_up_interruptible(&ss->sel);
@@ -6859,26 +7828,80 @@ extern int dahdi_hdlc_getbuf(struct dahdi_chan *ss, unsigned char *bufptr, unsig
 }
 
 
-static void process_timers(void)
+static void dahdi_timer_wake(unsigned long data)
 {
 	unsigned long flags;
-	struct dahdi_timer *cur;
+	struct dahdi_timer_group *g;
+	struct dahdi_timer *cur, *next;
+	LIST_HEAD(wake);
 	spin_lock_irqsave(&zaptimerlock, flags);
-	cur = zaptimers;
-	while(cur) {
-		if (cur->ms) {
-			cur->pos -= DAHDI_CHUNKSIZE;
-			if (cur->pos <= 0) {
-				cur->tripped++;
-				cur->pos = cur->ms;
-				wake_up_interruptible(&cur->sel);
-			}
+	while (!list_empty(&timer_pending)) {
+		g = list_entry(timer_pending.next, struct dahdi_timer_group, pending);
+		list_del_init(&g->pending);
+		list_for_each_entry(cur, &g->timers, list) {
+			atomic_inc(&cur->refcount);
+			list_add_tail(&cur->wake, &wake);
 		}
-		cur = cur->next;
 	}
 	spin_unlock_irqrestore(&zaptimerlock, flags);
+	list_for_each_entry_safe(cur, next, &wake, wake) {
+		list_del_init(&cur->wake);
+		wake_up_interruptible(&cur->sel);
+		dahdi_timer_put(cur);
+	}
 }
 
+static DECLARE_TASKLET(timer_tasklet, dahdi_timer_wake, 0);
+
+static void process_timers(void)
+{
+	unsigned long flags;
+	struct dahdi_timer_group *cur, *next;
+	struct list_head *slot;
+	spin_lock_irqsave(&zaptimerlock, flags);
+	timer_ticks++;
+	slot = &timer_wheel[timer_ticks & (DAHDI_TIMER_WHEEL - 1)];
+	list_for_each_entry_safe(cur, next, slot, list) {
+		/* Groups longer than the wheel wait for a later turn */
+		if (cur->expires != timer_ticks)
+			continue;
+		cur->trips++;
+		timer_expirations += cur->count;
+		cur->expires += cur->period;
+		list_move_tail(&cur->list, &timer_wheel[cur->expires & (DAHDI_TIMER_WHEEL - 1)]);
+		if (list_empty(&cur->pending))
+			list_add_tail(&cur->pending, &timer_pending);
+	}
+	if (!list_empty(&timer_pending))
+		tasklet_schedule(&timer_tasklet);
+	if (!(timer_ticks % (8000 / DAHDI_CHUNKSIZE))) {
+		timer_rate = timer_expirations - timer_lastexp;
+		timer_lastexp = timer_expirations;
+	}
+	spin_unlock_irqrestore(&zaptimerlock, flags);
+}
+
+#ifdef CONFIG_PROC_FS
+static int dahdi_timer_proc_read(char *page, char **start, off_t off, int count, int *eof, void *data)
+{
+	int len = 0;
+
+	len += sprintf(page + len, "Timers: %d open, %d armed in %d groups\n",
+		timer_count, timer_armed, timer_groups);
+	len += sprintf(page + len, "Expirations: %lu total, %u/s\n",
+		timer_expirations, timer_rate);
+	if (len <= off) {
+		*eof = 1;
+		return 0;
+	}
+	*start = page + off;
+	len -= off;
+	if (len > count) len = count;
+	else *eof = 1;
+	return len;
+}
+#endif
+
 static unsigned int dahdi_timer_poll(struct file *file, struct poll_table_struct *wait_table)
 {
 	struct dahdi_timer *timer = file->private_data;
@@ -6887,7 +7910,7 @@ static unsigned int dahdi_timer_poll(struct file *file, struct poll_table_struct
 	if (timer) {
 		poll_wait(file, &timer->sel, wait_table);
 		spin_lock_irqsave(&zaptimerlock, flags);
-		if (timer->tripped || timer->ping) 
+		if (__dahdi_timer_tripped(timer) || timer->ping)
 			ret |= POLLPRI;
 		spin_unlock_irqrestore(&zaptimerlock, flags);
 	} else
@@ -6909,12 +7932,24 @@ dahdi_chan_poll(struct file *file, struct poll_table_struct *wait_table, int uni
 		poll_wait(file, &chan->sel, wait_table);
 		ret = 0; /* start with nothing to return */
 		spin_lock_irqsave(&chan->lock, flags);
-		   /* if at least 1 write buffer avail */
-		if (chan->inwritebuf > -1) {
-			ret |= POLLOUT | POLLWRNORM;
-		}
-		if ((chan->outreadbuf > -1) && !chan->rxdisable) {
-			ret |= POLLIN | POLLRDNORM;
+		if (chan->mmap) {
+			struct dahdi_mmap_area *area = chan->mmap;
+			unsigned int thresh = area->hdr->rxthreshold;
+			/* Go by the fill thresholds of the mmap()ed rings */
+			if (!thresh)
+				thresh = 1;
+			if (area->rxhead - area->hdr->rxtail >= thresh)
+				ret |= POLLIN | POLLRDNORM;
+			if (area->hdr->txhead - area->txtail < area->hdr->txthreshold)
+				ret |= POLLOUT | POLLWRNORM;
+		} else {
+			   /* if at least 1 write buffer avail */
+			if (dahdi_inwritebuf(chan) > -1) {
+				ret |= POLLOUT | POLLWRNORM;
+			}
+			if ((dahdi_outreadbuf(chan) > -1) && !chan->rxdisable) {
+				ret |= POLLIN | POLLRDNORM;
+			}
 		}
 		if (chan->eventoutidx != chan->eventinidx)
 		   {
@@ -6927,12 +7962,97 @@ dahdi_chan_poll(struct file *file, struct poll_table_struct *wait_table, int uni
 	return(ret);  /* return what we found */
 }
 
+static void dahdi_mmap_vm_open(struct vm_area_struct *vma)
+{
+	struct dahdi_mmap_area *area = vma->vm_private_data;
+	atomic_inc(&area->refcount);
+	atomic_inc(&area->mappings);
+}
+
+static void dahdi_mmap_vm_close(struct vm_area_struct *vma)
+{
+	dahdi_mmap_unmap(vma->vm_private_data);
+}
+
+static struct vm_operations_struct dahdi_mmap_vm_ops = {
+	.open = dahdi_mmap_vm_open,
+	.close = dahdi_mmap_vm_close,
+};
+
+static int dahdi_chan_mmap(struct file *file, struct vm_area_struct *vma, int unit)
+{
+	struct dahdi_chan *chan = chans[unit];
+	struct dahdi_mmap_area *area, *newarea = NULL;
+	unsigned long physical;
+	unsigned long flags;
+	int res;
+
+	if (!chan)
+		return -EINVAL;
+	/* Only audio goes through the rings, not HDLC frames */
+	if (chan->flags & (DAHDI_FLAG_HDLC | DAHDI_FLAG_NETDEV | DAHDI_FLAG_PPP))
+		return -EINVAL;
+	if (vma->vm_pgoff)
+		return -EINVAL;
+	if ((vma->vm_end - vma->vm_start) != PAGE_ALIGN(sizeof(struct dahdi_mmap_header)))
+		return -EINVAL;
+
+	if (!chan->mmap && !(newarea = dahdi_mmap_alloc()))
+		return -ENOMEM;
+	spin_lock_irqsave(&chan->lock, flags);
+	if (!chan->mmap) {
+		if (!newarea) {
+			/* Closed under us */
+			spin_unlock_irqrestore(&chan->lock, flags);
+			return -EINVAL;
+		}
+		newarea->chan = chan;
+		chan->mmap = newarea;
+		newarea = NULL;
+	}
+	area = chan->mmap;
+	/* This one is for the mapping */
+	atomic_inc(&area->refcount);
+	atomic_inc(&area->mappings);
+	spin_unlock_irqrestore(&chan->lock, flags);
+	if (newarea)
+		dahdi_mmap_put(newarea);
+
+	physical = (unsigned long) virt_to_phys(area->hdr);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,10)
+	res = remap_pfn_range(vma, vma->vm_start, physical >> PAGE_SHIFT, vma->vm_end - vma->vm_start, PAGE_SHARED);
+#else
+  #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,0)
+	res = remap_page_range(vma->vm_start, physical, vma->vm_end - vma->vm_start, PAGE_SHARED);
+  #else
+	res = remap_page_range(vma, vma->vm_start, physical, vma->vm_end - vma->vm_start, PAGE_SHARED);
+  #endif
+#endif
+	if (res) {
+		dahdi_mmap_unmap(area);
+		return -EAGAIN;
+	}
+	vma->vm_ops = &dahdi_mmap_vm_ops;
+	vma->vm_private_data = area;
+	return 0;
+}
+
 static int dahdi_mmap(struct file *file, struct vm_area_struct *vm)
 {
 	int unit = UNIT(file);
+	struct dahdi_chan *chan;
+
 	if (unit == 250)
 		return dahdi_transcode_fops->mmap(file, vm);
-	return -ENOSYS;
+	if (!unit || (unit == 253))
+		return -ENOSYS;
+	if ((unit == 254) || (unit == 255)) {
+		chan = file->private_data;
+		if (!chan)
+			return -EINVAL;
+		return dahdi_chan_mmap(file, vm, chan->channo);
+	}
+	return dahdi_chan_mmap(file, vm, unit);
 }
 
 static unsigned int dahdi_poll(struct file *file, struct poll_table_struct *wait_table)
@@ -6969,6 +8089,7 @@ static unsigned int dahdi_poll(struct file *file, struct poll_table_struct *wait
 static void __dahdi_transmit_chunk(struct dahdi_chan *chan, unsigned char *buf)
 {
 	unsigned char silly[DAHDI_CHUNKSIZE];
+	int fast;
 	/* Called with chan->lock locked */
 #ifdef	OPTIMIZE_CHANMUTE
 	if(likely(chan->chanmute))
@@ -6982,10 +8103,16 @@ static void __dahdi_transmit_chunk(struct dahdi_chan *chan, unsigned char *buf)
 #ifdef CONFIG_DAHDI_MMX
 		dahdi_kernel_fpu_begin();
 #endif
-		__dahdi_process_getaudio_chunk(chan, buf);
+		fast = __dahdi_process_getaudio_chunk(chan, buf);
 #ifdef CONFIG_DAHDI_MMX
 		kernel_fpu_end();
 #endif
+		if (chan->span) {
+			if (fast)
+				chan->span->fastchunks++;
+			else
+				chan->span->slowchunks++;
+		}
 	}
 }
 
@@ -7054,6 +8181,7 @@ static void __dahdi_receive_chunk(struct dahdi_chan *chan, unsigned char *buf)
 {
 	/* Receive chunk of audio -- called with chan->lock held */
 	unsigned char waste[DAHDI_CHUNKSIZE];
+	int fast;
 
 #ifdef	OPTIMIZE_CHANMUTE
 	if(likely(chan->chanmute))
@@ -7067,10 +8195,16 @@ static void __dahdi_receive_chunk(struct dahdi_chan *chan, unsigned char *buf)
 #ifdef CONFIG_DAHDI_MMX                         
 		dahdi_kernel_fpu_begin();
 #endif
-		__dahdi_process_putaudio_chunk(chan, buf);
+		fast = __dahdi_process_putaudio_chunk(chan, buf);
 #ifdef CONFIG_DAHDI_MMX
 		kernel_fpu_end();
 #endif
+		if (chan->span) {
+			if (fast)
+				chan->span->fastchunks++;
+			else
+				chan->span->slowchunks++;
+		}
 	}
 	__dahdi_putbuf_chunk(chan, buf);
 }
@@ -7090,16 +8224,278 @@ static inline void __dahdi_real_receive(struct dahdi_chan *chan)
 	}
 }
 
+#ifdef CONFIG_DAHDI_CONF_SHARDS
+static void dahdi_conf_shards_regroup(void)
+{
+	int x, a, b;
+
+	/* Called with bigzaplock held */
+	for (x = 0; x <= DAHDI_MAX_CONF; x++)
+		conf_group[x] = x;
+	for (x = 0; x < nactive_links; x++) {
+		a = conf_links[active_links[x]].src;
+		b = conf_links[active_links[x]].dst;
+		while (conf_group[a] != a)
+			a = conf_group[a];
+		while (conf_group[b] != b)
+			b = conf_group[b];
+		/* Always point to the lower one, so we can flatten in order */
+		if (a < b)
+			conf_group[b] = a;
+		else if (b < a)
+			conf_group[a] = b;
+	}
+	for (x = 1; x <= DAHDI_MAX_CONF; x++)
+		conf_group[x] = conf_group[conf_group[x]];
+	conf_groups_dirty = 0;
+}
+
+static inline int dahdi_conf_shard_key(struct dahdi_chan *chan)
+{
+	struct dahdi_chan *mon;
+
+	switch(chan->confmode & DAHDI_CONF_MODE_MASK) {
+	case DAHDI_CONF_NORMAL:
+		/* Plain pseudo channel, touches nobody else */
+		return chan->channo;
+	case DAHDI_CONF_CONF:
+	case DAHDI_CONF_CONFANN:
+	case DAHDI_CONF_CONFMON:
+	case DAHDI_CONF_CONFANNMON:
+	case DAHDI_CONF_REALANDPSEUDO:
+		return conf_group[chan->confna];
+	default:
+		/* Monitor modes: stay with the channel we are monitoring */
+		if ((chan->confna > 0) && (chan->confna < DAHDI_MAX_CHANNELS) &&
+		    (mon = chans[chan->confna]) &&
+		    ((mon->confmode & DAHDI_CONF_MODE_MASK) >= DAHDI_CONF_CONF) &&
+		    ((mon->confmode & DAHDI_CONF_MODE_MASK) <= DAHDI_CONF_REALANDPSEUDO))
+			return conf_group[mon->confna];
+		return chan->confna;
+	}
+}
+
+static void dahdi_conf_shards_catchup(void);
+
+static void dahdi_conf_shard_run(struct dahdi_conf_shard *shard)
+{
+	struct dahdi_chan *chan;
+	unsigned long flags;
+	int x, y, z, n;
+
+	read_lock(&conf_shard_lock);
+	/* do all the pseudo and/or conferenced channel receives (getbuf's) */
+	for (x = shard->pseudo_start; x < shard->pseudo_end; x++) {
+		chan = conf_shard_pseudo[x];
+		spin_lock_irqsave(&chan->lock, flags);
+		__dahdi_transmit_chunk(chan, NULL);
+		spin_unlock_irqrestore(&chan->lock, flags);
+	}
+	if (shard->link_start < shard->link_end) {
+		/* process the conf links of this shard */
+		n = shard->link_start;
+		for (x = shard->link_start; x < shard->link_end; x++) {
+			y = conf_shard_link[x];
+			if (((z = confalias[conf_links[y].dst]) > 0) &&
+			    ((y = confalias[conf_links[y].src]) > 0)) {
+				link_dst[n] = conf_sums[z];
+				link_src[n++] = conf_sums[y];
+			}
+		}
+#ifdef CONFIG_DAHDI_MMX
+		dahdi_kernel_fpu_begin();
+#endif
+		ACSS_BATCH(link_dst + shard->link_start, link_src + shard->link_start,
+			   n - shard->link_start);
+#ifdef CONFIG_DAHDI_MMX
+		kernel_fpu_end();
+#endif
+	}
+	/* do all the pseudo/conferenced channel transmits (putbuf's) */
+	for (x = shard->pseudo_start; x < shard->pseudo_end; x++) {
+		unsigned char tmp[DAHDI_CHUNKSIZE];
+		chan = conf_shard_pseudo[x];
+		spin_lock_irqsave(&chan->lock, flags);
+		__dahdi_getempty(chan, tmp);
+		__dahdi_receive_chunk(chan, tmp);
+		spin_unlock_irqrestore(&chan->lock, flags);
+	}
+	for (x = shard->real_start; x < shard->real_end; x++) {
+		u_char *data;
+		chan = conf_shard_real[x];
+		spin_lock_irqsave(&chan->lock, flags);
+		data = __buf_pushpeek(&chan->confout);
+		__dahdi_transmit_chunk(chan, data);
+		if (data)
+			__buf_push(&chan->confout, NULL, "conftransmit");
+		spin_unlock_irqrestore(&chan->lock, flags);
+	}
+	/* Pull in the conference receives for the next chunk, so they are
+	   summed into conf_sums_next before the master rotates the sums */
+	for (x = shard->real_start; x < shard->real_end; x++) {
+		u_char *data;
+		chan = conf_shard_real[x];
+		spin_lock_irqsave(&chan->lock, flags);
+		data = __buf_peek(&chan->confin);
+		__dahdi_receive_chunk(chan, data);
+		if (data)
+			__buf_pull(&chan->confin, NULL, chan, "confreceive");
+		spin_unlock_irqrestore(&chan->lock, flags);
+	}
+	read_unlock(&conf_shard_lock);
+	if (atomic_dec_and_test(&conf_shards_pending))
+		dahdi_conf_shards_catchup();
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,20)
+static void dahdi_conf_shard_work(struct work_struct *work)
+{
+	dahdi_conf_shard_run(container_of(work, struct dahdi_conf_shard, work));
+}
+#else
+static void dahdi_conf_shard_work(void *data)
+{
+	dahdi_conf_shard_run(data);
+}
+#endif
+
+/* Split the conference work of the next chunk among the shards and start
+   them.  Called from the master tick or dahdi_conf_shards_catchup() with
+   bigzaplock and active_lock held, only once the previous pass is
+   completely done. */
+static void dahdi_conf_shards_kick(void)
+{
+	int pseudos[DAHDI_MAX_CONF_SHARDS];
+	int reals[DAHDI_MAX_CONF_SHARDS];
+	int links[DAHDI_MAX_CONF_SHARDS];
+	struct dahdi_conf_shard *shard;
+	struct dahdi_chan *chan;
+	int x, n, s, busy;
+
+	if (conf_groups_dirty)
+		dahdi_conf_shards_regroup();
+
+	memset(pseudos, 0, sizeof(pseudos));
+	memset(reals, 0, sizeof(reals));
+	memset(links, 0, sizeof(links));
+	/* Pick each channel's shard exactly once, since conference modes may
+	   change under us.  Pseudo channels are stored as shard + 1,
+	   conferenced real channels as -(shard + 1). */
+	n = 0;
+	list_for_each_entry(chan, &active_pseudo_chans, active_node) {
+		s = dahdi_conf_shard_key(chan) % conf_nshards;
+		pseudos[s]++;
+		conf_shard_tmp[n] = chan;
+		conf_shard_tmpkey[n++] = s + 1;
+	}
+	list_for_each_entry(chan, &active_conf_chans, active_node) {
+		if (!chan->confmode)
+			continue;
+		s = dahdi_conf_shard_key(chan) % conf_nshards;
+		reals[s]++;
+		conf_shard_tmp[n] = chan;
+		conf_shard_tmpkey[n++] = -(s + 1);
+	}
+	for (x = 0; x < nactive_links; x++)
+		links[conf_group[conf_links[active_links[x]].dst] % conf_nshards]++;
+
+	/* Turn the counts into ranges */
+	for (s = 0; s < conf_nshards; s++) {
+		shard = &conf_shards[s];
+		shard->pseudo_start = shard->pseudo_end = s ? conf_shards[s - 1].pseudo_start + pseudos[s - 1] : 0;
+		shard->real_start = shard->real_end = s ? conf_shards[s - 1].real_start + reals[s - 1] : 0;
+		shard->link_start = shard->link_end = s ? conf_shards[s - 1].link_start + links[s - 1] : 0;
+	}
+	for (x = 0; x < n; x++) {
+		if (conf_shard_tmpkey[x] > 0) {
+			shard = &conf_shards[conf_shard_tmpkey[x] - 1];
+			conf_shard_pseudo[shard->pseudo_end++] = conf_shard_tmp[x];
+		} else {
+			shard = &conf_shards[-conf_shard_tmpkey[x] - 1];
+			conf_shard_real[shard->real_end++] = conf_shard_tmp[x];
+		}
+	}
+	for (x = 0; x < nactive_links; x++) {
+		shard = &conf_shards[conf_group[conf_links[active_links[x]].dst] % conf_nshards];
+		conf_shard_link[shard->link_end++] = active_links[x];
+	}
+
+	busy = 0;
+	for (s = 0; s < conf_nshards; s++) {
+		if (pseudos[s] || reals[s] || links[s])
+			busy++;
+	}
+	if (!busy)
+		return;
+	atomic_set(&conf_shards_pending, busy);
+	for (s = 0; s < conf_nshards; s++) {
+		if (!pseudos[s] && !reals[s] && !links[s])
+			continue;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,28)
+		queue_work_on(conf_shards[s].cpu, conf_shard_wq, &conf_shards[s].work);
+#else
+		/* No queue_work_on() here; the shards all run on this CPU */
+		queue_work(conf_shard_wq, &conf_shards[s].work);
+#endif
+	}
+}
+
+/* Called by the last shard of a pass: run the pass of a tick that came
+   while this one was still going, so its conference audio isn't lost */
+static void dahdi_conf_shards_catchup(void)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&bigzaplock, flags);
+	if (conf_shard_owed && !atomic_read(&conf_shards_pending)) {
+		conf_shard_owed--;
+		spin_lock(&active_lock);
+		rotate_sums();
+		dahdi_conf_shards_kick();
+		spin_unlock(&active_lock);
+		/* Nothing left to do, so nothing left to catch up */
+		if (!atomic_read(&conf_shards_pending))
+			conf_shard_owed = 0;
+	}
+	spin_unlock_irqrestore(&bigzaplock, flags);
+}
+
+static int dahdi_conf_shards_init(void)
+{
+	int cpu;
+
+	conf_shard_wq = create_workqueue("dahdi_conf");
+	if (!conf_shard_wq)
+		return -ENOMEM;
+	conf_nshards = 0;
+	for_each_online_cpu(cpu) {
+		if (conf_nshards >= DAHDI_MAX_CONF_SHARDS)
+			break;
+		conf_shards[conf_nshards++].cpu = cpu;
+	}
+	for (cpu = 0; cpu < conf_nshards; cpu++) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,20)
+		INIT_WORK(&conf_shards[cpu].work, dahdi_conf_shard_work);
+#else
+		INIT_WORK(&conf_shards[cpu].work, dahdi_conf_shard_work, &conf_shards[cpu]);
+#endif
+	}
+	return 0;
+}
+#endif /* CONFIG_DAHDI_CONF_SHARDS */
+
 int dahdi_transmit(struct dahdi_span *span)
 {
 	int x,y,z;
 	unsigned long flags;
 
 #if 1
+	/* Interrupts go off once for the span, not once per channel */
+	local_irq_save(flags);
 	for (x=0;x<span->channels;x++) {
-		spin_lock_irqsave(&span->chans[x].lock, flags);
+		spin_lock(&span->chans[x].lock);
 		if (span->chans[x].flags & DAHDI_FLAG_NOSTDTXRX) {
-			spin_unlock_irqrestore(&span->chans[x].lock, flags);
+			spin_unlock(&span->chans[x].lock);
 			continue;
 		}
 		if (&span->chans[x] == span->chans[x].master) {
@@ -7145,8 +8541,9 @@ int dahdi_transmit(struct dahdi_span *span)
 			}
 
 		}
-		spin_unlock_irqrestore(&span->chans[x].lock, flags);
+		spin_unlock(&span->chans[x].lock);
 	}
+	local_irq_restore(flags);
 	if (span->mainttimer) {
 		span->mainttimer -= DAHDI_CHUNKSIZE;
 		if (span->mainttimer <= 0) {
@@ -7161,18 +8558,24 @@ int dahdi_transmit(struct dahdi_span *span)
 	return 0;
 }
 
-int dahdi_receive(struct dahdi_span *span)
+static int __dahdi_receive(struct dahdi_span *span, int ec)
 {
-	int x,y,z;
+	int x,y,z,n;
 	unsigned long flags, flagso;
+	struct dahdi_chan *chan;
 
 #if 1
 #ifdef CONFIG_DAHDI_WATCHDOG
 	span->watchcounter--;
 #endif	
+	/* Interrupts go off once for the span, not once per channel */
+	local_irq_save(flags);
 	for (x=0;x<span->channels;x++) {
 		if (span->chans[x].master == &span->chans[x]) {
-			spin_lock_irqsave(&span->chans[x].lock, flags);
+			spin_lock(&span->chans[x].lock);
+			/* Echo cancel under the same hold of the lock */
+			if (ec && span->chans[x].ec)
+				__dahdi_ec_chunk(&span->chans[x], span->chans[x].readchunk, span->chans[x].writechunk);
 			if (span->chans[x].nextslave) {
 				/* Must process each slave at the same time */
 				u_char data[DAHDI_CHUNKSIZE];
@@ -7239,9 +8642,16 @@ int dahdi_receive(struct dahdi_span *span)
 					}
 				}
 			}
-			spin_unlock_irqrestore(&span->chans[x].lock, flags);
+			spin_unlock(&span->chans[x].lock);
+		} else if (ec && span->chans[x].ec) {
+			/* Bonded slaves carry data rather than audio, so
+			   their master has no cancelled audio to wait for */
+			spin_lock(&span->chans[x].lock);
+			__dahdi_ec_chunk(&span->chans[x], span->chans[x].readchunk, span->chans[x].writechunk);
+			spin_unlock(&span->chans[x].lock);
 		}
 	}
+	local_irq_restore(flags);
 
 	if (span == master) {
 		/* Hold the big zap lock for the duration of major
@@ -7253,64 +8663,81 @@ int dahdi_receive(struct dahdi_span *span)
 		   make it run */
 		if (dahdi_dynamic_ioctl)
 			dahdi_dynamic_ioctl(0,0);
-		for (x=1;x<maxchans;x++) {
-			if (chans[x] && chans[x]->confmode && !(chans[x]->flags & DAHDI_FLAG_PSEUDO)) {
-				u_char *data;
-				spin_lock_irqsave(&chans[x]->lock, flags);
-				data = __buf_peek(&chans[x]->confin);
-				__dahdi_receive_chunk(chans[x], data);
-				if (data)
-					__buf_pull(&chans[x]->confin, NULL,chans[x], "confreceive");
-				spin_unlock_irqrestore(&chans[x]->lock, flags);
-			}
+		spin_lock(&active_lock);
+#ifdef CONFIG_DAHDI_CONF_SHARDS
+		if (atomic_read(&conf_shards_pending)) {
+			/* Last pass isn't done yet, its last shard runs
+			   this one when it is */
+			conf_shard_overruns++;
+			if (conf_shard_owed < DAHDI_CONF_SHARD_MAXOWED)
+				conf_shard_owed++;
+			if (debug && printk_ratelimit())
+				printk("DAHDI conference pass overrun (%u)\n", conf_shard_overruns);
+		} else {
+			/* This is the master channel, so make things switch over */
+			rotate_sums();
+			dahdi_conf_shards_kick();
+		}
+#else
+		list_for_each_entry(chan, &active_conf_chans, active_node) {
+			u_char *data;
+			if (!chan->confmode)
+				continue;
+			spin_lock_irqsave(&chan->lock, flags);
+			data = __buf_peek(&chan->confin);
+			__dahdi_receive_chunk(chan, data);
+			if (data)
+				__buf_pull(&chan->confin, NULL, chan, "confreceive");
+			spin_unlock_irqrestore(&chan->lock, flags);
 		}
 		/* This is the master channel, so make things switch over */
 		rotate_sums();
 		/* do all the pseudo and/or conferenced channel receives (getbuf's) */
-		for (x=1;x<maxchans;x++) {
-			if (chans[x] && (chans[x]->flags & DAHDI_FLAG_PSEUDO)) {
-				spin_lock_irqsave(&chans[x]->lock, flags);
-				__dahdi_transmit_chunk(chans[x], NULL);
-				spin_unlock_irqrestore(&chans[x]->lock, flags);
-			}
+		list_for_each_entry(chan, &active_pseudo_chans, active_node) {
+			spin_lock_irqsave(&chan->lock, flags);
+			__dahdi_transmit_chunk(chan, NULL);
+			spin_unlock_irqrestore(&chan->lock, flags);
 		}
-		if (maxlinks) {
-#ifdef CONFIG_DAHDI_MMX
-			dahdi_kernel_fpu_begin();
-#endif			
+		if (nactive_links) {
 			  /* process all the conf links */
-			for(x = 1; x <= maxlinks; x++) {
+			for(x = 0, n = 0; x < nactive_links; x++) {
+				y = active_links[x];
 				  /* if we have a destination conf */
-				if (((z = confalias[conf_links[x].dst]) > 0) &&
-				    ((y = confalias[conf_links[x].src]) > 0)) {
-					ACSS(conf_sums[z], conf_sums[y]);
+				if (((z = confalias[conf_links[y].dst]) > 0) &&
+				    ((y = confalias[conf_links[y].src]) > 0)) {
+					link_dst[n] = conf_sums[z];
+					link_src[n++] = conf_sums[y];
 				}
 			}
+#ifdef CONFIG_DAHDI_MMX
+			dahdi_kernel_fpu_begin();
+#endif			
+			ACSS_BATCH(link_dst, link_src, n);
 #ifdef CONFIG_DAHDI_MMX
 			kernel_fpu_end();
 #endif			
 		}
 		/* do all the pseudo/conferenced channel transmits (putbuf's) */
-		for (x=1;x<maxchans;x++) {
-			if (chans[x] && (chans[x]->flags & DAHDI_FLAG_PSEUDO)) {
-				unsigned char tmp[DAHDI_CHUNKSIZE];
-				spin_lock_irqsave(&chans[x]->lock, flags);
-				__dahdi_getempty(chans[x], tmp);
-				__dahdi_receive_chunk(chans[x], tmp);
-				spin_unlock_irqrestore(&chans[x]->lock, flags);
-			}
+		list_for_each_entry(chan, &active_pseudo_chans, active_node) {
+			unsigned char tmp[DAHDI_CHUNKSIZE];
+			spin_lock_irqsave(&chan->lock, flags);
+			__dahdi_getempty(chan, tmp);
+			__dahdi_receive_chunk(chan, tmp);
+			spin_unlock_irqrestore(&chan->lock, flags);
 		}
-		for (x=1;x<maxchans;x++) {
-			if (chans[x] && chans[x]->confmode && !(chans[x]->flags & DAHDI_FLAG_PSEUDO)) {
-				u_char *data;
-				spin_lock_irqsave(&chans[x]->lock, flags);
-				data = __buf_pushpeek(&chans[x]->confout);
-				__dahdi_transmit_chunk(chans[x], data);
-				if (data)
-					__buf_push(&chans[x]->confout, NULL, "conftransmit");
-				spin_unlock_irqrestore(&chans[x]->lock, flags);
-			}
+		list_for_each_entry(chan, &active_conf_chans, active_node) {
+			u_char *data;
+			if (!chan->confmode)
+				continue;
+			spin_lock_irqsave(&chan->lock, flags);
+			data = __buf_pushpeek(&chan->confout);
+			__dahdi_transmit_chunk(chan, data);
+			if (data)
+				__buf_push(&chan->confout, NULL, "conftransmit");
+			spin_unlock_irqrestore(&chan->lock, flags);
 		}
+#endif /* CONFIG_DAHDI_CONF_SHARDS */
+		spin_unlock(&active_lock);
 #ifdef	DAHDI_SYNC_TICK
 		for (x=0;x<maxspans;x++) {
 			struct dahdi_span	*s = spans[x];
@@ -7325,6 +8752,16 @@ int dahdi_receive(struct dahdi_span *span)
 	return 0;
 }
 
+int dahdi_receive(struct dahdi_span *span)
+{
+	return __dahdi_receive(span, 0);
+}
+
+int dahdi_ec_receive(struct dahdi_span *span)
+{
+	return __dahdi_receive(span, 1);
+}
+
 MODULE_AUTHOR("Mark Spencer <markster@digium.com>");
 MODULE_DESCRIPTION("DAHDI Telephony Interface");
 #ifdef MODULE_LICENSE
@@ -7336,6 +8773,7 @@ MODULE_VERSION(DAHDI_VERSION);
 
 module_param(debug, int, 0644);
 module_param(deftaps, int, 0644);
+module_param(default_echocan, charp, 0444);
 
 static struct file_operations dahdi_fops = {
 	owner: THIS_MODULE,
@@ -7436,9 +8874,16 @@ int dahdi_unregister_chardev(struct dahdi_chardev *dev)
 
 static int __init dahdi_init(void) {
 	int res = 0;
+	int x;
+
+	for (x = 0; x < DAHDI_TIMER_WHEEL; x++)
+		INIT_LIST_HEAD(&timer_wheel[x]);
+	dahdi_fcs_init();
 
 #ifdef CONFIG_PROC_FS
 	proc_entries[0] = proc_mkdir("dahdi", NULL);
+	create_proc_read_entry("dahdi/conferences", 0444, NULL, dahdi_conf_proc_read, NULL);
+	create_proc_read_entry("dahdi/timers", 0444, NULL, dahdi_timer_proc_read, NULL);
 #endif
 
 #ifdef CONFIG_DAHDI_UDEV /* udev support functions */
@@ -7449,16 +8894,32 @@ static int __init dahdi_init(void) {
 	CLASS_DEV_CREATE(dahdi_class, MKDEV(DAHDI_MAJOR, 0), NULL, "dahdictl");
 #endif /* CONFIG_DAHDI_UDEV */
 
+#ifdef CONFIG_DAHDI_CONF_SHARDS
+	if ((res = dahdi_conf_shards_init())) {
+		printk(KERN_ERR "Unable to create DAHDI conference workqueue\n");
+		return res;
+	}
+#endif
+
 	if ((res = register_chrdev(DAHDI_MAJOR, "dahdi", &dahdi_fops))) {
 		printk(KERN_ERR "Unable to register DAHDI character device handler on %d\n", DAHDI_MAJOR);
+#ifdef CONFIG_DAHDI_CONF_SHARDS
+		destroy_workqueue(conf_shard_wq);
+#endif
 		return res;
 	}
 
 	printk(KERN_INFO "DAHDI Telephony Interface Registered on major %d\n", DAHDI_MAJOR);
 	printk(KERN_INFO "DAHDI Version: %s\n", DAHDI_VERSION);
+#if defined(ECHO_CAN_HPEC)
 	echo_can_init();
+	dahdi_register_echocan(&hpec_echocan);
+#endif
 	dahdi_conv_init();
 	fasthdlc_precalc();
+#ifdef DAHDI_ARITH_SIMD
+	dahdi_simd_init();
+#endif
 	rotate_sums();
 	rwlock_init(&chan_lock);
 #ifdef CONFIG_DAHDI_WATCHDOG
@@ -7470,7 +8931,11 @@ static int __init dahdi_init(void) {
 static void __exit dahdi_cleanup(void) {
 	int x;
 
+	tasklet_kill(&timer_tasklet);
+
 #ifdef CONFIG_PROC_FS
+	remove_proc_entry("dahdi/conferences", NULL);
+	remove_proc_entry("dahdi/timers", NULL);
 	remove_proc_entry("dahdi", NULL);
 #endif
 
@@ -7490,11 +8955,18 @@ static void __exit dahdi_cleanup(void) {
 
 	unregister_chrdev(DAHDI_MAJOR, "dahdi");
 
+#ifdef CONFIG_DAHDI_CONF_SHARDS
+	destroy_workqueue(conf_shard_wq);
+#endif
+
 #ifdef CONFIG_DAHDI_WATCHDOG
 	watchdog_cleanup();
 #endif
 
+#if defined(ECHO_CAN_HPEC)
+	dahdi_unregister_echocan(&hpec_echocan);
 	echo_can_shutdown();
+#endif
 }
 
 module_init(dahdi_init);
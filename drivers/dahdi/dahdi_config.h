@@ -54,11 +54,21 @@
  */
 /* #define CONFIG_DAHDI_MMX */
 
+/*
+ * Define to use SSE2, or AVX2 where the CPU has it, for the echo
+ * canceller convolutions and conference link sums on x86_64.  Which one
+ * is used is decided when the module loads.
+ */
+/* #define CONFIG_DAHDI_SIMD */
+
 /** If defined: the user must define exactly one ECHO_CAN_ var: */
 #ifndef ECHO_CAN_FROMENV 
 
 /*
- * Pick your echo canceller: MARK2, MARK3, STEVE, or STEVE2 :)
+ * Pick your default echo canceller: MARK2, MARK3, STEVE, or STEVE2 :)
+ * Each one is built as a module of its own (dahdi_echocan_*), and any
+ * channel can be switched to another one with DAHDI_ATTACH_ECHOCAN.
+ * The default can also be changed with the default_echocan parameter.
  * 
  */ 
 /* #define ECHO_CAN_STEVE */
@@ -80,6 +90,13 @@
  */
 /* #define AGGRESSIVE_SUPPRESSOR */
 #endif /* ifndef ECHO_CAN_FROMENV */
+
+#ifdef AGGRESSIVE_SUPPRESSOR
+#define DAHDI_ECHO_AGGRESSIVE " (aggressive)"
+#else
+#define DAHDI_ECHO_AGGRESSIVE ""
+#endif
+
 /*
  * Define to turn off the echo canceler disable tone detector,
  * which will cause dahdi to ignore the 2100 Hz echo cancel disable
@@ -194,4 +211,12 @@
  */
 /* #define	OPTIMIZE_CHANMUTE */
 
+/*
+ * Uncomment to split the master span's conference and pseudo channel
+ * work into per-conference shards that run in parallel on a per-CPU
+ * workqueue, instead of doing it all on one CPU under the big lock.
+ * Useful on SMP systems with many spans and conferences.
+ */
+/* #define CONFIG_DAHDI_CONF_SHARDS */
+
 #endif
@@ -65,11 +65,24 @@
  *                          the least significant channel, network byte order.
  *         the rest	    data for each channel, all samples per channel
                             before moving to the next.
+ *
+ *  Byte 0 may be any multiple of DAHDI_CHUNKSIZE up to
+ *  DAHDI_DYNAMIC_MAX_BATCH chunks, so one message can carry several
+ *  milliseconds of audio.  Received chunks go through a small jitter
+ *  buffer and are played out one per tick, whatever the sender batched.
+ *  Peers that only know single chunk messages reject the longer ones,
+ *  so batching ("chunks" parameter) is off unless both ends have it.
  */
 
 /* Arbitrary limit to the max # of channels in a span */
 #define DAHDI_DYNAMIC_MAX_CHANS	256
 
+/* Most chunks one message may carry */
+#define DAHDI_DYNAMIC_MAX_BATCH	8
+
+/* Received chunks we can hold per span (a power of two) */
+#define DAHDI_DYNAMIC_RXCHUNKS	32
+
 #define ZTD_FLAG_YELLOW_ALARM		(1 << 0)
 #define ZTD_FLAG_SIGBITS_PRESENT	(1 << 1)
 #define ZTD_FLAG_LOOPBACK			(1 << 2)
@@ -111,12 +124,25 @@ static struct dahdi_dynamic {
 	int timing;
 	int master;
 	unsigned char *msgbuf;
+	int hdrlen;		/* Header and sig bits ahead of the audio */
+	int txchunks;		/* Chunks per transmitted message */
+	int txchunk;		/* Chunks already in msgbuf */
+	unsigned char *rxbuf;	/* DAHDI_DYNAMIC_RXCHUNKS chunks of all channels */
+	unsigned int rxhead;	/* Chunks received */
+	unsigned int rxtail;	/* Chunks played out */
+	int rxdepth;		/* Chunks to buffer before playing out */
+	int rxplaying;
 } *dspans;
 
 static struct dahdi_dynamic_driver *drivers =  NULL;
 
 static int debug = 0;
 
+/* Chunks to send in each message, and extra chunks of received audio
+   to hold back against network jitter, for spans created from now on */
+static int chunks = 1;
+static int jitter = 0;
+
 static int hasmaster = 0;
 #ifdef DEFINE_SPINLOCK
 static DEFINE_SPINLOCK(dlock); 
@@ -167,31 +193,31 @@ static void ztd_sendmessage(struct dahdi_dynamic *z)
 {
 	unsigned char *buf = z->msgbuf;
 	unsigned short bits;
-	int msglen = 0;
+	int nsamp = z->txchunks * DAHDI_CHUNKSIZE;
 	int x;
 	int offset;
 
 	/* Byte 0: Number of samples per channel */
-	*buf = DAHDI_CHUNKSIZE;
-	buf++; msglen++;
+	*buf = nsamp;
+	buf++;
 
 	/* Byte 1: Flags */
 	*buf = 0;
 	if (z->span.alarms & DAHDI_ALARM_RED)
 		*buf |= ZTD_FLAG_YELLOW_ALARM;
 	*buf |= ZTD_FLAG_SIGBITS_PRESENT;
-	buf++; msglen++;
+	buf++;
 
 	/* Bytes 2-3: Transmit counter */
 	*((unsigned short *)buf) = htons((unsigned short)z->txcnt);
 	z->txcnt++;
-	buf++; msglen++;
-	buf++; msglen++;
+	buf++;
+	buf++;
 
 	/* Bytes 4-5: Number of channels */
 	*((unsigned short *)buf) = htons((unsigned short)z->span.channels);
-	buf++; msglen++;
-	buf++; msglen++;
+	buf++;
+	buf++;
 	bits = 0;
 	offset = 0;
 	for (x=0;x<z->span.channels;x++) {
@@ -200,8 +226,8 @@ static void ztd_sendmessage(struct dahdi_dynamic *z)
 		if (offset == 3) {
 			/* Write the bits when we have four channels */
 			*((unsigned short *)buf) = htons(bits);
-			buf++; msglen++;
-			buf++; msglen++;
+			buf++;
+			buf++;
 			bits = 0;
 		}
 	}
@@ -209,18 +235,59 @@ static void ztd_sendmessage(struct dahdi_dynamic *z)
 	if (offset != 3) {
 		/* Finish it off if it's not done already */
 		*((unsigned short *)buf) = htons(bits);
-		buf++; msglen++;
-		buf++; msglen++;
+		buf++;
+		buf++;
 	}
+
+	/* The audio is already in place after the header */
+	z->driver->transmit(z->pvt, z->msgbuf, z->hdrlen + z->span.channels * nsamp);
 	
+}
+
+/* Add this tick's audio to the message, sending it once it is full */
+static void ztd_queuechunk(struct dahdi_dynamic *z)
+{
+	int nsamp = z->txchunks * DAHDI_CHUNKSIZE;
+	unsigned char *buf = z->msgbuf + z->hdrlen + z->txchunk * DAHDI_CHUNKSIZE;
+	int x;
+
 	for (x=0;x<z->span.channels;x++) {
 		memcpy(buf, z->chans[x].writechunk, DAHDI_CHUNKSIZE);
+		buf += nsamp;
+	}
+	if (++z->txchunk >= z->txchunks) {
+		ztd_sendmessage(z);
+		z->txchunk = 0;
+	}
+}
+
+/* Play out the next received chunk, if the jitter buffer has one */
+static void ztd_playchunk(struct dahdi_dynamic *z)
+{
+	int chunklen = z->span.channels * DAHDI_CHUNKSIZE;
+	unsigned char *buf;
+	int x;
+
+	if (!z->rxplaying) {
+		if (z->rxhead - z->rxtail < z->rxdepth)
+			return;
+		z->rxplaying = 1;
+	}
+	if (z->rxhead == z->rxtail) {
+		/* Ran dry; keep the last chunk and build back up */
+		z->rxplaying = 0;
+		/* Reported like a clock slip, which it amounts to */
+		z->span.timingslips++;
+		if (debug)
+			printk("Span %s: Jitter buffer underrun\n", z->span.name);
+		return;
+	}
+	buf = z->rxbuf + (z->rxtail & (DAHDI_DYNAMIC_RXCHUNKS - 1)) * chunklen;
+	for (x=0;x<z->span.channels;x++) {
+		memcpy(z->chans[x].readchunk, buf, DAHDI_CHUNKSIZE);
 		buf += DAHDI_CHUNKSIZE;
-		msglen += DAHDI_CHUNKSIZE;
 	}
-	
-	z->driver->transmit(z->pvt, z->msgbuf, msglen);
-	
+	z->rxtail++;
 }
 
 static void __ztdynamic_run(void)
@@ -234,6 +301,9 @@ static void __ztdynamic_run(void)
 	while(z) {
 		if (!z->dead) {
 			/* Ignore dead spans */
+			/* Get the received chunk for this tick ready first, so
+			   that without jitter buffering it goes up at once */
+			ztd_playchunk(z);
 			for (y=0;y<z->span.channels;y++) {
 				/* Echo cancel double buffered data */
 				dahdi_ec_chunk(&z->span.chans[y], z->span.chans[y].readchunk, z->span.chans[y].writechunk);
@@ -241,7 +311,7 @@ static void __ztdynamic_run(void)
 			dahdi_receive(&z->span);
 			dahdi_transmit(&z->span);
 			/* Handle all transmissions now */
-			ztd_sendmessage(z);
+			ztd_queuechunk(z);
 		}
 		z = z->next;
 	}
@@ -260,10 +330,10 @@ static void __ztdynamic_run(void)
 }
 
 #ifdef ENABLE_TASKLETS
-static void ztdynamic_run(void)
+static void ztdynamic_run(int ticks)
 {
 	if (!taskletpending) {
-		taskletpending = 1;
+		taskletpending = ticks;
 		taskletsched++;
 		tasklet_hi_schedule(&ztd_tlet);
 	} else {
@@ -271,7 +341,11 @@ static void ztdynamic_run(void)
 	}
 }
 #else
-#define ztdynamic_run __ztdynamic_run
+static void ztdynamic_run(int ticks)
+{
+	while (ticks--)
+		__ztdynamic_run();
+}
 #endif
 
 void dahdi_dynamic_receive(struct dahdi_span *span, unsigned char *msg, int msglen)
@@ -285,6 +359,8 @@ void dahdi_dynamic_receive(struct dahdi_span *span, unsigned char *msg, int msgl
 	int nchans, master;
 	int newalarm;
 	unsigned short rxpos, rxcnt;
+	int nsamp, nchunks, chunklen, y;
+	unsigned char *buf;
 	
 	
 	spin_lock_irqsave(&dlock, flags);
@@ -299,11 +375,14 @@ void dahdi_dynamic_receive(struct dahdi_span *span, unsigned char *msg, int msgl
 	}
 	
 	/* First, check the chunksize */
-	if (*msg != DAHDI_CHUNKSIZE) {
+	nsamp = *msg;
+	nchunks = nsamp / DAHDI_CHUNKSIZE;
+	if ((nsamp % DAHDI_CHUNKSIZE) || !nchunks ||
+	    (nchunks > DAHDI_DYNAMIC_MAX_BATCH)) {
 		spin_unlock_irqrestore(&dlock, flags);
 		newerr = ERR_NSAMP | msg[0];
 		if (newerr != 	ztd->err) {
-			printk("Span %s: Expected %d samples, but receiving %d\n", span->name, DAHDI_CHUNKSIZE, msg[0]);
+			printk("Span %s: Expected a multiple of %d samples, but receiving %d\n", span->name, DAHDI_CHUNKSIZE, msg[0]);
 		}
 		ztd->err = newerr;
 		return;
@@ -335,7 +414,7 @@ void dahdi_dynamic_receive(struct dahdi_span *span, unsigned char *msg, int msgl
 	/* Start with header */
 	xlen = 6;
 	/* Add samples of audio */
-	xlen += nchans * DAHDI_CHUNKSIZE;
+	xlen += nchans * nsamp;
 	/* If RBS info is there, add that */
 	if (sflags & ZTD_FLAG_SIGBITS_PRESENT) {
 		/* Account for sigbits -- one short per 4 channels*/
@@ -374,10 +453,22 @@ void dahdi_dynamic_receive(struct dahdi_span *span, unsigned char *msg, int msgl
 		}
 	}
 	
-	/* Record data for channels */
-	for (x=0;x<nchans;x++) {
-		memcpy(span->chans[x].readchunk, msg, DAHDI_CHUNKSIZE);
-		msg += DAHDI_CHUNKSIZE;
+	/* Queue each chunk for playing out, dropping the oldest if the
+	   far end is getting ahead of us */
+	chunklen = nchans * DAHDI_CHUNKSIZE;
+	for (y=0;y<nchunks;y++) {
+		if (ztd->rxhead - ztd->rxtail >= DAHDI_DYNAMIC_RXCHUNKS) {
+			ztd->rxtail++;
+			ztd->span.timingslips++;
+			if (debug)
+				printk("Span %s: Jitter buffer overrun\n", ztd->span.name);
+		}
+		buf = ztd->rxbuf + (ztd->rxhead & (DAHDI_DYNAMIC_RXCHUNKS - 1)) * chunklen;
+		for (x=0;x<nchans;x++) {
+			memcpy(buf, msg + x * nsamp + y * DAHDI_CHUNKSIZE, DAHDI_CHUNKSIZE);
+			buf += DAHDI_CHUNKSIZE;
+		}
+		ztd->rxhead++;
 	}
 
 	master = ztd->master;
@@ -405,9 +496,10 @@ void dahdi_dynamic_receive(struct dahdi_span *span, unsigned char *msg, int msgl
 	if (rxpos != rxcnt)
 		printk("Span %s: Expected seq no %d, but received %d instead\n", span->name, rxcnt, rxpos);
 
-	/* If this is our master span, then run everything */
+	/* If this is our master span, then run everything, once for
+	   each millisecond the message carried */
 	if (master)
-		ztdynamic_run();
+		ztdynamic_run(nchunks);
 	
 }
 
@@ -425,6 +517,10 @@ static void dynamic_destroy(struct dahdi_dynamic *z)
 	if (z->msgbuf)
 		kfree(z->msgbuf);
 
+	/* And the jitter buffer */
+	if (z->rxbuf)
+		vfree(z->rxbuf);
+
 	/* Free channels */
 	if (z->chans)
 		vfree(z->chans);
@@ -582,8 +678,27 @@ static int create_dynamic(DAHDI_DYNAMIC_SPAN *zds)
 	/* Zero out channel stuff */
 	memset(z->chans, 0, sizeof(struct dahdi_chan) * zds->numchans);
 
+	z->txchunks = chunks;
+	if (z->txchunks < 1)
+		z->txchunks = 1;
+	if (z->txchunks > DAHDI_DYNAMIC_MAX_BATCH)
+		z->txchunks = DAHDI_DYNAMIC_MAX_BATCH;
+	/* Start playing out once this many chunks are waiting, leaving
+	   room for the largest message we accept on top of them */
+	z->rxdepth = 1 + (jitter > 0 ? jitter : 0);
+	if (z->rxdepth > DAHDI_DYNAMIC_RXCHUNKS - DAHDI_DYNAMIC_MAX_BATCH)
+		z->rxdepth = DAHDI_DYNAMIC_RXCHUNKS - DAHDI_DYNAMIC_MAX_BATCH;
+
+	z->rxbuf = vmalloc(DAHDI_DYNAMIC_RXCHUNKS * zds->numchans * DAHDI_CHUNKSIZE);
+	if (!z->rxbuf) {
+		dynamic_destroy(z);
+		return -ENOMEM;
+	}
+	memset(z->rxbuf, 0, DAHDI_DYNAMIC_RXCHUNKS * zds->numchans * DAHDI_CHUNKSIZE);
+
 	/* Allocate message buffer with sample space and header space */
-	bufsize = zds->numchans * DAHDI_CHUNKSIZE + zds->numchans / 4 + 48;
+	z->hdrlen = 6 + ((zds->numchans + 3) / 4) * 2;
+	bufsize = z->hdrlen + zds->numchans * DAHDI_CHUNKSIZE * z->txchunks;
 
 	z->msgbuf = kmalloc(bufsize, GFP_KERNEL);
 
@@ -676,8 +791,10 @@ static int create_dynamic(DAHDI_DYNAMIC_SPAN *zds)
 #ifdef ENABLE_TASKLETS
 static void ztd_tasklet(unsigned long data)
 {
+	int ticks = taskletpending;
+
 	taskletrun++;
-	if (taskletpending) {
+	while (ticks--) {
 		taskletexec++;
 		__ztdynamic_run();
 	}
@@ -695,7 +812,7 @@ static int ztdynamic_ioctl(unsigned int cmd, unsigned long data)
 		   spans are pulling timing, then now is the time to process
 		   them */
 		if (!hasmaster)
-			ztdynamic_run();
+			ztdynamic_run(1);
 		return 0;
 	case DAHDI_DYNAMIC_CREATE:
 		if (copy_from_user(&zds, (DAHDI_DYNAMIC_SPAN *)data, sizeof(zds)))
@@ -841,6 +958,8 @@ void ztdynamic_cleanup(void)
 }
 
 module_param(debug, int, 0600);
+module_param(chunks, int, 0600);
+module_param(jitter, int, 0600);
 
 MODULE_DESCRIPTION("DAHDI Dynamic Span Support");
 MODULE_AUTHOR("Mark Spencer <markster@digium.com>");
@@ -58,6 +58,7 @@ static struct ztdeth {
 	struct dahdi_span *span;
 	char ethdev[IFNAMSIZ];
 	struct net_device *dev;
+	int toobig;	/* Already complained the messages don't fit */
 	struct ztdeth *next;
 } *zdevs = NULL;
 
@@ -100,6 +101,13 @@ static int ztdeth_rcv(struct sk_buff *skb, struct net_device *dev, struct packet
 #endif	
 	if (span) {
 		skb_pull(skb, sizeof(struct ztdeth_header));
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,18)
+		/* Messages carrying several chunks may arrive in fragments */
+		if (skb_is_nonlinear(skb) && skb_linearize(skb)) {
+			kfree_skb(skb);
+			return 0;
+		}
+#endif
 		dahdi_dynamic_receive(span, (unsigned char *)skb->data, skb->len);
 	}
 	kfree_skb(skb);
@@ -156,6 +164,16 @@ static int ztdeth_transmit(void *pvt, unsigned char *msg, int msglen)
 		dev = z->dev;
 		memcpy(addr, z->addr, sizeof(z->addr));
 		subaddr = z->subaddr;
+		if (msglen + sizeof(struct ztdeth_header) > dev->mtu) {
+			/* Too many chunks per message for this device */
+			if (!z->toobig)
+				printk("TDMoE: %d byte messages for %s don't fit in the %d byte MTU of %s\n",
+					msglen, z->span->name, dev->mtu, dev->name);
+			z->toobig = 1;
+			spin_unlock_irqrestore(&zlock, flags);
+			return 0;
+		}
+		z->toobig = 0;
 		spin_unlock_irqrestore(&zlock, flags);
 		skb = dev_alloc_skb(msglen + dev->hard_header_len + sizeof(struct ztdeth_header) + 32);
 		if (skb) {
@@ -0,0 +1,66 @@
+/*
+ * DAHDI MG2 echo canceller module
+ *
+ * Registers the canceller in mg2ec.h with DAHDI, so that channels can be
+ * set to use it with DAHDI_ATTACH_ECHOCAN.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+#include <linux/kernel.h>
+#include <linux/errno.h>
+#include <linux/module.h>
+#include <linux/init.h>
+
+#include "dahdi_config.h"
+#include <dahdi/kernel.h>
+
+#include "mg2ec.h"
+
+static struct dahdi_echocan mg2_echocan = {
+	.name = "mg2",
+	.owner = THIS_MODULE,
+	.echo_can_create = echo_can_create,
+	.echo_can_free = echo_can_free,
+	.echo_can_update = echo_can_update,
+	.echo_can_array_update = echo_can_array_update,
+	.echo_can_traintap = echo_can_traintap,
+};
+
+static int __init mg2_init(void)
+{
+	int res;
+
+	if ((res = dahdi_register_echocan(&mg2_echocan)))
+		return res;
+	echo_can_init();
+	return 0;
+}
+
+static void __exit mg2_cleanup(void)
+{
+	dahdi_unregister_echocan(&mg2_echocan);
+	echo_can_shutdown();
+}
+
+MODULE_DESCRIPTION("DAHDI MG2 Echo Canceller");
+MODULE_AUTHOR("Michael Gernoth");
+#ifdef MODULE_LICENSE
+MODULE_LICENSE("GPL");
+#endif
+
+module_init(mg2_init);
+module_exit(mg2_cleanup);
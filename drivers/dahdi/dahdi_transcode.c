@@ -36,6 +36,14 @@
 #include <linux/mm.h>
 #include <linux/page-flags.h>
 #include <linux/moduleparam.h>
+#include <linux/workqueue.h>
+#include <linux/poll.h>
+#include <linux/proc_fs.h>
+#include <linux/jiffies.h>
+#include <linux/version.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,22)
+#include <linux/ktime.h>
+#endif
 #include <asm/io.h>
 
 #include <dahdi/kernel.h>
@@ -44,6 +52,53 @@
 static int debug = 0;
 static struct dahdi_transcoder *trans;
 static spinlock_t translock = SPIN_LOCK_UNLOCKED;
+/* Protects every frame ring, and the ring pointers in the channels */
+static spinlock_t ringlock = SPIN_LOCK_UNLOCKED;
+
+struct dahdi_tc_ring {
+	struct dahdi_transcode_ring *hdr;
+	struct dahdi_transcoder_channel *ztc;	/* Channel doing the work */
+	struct work_struct work;
+	/* Our own copies of the indices we move; the ones in hdr
+	   are only for userspace to look at */
+	unsigned int sqtail;
+	unsigned int cqhead;
+	/* The batch the transcoder is working on */
+	int inflight;
+	int done;
+	unsigned int cut;			/* dstdata bytes already posted */
+	unsigned long submitted;		/* When it went, from dahdi_tc_now() */
+	unsigned int user[DAHDI_TCRING_ENTRIES];
+	unsigned int ends[DAHDI_TCRING_ENTRIES];	/* Samples out at the end of each */
+};
+
+/* Latency is counted in buckets of up to 0.5 ms, 1 ms, 2 ms and so on,
+   with everything over the last bound in the last one */
+#define DAHDI_TC_LATBUCKETS 12
+
+struct dahdi_tc_stats {
+	unsigned int frames;			/* Completed */
+	unsigned int errors;			/* Of those, how many failed */
+	unsigned int busy;			/* Turned away with -EBUSY */
+	unsigned int busymax;			/* Most channels busy at once */
+	unsigned int latmax;			/* Worst latency, in usecs */
+	unsigned int lat[DAHDI_TC_LATBUCKETS];
+	/* For frames per second */
+	unsigned int lastframes;
+	unsigned int framerate;
+	unsigned long ratestamp;
+};
+
+#define DAHDI_TC_NUMFMTS 16
+
+/* Protects every dahdi_tc_stats; taken inside the other locks */
+static spinlock_t statlock = SPIN_LOCK_UNLOCKED;
+/* By source and destination format */
+static struct dahdi_tc_stats fmtstats[DAHDI_TC_NUMFMTS][DAHDI_TC_NUMFMTS];
+
+static void __dahdi_tc_ring_harvest(struct dahdi_tc_ring *ring);
+static void __dahdi_tc_ring_post(struct dahdi_tc_ring *ring, unsigned int user, int res,
+				 unsigned char *data, unsigned int len, unsigned int samples);
 
 EXPORT_SYMBOL(dahdi_transcoder_register);
 EXPORT_SYMBOL(dahdi_transcoder_unregister);
@@ -61,14 +116,21 @@ struct dahdi_transcoder *dahdi_transcoder_alloc(int numchans)
 		return NULL;
 
 	memset(ztc, 0, size);
+	if (!(ztc->stats = kmalloc(sizeof(*ztc->stats), GFP_KERNEL))) {
+		kfree(ztc);
+		return NULL;
+	}
+	memset(ztc->stats, 0, sizeof(*ztc->stats));
 	strcpy(ztc->name, "<unspecified>");
 	ztc->numchannels = numchans;
+	INIT_LIST_HEAD(&ztc->free);
 	for (x=0;x<ztc->numchannels;x++) {
 		init_waitqueue_head(&ztc->channels[x].ready);
 		ztc->channels[x].parent = ztc;
 		ztc->channels[x].offset = x;
 		ztc->channels[x].chan_built = 0;
 		ztc->channels[x].built_fmts = 0;
+		list_add_tail(&ztc->channels[x].free_node, &ztc->free);
 	}
 
 	return ztc;
@@ -95,9 +157,83 @@ static int schluffen(wait_queue_head_t *q)
 
 void dahdi_transcoder_free(struct dahdi_transcoder *ztc)
 {
+	kfree(ztc->stats);
 	kfree(ztc);
 }
 
+/* Time stamps for latencies, off a clock that never steps back.  Only
+   differences of them mean anything, so they may wrap. */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,22)
+static unsigned long dahdi_tc_now(void)
+{
+	return (unsigned long) ktime_to_us(ktime_get());
+}
+
+static unsigned int dahdi_tc_since(unsigned long stamp)
+{
+	return dahdi_tc_now() - stamp;
+}
+#else
+static unsigned long dahdi_tc_now(void)
+{
+	return jiffies;
+}
+
+static unsigned int dahdi_tc_since(unsigned long stamp)
+{
+	return jiffies_to_usecs(jiffies - stamp);
+}
+#endif
+
+static struct dahdi_tc_stats *dahdi_tc_fmtstats(unsigned int srcfmt, unsigned int dstfmt)
+{
+	int src = ffs(srcfmt) - 1, dst = ffs(dstfmt) - 1;
+
+	if ((src < 0) || (src >= DAHDI_TC_NUMFMTS) ||
+	    (dst < 0) || (dst >= DAHDI_TC_NUMFMTS))
+		return NULL;
+	return &fmtstats[src][dst];
+}
+
+static void __dahdi_tc_account(struct dahdi_tc_stats *st, unsigned int lat, int res)
+{
+	int x;
+
+	st->frames++;
+	if (res)
+		st->errors++;
+	else {
+		for (x = 0; x < DAHDI_TC_LATBUCKETS - 1; x++) {
+			if (lat < (500 << x))
+				break;
+		}
+		st->lat[x]++;
+		if (lat > st->latmax)
+			st->latmax = lat;
+	}
+	if (time_after_eq(jiffies, st->ratestamp + HZ)) {
+		st->framerate = (st->frames - st->lastframes) * HZ / (jiffies - st->ratestamp);
+		st->lastframes = st->frames;
+		st->ratestamp = jiffies;
+	}
+}
+
+/* Count a frame that was started at submitted, and has finished */
+static void dahdi_tc_account(struct dahdi_transcoder_channel *ztc, unsigned int srcfmt,
+			     unsigned int dstfmt, unsigned long submitted, int res)
+{
+	struct dahdi_tc_stats *st;
+	unsigned int lat = dahdi_tc_since(submitted);
+	unsigned long flags;
+
+	spin_lock_irqsave(&statlock, flags);
+	if (ztc->parent && ztc->parent->stats)
+		__dahdi_tc_account(ztc->parent->stats, lat, res);
+	if ((st = dahdi_tc_fmtstats(srcfmt, dstfmt)))
+		__dahdi_tc_account(st, lat, res);
+	spin_unlock_irqrestore(&statlock, flags);
+}
+
 /* Register a transcoder */
 int dahdi_transcoder_register(struct dahdi_transcoder *tc)
 {
@@ -157,8 +293,20 @@ int dahdi_transcoder_alert(struct dahdi_transcoder_channel *ztc)
 {
 	if (debug)
 		printk("DAHDI Transcoder Alert!\n");
+	/* Frames on a ring are counted as they're harvested */
+	if (ztc->tch && !ztc->ring && (ztc->tch->status & DAHDI_TC_FLAG_BUSY))
+		dahdi_tc_account(ztc, ztc->tch->srcfmt, ztc->tch->dstfmt,
+				 ztc->submitted, ztc->errorstatus);
 	if (ztc->tch)
 		ztc->tch->status &= ~DAHDI_TC_FLAG_BUSY;
+	if (ztc->ring) {
+		unsigned long flags;
+
+		spin_lock_irqsave(&ringlock, flags);
+		if (ztc->ring)
+			__dahdi_tc_ring_harvest(ztc->ring);
+		spin_unlock_irqrestore(&ringlock, flags);
+	}
 	wake_up_interruptible(&ztc->ready);
 
 	return 0;
@@ -194,6 +342,8 @@ static int dahdi_tc_open(struct inode *inode, struct file *file)
 	return 0;
 }
 
+static void dahdi_tc_ringoff(struct dahdi_transcoder_channel *ztc);
+
 static void ztc_release(struct dahdi_transcoder_channel *ztc)
 {
 	struct dahdi_transcode_header *zth = ztc->tch;
@@ -202,6 +352,18 @@ static void ztc_release(struct dahdi_transcoder_channel *ztc)
 	if (!ztc)
 		return;
 
+	dahdi_tc_ringoff(ztc);
+	if (ztc->parent && ztc->parent->flush)
+		ztc->parent->flush(ztc);
+
+	if (ztc->parent && (ztc->flags & DAHDI_TC_FLAG_BUSY)) {
+		/* Back on the free list, behind the ones that have been
+		   idle longer */
+		spin_lock(&translock);
+		list_add_tail(&ztc->free_node, &ztc->parent->free);
+		ztc->parent->busy--;
+		spin_unlock(&translock);
+	}
 	ztc->flags &= ~(DAHDI_TC_FLAG_BUSY);
 
 	if(ztc->tch) {
@@ -227,19 +389,38 @@ static int dahdi_tc_release(struct inode *inode, struct file *file)
 	return 0;
 }
 
+/* First free channel of tc that can do fmts; called with translock held */
+static struct dahdi_transcoder_channel *__dahdi_tc_getfree(struct dahdi_transcoder *tc, unsigned int fmts)
+{
+	struct dahdi_transcoder_channel *ztc;
+
+	/* Channels still built for other formats are the only ones we
+	   skip, so this rarely looks past the first */
+	list_for_each_entry(ztc, &tc->free, free_node) {
+		if (!ztc->chan_built || (ztc->built_fmts == fmts))
+			return ztc;
+	}
+	return NULL;
+}
+
 static int do_reset(struct dahdi_transcoder_channel **ztc)
 {
-	struct dahdi_transcoder_channel *newztc = NULL, *origztc = NULL;
+	struct dahdi_transcoder_channel *newztc = NULL, *origztc = NULL, *cand;
 	struct dahdi_transcode_header *zth = (*ztc)->tch;
-	struct dahdi_transcoder *tc;
-	unsigned int x;
+	struct dahdi_transcoder *tc, *best = NULL;
+	struct dahdi_tc_stats *st;
+	struct dahdi_tc_ring *ring;
 	unsigned int match = 0;
+	unsigned long flags;
+	int res, restart = 0;
 
 	if (((*ztc)->srcfmt != zth->srcfmt) ||
 	    ((*ztc)->dstfmt != zth->dstfmt)) {
-		/* Find new transcoder */
+		/* Find new transcoder: the least loaded one that can
+		   do these formats and has a channel to spare, leaving
+		   fallbacks for when nothing else has */
 		spin_lock(&translock);
-		for (tc = trans; tc && !newztc; tc = tc->next) {
+		for (tc = trans; tc; tc = tc->next) {
 			if (!(tc->srcfmts & zth->srcfmt))
 				continue;
 
@@ -247,36 +428,75 @@ static int do_reset(struct dahdi_transcoder_channel **ztc)
 				continue;
 
 			match = 1;
-			for (x = 0; x < tc->numchannels; x++) {
-				if (tc->channels[x].flags & DAHDI_TC_FLAG_BUSY)
-					continue;
-				if ((tc->channels[x].chan_built) && ((zth->srcfmt | zth->dstfmt) != tc->channels[x].built_fmts))
-					continue;
-
-				newztc = &tc->channels[x];
-				newztc->flags = DAHDI_TC_FLAG_BUSY;
-				break;
+			if (best && (tc->fallback > best->fallback))
+				continue;
+			if (best && (tc->fallback == best->fallback) &&
+			    (tc->busy * best->numchannels >= best->busy * tc->numchannels))
+				continue;
+			if (!(cand = __dahdi_tc_getfree(tc, zth->srcfmt | zth->dstfmt)))
+				continue;
+
+			best = tc;
+			newztc = cand;
+		}
+		if (newztc) {
+			list_del(&newztc->free_node);
+			best->busy++;
+			if (best->busy > best->stats->busymax)
+				best->stats->busymax = best->busy;
+			newztc->flags = DAHDI_TC_FLAG_BUSY;
+		} else if (match) {
+			/* Everything that could have done it was full */
+			spin_lock_irqsave(&statlock, flags);
+			for (tc = trans; tc; tc = tc->next) {
+				if ((tc->srcfmts & zth->srcfmt) && (tc->dstfmts & zth->dstfmt))
+					tc->stats->busy++;
 			}
+			if ((st = dahdi_tc_fmtstats(zth->srcfmt, zth->dstfmt)))
+				st->busy++;
+			spin_unlock_irqrestore(&statlock, flags);
 		}
 		spin_unlock(&translock);
 
 		if (!newztc)
 			return match ? -EBUSY : -ENOSYS;
 
-		/* Move transcoder header over */
+		/* Move transcoder header and frame ring over */
 		origztc = (*ztc);
 		(*ztc) = newztc;
 		(*ztc)->tch = origztc->tch;
 		origztc->tch = NULL;
+		spin_lock_irqsave(&ringlock, flags);
+		if ((ring = (*ztc)->ring = origztc->ring)) {
+			ring->ztc = (*ztc);
+			if (ring->inflight) {
+				/* The batch went to the old channel, which
+				   won't be telling us about it any more */
+				while (ring->done < ring->inflight)
+					__dahdi_tc_ring_post(ring, ring->user[ring->done++], -EIO, NULL, 0, 0);
+				ring->inflight = 0;
+				ring->done = 0;
+				ring->cut = 0;
+				(*ztc)->tch->status &= ~DAHDI_TC_FLAG_BUSY;
+				restart = 1;
+			}
+		}
+		origztc->ring = NULL;
+		spin_unlock_irqrestore(&ringlock, flags);
 		(*ztc)->flags |= (origztc->flags & ~(DAHDI_TC_FLAG_TRANSIENT));
 		ztc_release(origztc);
 	}
 
 	/* Actually reset the transcoder channel */
-	if ((*ztc)->parent && ((*ztc)->parent->operation))
-		return (*ztc)->parent->operation((*ztc), DAHDI_TCOP_ALLOCATE);
-
-	return -EINVAL;
+	if (!(*ztc)->parent || !((*ztc)->parent->operation))
+		return -EINVAL;
+	res = (*ztc)->parent->operation((*ztc), DAHDI_TCOP_ALLOCATE);
+	/* Go on with whatever was queued behind the lost batch */
+	if (restart && !res)
+		schedule_work(&(*ztc)->ring->work);
+	if (restart)
+		wake_up_interruptible(&(*ztc)->ready);
+	return res;
 }
 
 static int wait_busy(struct dahdi_transcoder_channel *ztc)
@@ -291,6 +511,324 @@ static int wait_busy(struct dahdi_transcoder_channel *ztc)
 	}
 }
 
+/* Samples in len bytes of fmt; 0 if we don't know how to count them */
+static unsigned int dahdi_tc_samples(unsigned int fmt, unsigned char *data, unsigned int len)
+{
+	unsigned int samples = 0;
+	unsigned int framelen;
+
+	switch(fmt) {
+	case DAHDI_FORMAT_ULAW:
+	case DAHDI_FORMAT_ALAW:
+		return len;
+	case DAHDI_FORMAT_SLINEAR:
+		return len / 2;
+	case DAHDI_FORMAT_G726:
+		return len * 2;
+	case DAHDI_FORMAT_G729A:
+		return (len / 10) * 80;
+	case DAHDI_FORMAT_G723_1:
+		/* The low two bits of each frame give its size */
+		while (len) {
+			switch (data[0] & 0x03) {
+			case 0x00:
+				framelen = 24;
+				break;
+			case 0x01:
+				framelen = 20;
+				break;
+			default:
+				framelen = 4;
+				break;
+			}
+			if (framelen > len)
+				break;
+			data += framelen;
+			len -= framelen;
+			samples += 240;
+		}
+		return samples;
+	}
+	return 0;
+}
+
+/* Samples in each frame the transcoder turns out in fmt */
+static unsigned int dahdi_tc_framesamples(unsigned int fmt)
+{
+	switch(fmt) {
+	case DAHDI_FORMAT_G726:
+		return 2;
+	case DAHDI_FORMAT_G729A:
+		return 80;
+	case DAHDI_FORMAT_G723_1:
+		return 240;
+	}
+	return 1;
+}
+
+/* Bytes that samples take in fmt, or 0 if that depends on the data */
+static unsigned int dahdi_tc_bytes(unsigned int fmt, unsigned int samples)
+{
+	switch(fmt) {
+	case DAHDI_FORMAT_ULAW:
+	case DAHDI_FORMAT_ALAW:
+		return samples;
+	case DAHDI_FORMAT_SLINEAR:
+		return samples * 2;
+	case DAHDI_FORMAT_G726:
+		return samples / 2;
+	}
+	return 0;
+}
+
+static void __dahdi_tc_ring_post(struct dahdi_tc_ring *ring, unsigned int user, int res,
+				 unsigned char *data, unsigned int len, unsigned int samples)
+{
+	struct dahdi_transcode_cqe *cqe;
+
+	cqe = &ring->hdr->cq[ring->cqhead & (DAHDI_TCRING_ENTRIES - 1)];
+	if (len > sizeof(cqe->dstdata)) {
+		len = 0;
+		res = -EOVERFLOW;
+	}
+	cqe->user = user;
+	cqe->res = res;
+	cqe->dstlen = len;
+	cqe->dstsamples = samples;
+	if (len)
+		memcpy(cqe->dstdata, data, len);
+	/* Make the entry visible before the index that hands it over */
+	wmb();
+	ring->hdr->cqhead = ++ring->cqhead;
+}
+
+/* Post whatever the batch has finished; called with ringlock held */
+static void __dahdi_tc_ring_harvest(struct dahdi_tc_ring *ring)
+{
+	struct dahdi_transcode_header *zth = ring->ztc->tch;
+	unsigned int dstlen = zth->dstlen;
+	unsigned int dstsamples = zth->dstsamples;
+	unsigned int start, len;
+	int res = ring->ztc->errorstatus;
+
+	/* The header is mapped, so don't trust what's in it */
+	if ((dstlen > sizeof(zth->dstdata)) || (dstlen < ring->cut))
+		res = -EIO;
+
+	while (ring->done < ring->inflight) {
+		if (!res && (dstsamples < ring->ends[ring->done]))
+			break;
+		dahdi_tc_account(ring->ztc, zth->srcfmt, zth->dstfmt, ring->submitted, res);
+		start = ring->done ? ring->ends[ring->done - 1] : 0;
+		if (res)
+			__dahdi_tc_ring_post(ring, ring->user[ring->done], res, NULL, 0, 0);
+		else {
+			/* Where the rate is fixed, several frames done at once
+			   can still be told apart */
+			len = dahdi_tc_bytes(zth->dstfmt, ring->ends[ring->done] - start);
+			if (!len || (len > dstlen - ring->cut))
+				len = dstlen - ring->cut;
+			__dahdi_tc_ring_post(ring, ring->user[ring->done], 0, zth->dstdata + ring->cut,
+					     len, ring->ends[ring->done] - start);
+			ring->cut += len;
+		}
+		ring->done++;
+	}
+	if (ring->inflight && (ring->done == ring->inflight)) {
+		/* Batch finished; start on the next one */
+		ring->inflight = 0;
+		schedule_work(&ring->work);
+	}
+}
+
+/* Hand the transcoder everything queued that we have room for */
+static void dahdi_tc_ring_start(struct dahdi_tc_ring *ring)
+{
+	struct dahdi_transcoder_channel *ztc;
+	struct dahdi_transcode_header *zth;
+	struct dahdi_transcode_ring *hdr = ring->hdr;
+	struct dahdi_transcode_sqe *sqe;
+	unsigned int sqhead, room, len, srclen = 0, samples = 0, frame, s;
+	unsigned long flags;
+	int n = 0;
+	int res;
+
+	spin_lock_irqsave(&ringlock, flags);
+	ztc = ring->ztc;
+	if (!ztc || ring->inflight || !ztc->parent || !ztc->parent->operation) {
+		spin_unlock_irqrestore(&ringlock, flags);
+		return;
+	}
+	zth = ztc->tch;
+	frame = dahdi_tc_framesamples(zth->dstfmt);
+
+	/* Everything in hdr can be scribbled on by userspace, so read
+	   each index once and never trust it to stay in range */
+	sqhead = hdr->sqhead;
+	if (sqhead - ring->sqtail > DAHDI_TCRING_ENTRIES)
+		sqhead = ring->sqtail;
+	room = ring->cqhead - hdr->cqtail;
+	room = (room > DAHDI_TCRING_ENTRIES) ? 0 : DAHDI_TCRING_ENTRIES - room;
+	rmb();
+
+	while ((ring->sqtail != sqhead) && room) {
+		sqe = &hdr->sq[ring->sqtail & (DAHDI_TCRING_ENTRIES - 1)];
+		len = sqe->srclen;
+		if (len > sizeof(sqe->srcdata))
+			len = 0;
+		if (srclen + len > sizeof(zth->srcdata))
+			break;
+		memcpy(zth->srcdata + srclen, sqe->srcdata, len);
+		/* Count the copy; the original can still change under us */
+		s = dahdi_tc_samples(zth->srcfmt, zth->srcdata + srclen, len);
+		s -= s % frame;
+		/* Keep the results within what dstdata can surely hold */
+		if (n && (samples + s > sizeof(zth->dstdata) / 2))
+			break;
+		if (!s || (s > sizeof(zth->dstdata) / 2)) {
+			/* Not a whole frame, too much, or nothing we understand */
+			__dahdi_tc_ring_post(ring, sqe->user, -EINVAL, NULL, 0, 0);
+		} else {
+			ring->user[n] = sqe->user;
+			samples += s;
+			ring->ends[n] = samples;
+			srclen += len;
+			n++;
+		}
+		ring->sqtail++;
+		room--;
+	}
+	hdr->sqtail = ring->sqtail;
+
+	if (!n) {
+		spin_unlock_irqrestore(&ringlock, flags);
+		wake_up_interruptible(&ztc->ready);
+		return;
+	}
+
+	zth->srcoffset = 0;
+	zth->srclen = srclen;
+	zth->dstoffset = 0;
+	zth->dstlen = 0;
+	zth->dstsamples = 0;
+	zth->status |= DAHDI_TC_FLAG_BUSY;
+	ztc->errorstatus = 0;
+	ring->inflight = n;
+	ring->done = 0;
+	ring->cut = 0;
+	ring->submitted = dahdi_tc_now();
+	spin_unlock_irqrestore(&ringlock, flags);
+
+	/* The results come back through dahdi_transcoder_alert() */
+	if ((res = ztc->parent->operation(ztc, DAHDI_TCOP_TRANSCODE))) {
+		spin_lock_irqsave(&ringlock, flags);
+		if (ring->ztc == ztc) {
+			zth->status &= ~DAHDI_TC_FLAG_BUSY;
+			ztc->errorstatus = res;
+			__dahdi_tc_ring_harvest(ring);
+		}
+		spin_unlock_irqrestore(&ringlock, flags);
+		wake_up_interruptible(&ztc->ready);
+	}
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,20)
+static void dahdi_tc_ring_work(struct work_struct *work)
+{
+	struct dahdi_tc_ring *ring = container_of(work, struct dahdi_tc_ring, work);
+#else
+static void dahdi_tc_ring_work(void *data)
+{
+	struct dahdi_tc_ring *ring = data;
+#endif
+	dahdi_tc_ring_start(ring);
+}
+
+static int dahdi_tc_ringon(struct dahdi_transcoder_channel *ztc)
+{
+	struct dahdi_tc_ring *ring;
+	struct dahdi_transcode_ring *hdr;
+	struct page *page;
+	unsigned long flags;
+
+	if (!ztc->tch)
+		return -EINVAL;
+	if (ztc->ring)
+		return 0;
+
+	if (!(ring = kmalloc(sizeof(*ring), GFP_KERNEL)))
+		return -ENOMEM;
+	hdr = (struct dahdi_transcode_ring *) __get_free_pages(GFP_KERNEL, get_order(sizeof(*hdr)));
+	if (!hdr) {
+		kfree(ring);
+		return -ENOMEM;
+	}
+	memset(ring, 0, sizeof(*ring));
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->magic = DAHDI_TCRING_MAGIC;
+	hdr->entries = DAHDI_TCRING_ENTRIES;
+	for (page = virt_to_page(hdr);
+	     page < virt_to_page((unsigned long) hdr + PAGE_ALIGN(sizeof(*hdr)));
+	     page++)
+		SetPageReserved(page);
+	ring->hdr = hdr;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,20)
+	INIT_WORK(&ring->work, dahdi_tc_ring_work);
+#else
+	INIT_WORK(&ring->work, dahdi_tc_ring_work, ring);
+#endif
+
+	spin_lock_irqsave(&ringlock, flags);
+	if (ztc->ring) {
+		/* Someone beat us to it */
+		spin_unlock_irqrestore(&ringlock, flags);
+		for (page = virt_to_page(hdr);
+		     page < virt_to_page((unsigned long) hdr + PAGE_ALIGN(sizeof(*hdr)));
+		     page++)
+			ClearPageReserved(page);
+		free_pages((unsigned long) hdr, get_order(sizeof(*hdr)));
+		kfree(ring);
+		return 0;
+	}
+	ring->ztc = ztc;
+	ztc->ring = ring;
+	spin_unlock_irqrestore(&ringlock, flags);
+
+	return 0;
+}
+
+static void dahdi_tc_ringoff(struct dahdi_transcoder_channel *ztc)
+{
+	struct dahdi_tc_ring *ring;
+	struct dahdi_transcode_ring *hdr;
+	struct page *page;
+	unsigned long flags;
+
+	spin_lock_irqsave(&ringlock, flags);
+	if ((ring = ztc->ring)) {
+		ztc->ring = NULL;
+		ring->ztc = NULL;
+	}
+	spin_unlock_irqrestore(&ringlock, flags);
+	if (!ring)
+		return;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,22)
+	cancel_work_sync(&ring->work);
+#else
+	flush_scheduled_work();
+#endif
+	/* Only called on release, so nothing has the ring mapped, and
+	   anything still in flight is simply forgotten */
+	hdr = ring->hdr;
+	for (page = virt_to_page(hdr);
+	     page < virt_to_page((unsigned long) hdr + PAGE_ALIGN(sizeof(*hdr)));
+	     page++)
+		ClearPageReserved(page);
+	free_pages((unsigned long) hdr, get_order(sizeof(*hdr)));
+	kfree(ring);
+}
+
 static int dahdi_tc_getinfo(unsigned long data)
 {
 	struct dahdi_transcode_info info;
@@ -345,10 +883,23 @@ static int dahdi_tc_ioctl(struct inode *inode, struct file *file, unsigned int c
 	case DAHDI_TCOP_TEST:
 		ret = ztc->parent->operation(ztc, DAHDI_TCOP_TEST);
 		break;
+	case DAHDI_TCOP_RINGON:
+		ret = dahdi_tc_ringon(ztc);
+		break;
+	case DAHDI_TCOP_SUBMIT:
+		if (!ztc->ring || !ztc->parent || !ztc->parent->operation)
+			return -EINVAL;
+		dahdi_tc_ring_start(ztc->ring);
+		ret = 0;
+		break;
 	case DAHDI_TCOP_TRANSCODE:
 		if (!ztc->parent->operation)
 			return -EINVAL;
+		/* The ring has the header's buffers while it's set up */
+		if (ztc->ring)
+			return -EBUSY;
 
+		ztc->submitted = dahdi_tc_now();
 		ztc->tch->status |= DAHDI_TC_FLAG_BUSY;
 		if (!(ret = ztc->parent->operation(ztc, DAHDI_TCOP_TRANSCODE))) {
 			/* Wait for busy to go away if we're not non-blocking */
@@ -356,8 +907,11 @@ static int dahdi_tc_ioctl(struct inode *inode, struct file *file, unsigned int c
 				if (!(ret = wait_busy(ztc)))
 					ret = ztc->errorstatus;
 			}
-		} else
+		} else {
 			ztc->tch->status &= ~DAHDI_TC_FLAG_BUSY;
+			dahdi_tc_account(ztc, ztc->tch->srcfmt, ztc->tch->dstfmt,
+					 ztc->submitted, ret);
+		}
 		break;
 	default:
 		ret = -ENOSYS;
@@ -366,6 +920,40 @@ static int dahdi_tc_ioctl(struct inode *inode, struct file *file, unsigned int c
 	return ret;
 }
 
+static int dahdi_tc_mmap_ring(struct dahdi_transcoder_channel *ztc, struct vm_area_struct *vma)
+{
+	unsigned long physical;
+	int res;
+
+	if (!ztc->ring)
+		return -EINVAL;
+
+	/* The ring takes up whole pages, and so does its mapping */
+	if ((vma->vm_end - vma->vm_start) != PAGE_ALIGN(sizeof(struct dahdi_transcode_ring))) {
+		if (debug)
+			printk("zttranscode: Attempted to mmap ring with size %d != %lu!\n", (int) (vma->vm_end - vma->vm_start), (unsigned long) PAGE_ALIGN(sizeof(struct dahdi_transcode_ring)));
+		return -EINVAL;
+	}
+
+	physical = (unsigned long) virt_to_phys(ztc->ring->hdr);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,10)
+	res = remap_pfn_range(vma, vma->vm_start, physical >> PAGE_SHIFT, PAGE_ALIGN(sizeof(struct dahdi_transcode_ring)), PAGE_SHARED);
+#else
+  #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,0)
+	res = remap_page_range(vma->vm_start, physical, PAGE_ALIGN(sizeof(struct dahdi_transcode_ring)), PAGE_SHARED);
+  #else
+	res = remap_page_range(vma, vma->vm_start, physical, PAGE_ALIGN(sizeof(struct dahdi_transcode_ring)), PAGE_SHARED);
+  #endif
+#endif
+	if (res) {
+		if (debug)
+			printk("zttranscode: ring remap failed!\n");
+		return -EAGAIN;
+	}
+
+	return 0;
+}
+
 static int dahdi_tc_mmap(struct file *file, struct vm_area_struct *vma)
 {
 	struct dahdi_transcoder_channel *ztc = file->private_data;
@@ -375,6 +963,9 @@ static int dahdi_tc_mmap(struct file *file, struct vm_area_struct *vma)
 	if (!ztc)
 		return -EINVAL;
 
+	if (vma->vm_pgoff == (DAHDI_TRANSCODE_RINGOFFSET >> PAGE_SHIFT))
+		return dahdi_tc_mmap_ring(ztc, vma);
+
 	/* Do not allow an offset */
 	if (vma->vm_pgoff) {
 		if (debug)
@@ -418,6 +1009,8 @@ static unsigned int dahdi_tc_poll(struct file *file, struct poll_table_struct *w
 		return -EINVAL;
 
 	poll_wait(file, &ztc->ready, wait_table);
+	if (ztc->ring)
+		return (ztc->ring->cqhead != ztc->ring->hdr->cqtail) ? POLLIN | POLLRDNORM : 0;
 	return ztc->tch->status & DAHDI_TC_FLAG_BUSY ? 0 : POLLPRI;
 }
 
@@ -441,6 +1034,92 @@ static struct dahdi_chardev transcode_chardev = {
 	.minor = 250,
 };
 
+#ifdef CONFIG_PROC_FS
+static const char *dahdi_tc_fmtnames[DAHDI_TC_NUMFMTS] = {
+	"g723.1", "gsm", "ulaw", "alaw", "g726", "adpcm", "slin", "lpc10",
+	"g729a", "speex", "ilbc",
+};
+
+static int dahdi_tc_sprint_stats(char *page, struct dahdi_tc_stats *st)
+{
+	int len = 0;
+	int x;
+
+	len += sprintf(page + len, "  %u frames, %u/s, %u failed, %u turned away busy, worst %u.%u ms\n",
+		st->frames, time_after(jiffies, st->ratestamp + 2 * HZ) ? 0 : st->framerate,
+		st->errors, st->busy, st->latmax / 1000, (st->latmax % 1000) / 100);
+	len += sprintf(page + len, " ");
+	for (x = 0; x < DAHDI_TC_LATBUCKETS; x++)
+		len += sprintf(page + len, " %u", st->lat[x]);
+	len += sprintf(page + len, "\n");
+	return len;
+}
+
+/* Can run to more than a page, so it's done an entry at a time */
+static int dahdi_tc_proc_read(char *page, char **start, off_t off, int count, int *eof, void *data)
+{
+	struct dahdi_transcoder *tc;
+	struct dahdi_tc_stats st;
+	unsigned long flags;
+	off_t begin = 0;
+	int len = 0;
+	int src, dst;
+
+	*eof = 0;
+	len += sprintf(page + len, "Latency buckets, in ms: <0.5 <1 <2 <4 <8 <16 <32 <64 <128 <256 <512 more\n");
+
+	spin_lock(&translock);
+	for (tc = trans; tc; tc = tc->next) {
+		spin_lock_irqsave(&statlock, flags);
+		st = *tc->stats;
+		spin_unlock_irqrestore(&statlock, flags);
+		len += sprintf(page + len, "\n%s: %d of %d channels busy, at most %u\n",
+			tc->name, tc->busy, tc->numchannels, st.busymax);
+		len += dahdi_tc_sprint_stats(page + len, &st);
+		if (len + begin < off) {
+			begin += len;
+			len = 0;
+		}
+		if (len + begin >= off + count)
+			break;
+	}
+	spin_unlock(&translock);
+
+	for (src = 0; (src < DAHDI_TC_NUMFMTS) && (len + begin < off + count); src++) {
+		for (dst = 0; dst < DAHDI_TC_NUMFMTS; dst++) {
+			spin_lock_irqsave(&statlock, flags);
+			st = fmtstats[src][dst];
+			spin_unlock_irqrestore(&statlock, flags);
+			if (!st.frames && !st.busy)
+				continue;
+			len += sprintf(page + len, "\n");
+			if (dahdi_tc_fmtnames[src])
+				len += sprintf(page + len, "%s", dahdi_tc_fmtnames[src]);
+			else
+				len += sprintf(page + len, "format %d", src);
+			if (dahdi_tc_fmtnames[dst])
+				len += sprintf(page + len, " to %s:\n", dahdi_tc_fmtnames[dst]);
+			else
+				len += sprintf(page + len, " to format %d:\n", dst);
+			len += dahdi_tc_sprint_stats(page + len, &st);
+			if (len + begin < off) {
+				begin += len;
+				len = 0;
+			}
+			if (len + begin >= off + count)
+				break;
+		}
+	}
+	if ((src == DAHDI_TC_NUMFMTS) && (len + begin < off + count))
+		*eof = 1;
+
+	if (off >= len + begin)
+		return 0;
+	*start = page + (off - begin);
+	return ((count < begin + len - off) ? count : begin + len - off);
+}
+#endif
+
 int zttranscode_init(void)
 {
 	int res;
@@ -455,6 +1134,10 @@ int zttranscode_init(void)
 	if ((res = dahdi_register_chardev(&transcode_chardev)))
 		return res;
 
+#ifdef CONFIG_PROC_FS
+	create_proc_read_entry("dahdi/transcoders", 0444, NULL, dahdi_tc_proc_read, NULL);
+#endif
+
 	printk("DAHDI Transcoder support loaded\n");
 
 	return 0;
@@ -462,6 +1145,9 @@ int zttranscode_init(void)
 
 void zttranscode_cleanup(void)
 {
+#ifdef CONFIG_PROC_FS
+	remove_proc_entry("dahdi/transcoders", NULL);
+#endif
 	dahdi_unregister_chardev(&transcode_chardev);
 
 	dahdi_transcode_fops = NULL;
@@ -0,0 +1,639 @@
+/*
+ * DAHDI software transcoder
+ *
+ * Registers a transcoder that does the conversions DAHDI can do on the
+ * CPU: mu-law, A-law, signed linear and 32 kbit/s G.726 (RFC 3551 bit
+ * order), in any combination.  It is marked as a fallback, so it only
+ * gets channels when no hardware transcoder has one to spare, and it can
+ * be used to exercise the transcoder interface on systems without any.
+ *
+ * Transcoding requests are handed to a per-CPU workqueue, on the CPU
+ * that made them, and completed with dahdi_transcoder_alert() as a
+ * hardware transcoder would.
+ *
+ * The G.726 coder follows the ITU-T G.726 reference algorithm, by way
+ * of the Sun Microsystems public implementation.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+#include <linux/kernel.h>
+#include <linux/errno.h>
+#include <linux/module.h>
+#include <linux/init.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/moduleparam.h>
+#include <linux/workqueue.h>
+
+#include "dahdi_config.h"
+#include <dahdi/kernel.h>
+
+#define SW_FORMATS (DAHDI_FORMAT_ULAW | DAHDI_FORMAT_ALAW | \
+		    DAHDI_FORMAT_SLINEAR | DAHDI_FORMAT_G726)
+
+/* Samples converted at a time, through a buffer on the stack */
+#define SW_BLOCK 160
+
+struct g726_state {
+	long yl;	/* Locked or steady state step size multiplier */
+	short yu;	/* Unlocked or non-steady state step size multiplier */
+	short dms;	/* Short term energy estimate */
+	short dml;	/* Long term energy estimate */
+	short ap;	/* Linear weighting coefficient of yl and yu */
+	short a[2];	/* Coefficients of pole portion of prediction filter */
+	short b[6];	/* Coefficients of zero portion of prediction filter */
+	short pk[2];	/* Signs of previous two samples of a partially
+			   reconstructed signal */
+	short dq[6];	/* Previous 6 samples of the quantized difference
+			   signal, in an internal floating point format */
+	short sr[2];	/* Previous 2 samples of the reconstructed signal,
+			   in the same format */
+	char td;	/* Delayed tone detect */
+};
+
+struct sw_chan {
+	struct dahdi_transcoder_channel *ztc;
+	struct dahdi_transcode_header *zth;	/* As it was when queued */
+	struct work_struct work;
+	struct g726_state dec;
+	struct g726_state enc;
+	/* G.726 out of an odd number of samples leaves half a byte */
+	unsigned char nibble;
+	int half;
+};
+
+static int numchannels = 64;
+static int debug = 0;
+
+static struct dahdi_transcoder *sw_tc;
+static struct sw_chan *sw_chans;
+static struct workqueue_struct *sw_wq;
+
+static short power2[15] = {1, 2, 4, 8, 0x10, 0x20, 0x40, 0x80,
+			   0x100, 0x200, 0x400, 0x800, 0x1000, 0x2000, 0x4000};
+
+/* 32 kbit/s quantizer decision levels, and per code: the reconstructed
+   log magnitude, scale factor multiplier and transition weighting */
+static short qtab_721[7] = {-124, 80, 178, 246, 300, 349, 400};
+static short dqlntab[16] = {-2048, 4, 135, 213, 273, 323, 373, 425,
+			    425, 373, 323, 273, 213, 135, 4, -2048};
+static short witab[16] = {-12, 18, 41, 64, 112, 198, 355, 1122,
+			  1122, 355, 198, 112, 64, 41, 18, -12};
+static short fitab[16] = {0, 0, 0, 0x200, 0x200, 0x200, 0x600, 0xE00,
+			  0xE00, 0x600, 0x200, 0x200, 0x200, 0, 0, 0};
+
+static void g726_init(struct g726_state *s)
+{
+	int x;
+
+	memset(s, 0, sizeof(*s));
+	s->yl = 34816;
+	s->yu = 544;
+	for (x = 0; x < 2; x++)
+		s->sr[x] = 32;
+	for (x = 0; x < 6; x++)
+		s->dq[x] = 32;
+}
+
+/* Index of the first entry in table that val is less than */
+static int quan(int val, short *table, int size)
+{
+	int i;
+
+	for (i = 0; i < size; i++) {
+		if (val < table[i])
+			break;
+	}
+	return i;
+}
+
+/* Multiply a predictor coefficient by a sample in the internal
+   floating point format */
+static int fmult(int an, int srn)
+{
+	int anmag, anexp, anmant;
+	int wanexp, wanmant;
+	int retval;
+
+	anmag = (an > 0) ? an : ((-an) & 0x1FFF);
+	anexp = quan(anmag, power2, 15) - 6;
+	anmant = (anmag == 0) ? 32 :
+		 (anexp >= 0) ? anmag >> anexp : anmag << -anexp;
+	wanexp = anexp + ((srn >> 6) & 0xF) - 13;
+
+	wanmant = (anmant * (srn & 077) + 0x30) >> 4;
+	retval = (wanexp >= 0) ? ((wanmant << wanexp) & 0x7FFF) :
+		 (wanmant >> -wanexp);
+
+	return ((an ^ srn) < 0) ? -retval : retval;
+}
+
+static int predictor_zero(struct g726_state *s)
+{
+	int i;
+	int sezi;
+
+	sezi = fmult(s->b[0] >> 2, s->dq[0]);
+	for (i = 1; i < 6; i++)
+		sezi += fmult(s->b[i] >> 2, s->dq[i]);
+	return sezi;
+}
+
+static int predictor_pole(struct g726_state *s)
+{
+	return fmult(s->a[1] >> 2, s->sr[1]) + fmult(s->a[0] >> 2, s->sr[0]);
+}
+
+static int step_size(struct g726_state *s)
+{
+	int y, dif, al;
+
+	if (s->ap >= 256)
+		return s->yu;
+
+	y = s->yl >> 6;
+	dif = s->yu - y;
+	al = s->ap >> 2;
+	if (dif > 0)
+		y += (dif * al) >> 6;
+	else if (dif < 0)
+		y += (dif * al + 0x3F) >> 6;
+	return y;
+}
+
+static int quantize(int d, int y, short *table, int size)
+{
+	int dqm, exp, mant, dl, dln, i;
+
+	/* Log of the magnitude of the difference, less the step size */
+	dqm = (d < 0) ? -d : d;
+	exp = quan(dqm >> 1, power2, 15);
+	mant = ((dqm << 7) >> exp) & 0x7F;
+	dl = (exp << 7) + mant;
+	dln = dl - (y >> 2);
+
+	i = quan(dln, table, size);
+	if (d < 0)
+		return (size << 1) + 1 - i;
+	else if (i == 0)
+		return (size << 1) + 1;
+	return i;
+}
+
+static int reconstruct(int sign, int dqln, int y)
+{
+	int dql, dex, dqt, dq;
+
+	dql = dqln + (y >> 2);
+	if (dql < 0)
+		return sign ? -0x8000 : 0;
+
+	dex = (dql >> 7) & 15;
+	dqt = 128 + (dql & 127);
+	dq = (dqt << 7) >> (14 - dex);
+	return sign ? (dq - 0x8000) : dq;
+}
+
+/* Float a value into the internal format the predictors work in */
+static short g726_float(int mag, int neg)
+{
+	int exp;
+
+	exp = quan(mag, power2, 15);
+	return (exp << 6) + ((mag << 6) >> exp) - (neg ? 0x400 : 0);
+}
+
+static void update(int y, int wi, int fi, int dq, int sr, int dqsez, struct g726_state *s)
+{
+	int cnt;
+	int mag;
+	int a2p = 0;
+	int a1ul;
+	int pks1;
+	int fa1;
+	int tr;
+	int ylint, thr, dqthr;
+	int ylfrac;
+	int pk0;
+
+	pk0 = (dqsez < 0) ? 1 : 0;
+	mag = dq & 0x7FFF;
+
+	/* Transition detector */
+	ylint = s->yl >> 15;
+	ylfrac = (s->yl >> 10) & 0x1F;
+	thr = (ylint > 9) ? 31 << 10 : (32 + ylfrac) << ylint;
+	dqthr = (thr + (thr >> 1)) >> 1;
+	tr = (s->td && (mag > dqthr)) ? 1 : 0;
+
+	/* Quantizer scale factor adaptation */
+	s->yu = y + ((wi - y) >> 5);
+	if (s->yu < 544)
+		s->yu = 544;
+	else if (s->yu > 5120)
+		s->yu = 5120;
+	s->yl += s->yu + ((-s->yl) >> 6);
+
+	/* Adaptive predictor coefficients */
+	if (tr) {
+		s->a[0] = s->a[1] = 0;
+		for (cnt = 0; cnt < 6; cnt++)
+			s->b[cnt] = 0;
+	} else {
+		pks1 = pk0 ^ s->pk[0];
+
+		a2p = s->a[1] - (s->a[1] >> 7);
+		if (dqsez != 0) {
+			fa1 = pks1 ? s->a[0] : -s->a[0];
+			if (fa1 < -8191)
+				a2p -= 0x100;
+			else if (fa1 > 8191)
+				a2p += 0xFF;
+			else
+				a2p += fa1 >> 5;
+
+			if (pk0 ^ s->pk[1]) {
+				if (a2p <= -12160)
+					a2p = -12288;
+				else if (a2p >= 12416)
+					a2p = 12288;
+				else
+					a2p -= 0x80;
+			} else if (a2p <= -12416)
+				a2p = -12288;
+			else if (a2p >= 12160)
+				a2p = 12288;
+			else
+				a2p += 0x80;
+		}
+		s->a[1] = a2p;
+
+		s->a[0] -= s->a[0] >> 8;
+		if (dqsez != 0) {
+			if (pks1 == 0)
+				s->a[0] += 192;
+			else
+				s->a[0] -= 192;
+		}
+		a1ul = 15360 - a2p;
+		if (s->a[0] < -a1ul)
+			s->a[0] = -a1ul;
+		else if (s->a[0] > a1ul)
+			s->a[0] = a1ul;
+
+		for (cnt = 0; cnt < 6; cnt++) {
+			s->b[cnt] -= s->b[cnt] >> 8;
+			if (mag) {
+				if ((dq ^ s->dq[cnt]) >= 0)
+					s->b[cnt] += 128;
+				else
+					s->b[cnt] -= 128;
+			}
+		}
+	}
+
+	for (cnt = 5; cnt > 0; cnt--)
+		s->dq[cnt] = s->dq[cnt - 1];
+	if (mag == 0)
+		s->dq[0] = (dq >= 0) ? 0x20 : 0xFC20;
+	else
+		s->dq[0] = g726_float(mag, dq < 0);
+
+	s->sr[1] = s->sr[0];
+	if (sr == 0)
+		s->sr[0] = 0x20;
+	else if (sr > 0)
+		s->sr[0] = g726_float(sr, 0);
+	else if (sr > -32768)
+		s->sr[0] = g726_float(-sr, 1);
+	else
+		s->sr[0] = 0xFC20;
+
+	s->pk[1] = s->pk[0];
+	s->pk[0] = pk0;
+
+	/* Tone detector */
+	s->td = (!tr && (a2p < -11776)) ? 1 : 0;
+
+	/* Adaptation speed control */
+	s->dms += (fi - s->dms) >> 5;
+	s->dml += (((fi << 2) - s->dml) >> 7);
+
+	if (tr)
+		s->ap = 256;
+	else if ((y < 1536) || s->td ||
+		 (abs((s->dms << 2) - s->dml) >= (s->dml >> 3)))
+		s->ap += (0x200 - s->ap) >> 4;
+	else
+		s->ap += (-s->ap) >> 4;
+}
+
+static int g726_encode(short sample, struct g726_state *s)
+{
+	int sezi, sez, se, d, y, i, dq, sr, dqsez;
+
+	/* The coder works on 14 bit samples */
+	sezi = predictor_zero(s);
+	sez = sezi >> 1;
+	se = (sezi + predictor_pole(s)) >> 1;
+	d = (sample >> 2) - se;
+
+	y = step_size(s);
+	i = quantize(d, y, qtab_721, 7);
+	dq = reconstruct(i & 8, dqlntab[i], y);
+	sr = (dq < 0) ? se - (dq & 0x3FFF) : se + dq;
+	dqsez = sr + sez - se;
+
+	update(y, witab[i] << 5, fitab[i], dq, sr, dqsez, s);
+	return i;
+}
+
+static short g726_decode(int i, struct g726_state *s)
+{
+	int sezi, sez, se, y, dq, sr, dqsez;
+
+	i &= 0x0f;
+	sezi = predictor_zero(s);
+	sez = sezi >> 1;
+	se = (sezi + predictor_pole(s)) >> 1;
+
+	y = step_size(s);
+	dq = reconstruct(i & 0x08, dqlntab[i], y);
+	sr = (dq < 0) ? (se - (dq & 0x3FFF)) : se + dq;
+	dqsez = sr - se + sez;
+
+	update(y, witab[i] << 5, fitab[i], dq, sr, dqsez, s);
+	return sr << 2;
+}
+
+/* How many samples the next block of src will give */
+static unsigned int sw_blocksamples(unsigned int fmt, unsigned int len)
+{
+	switch(fmt) {
+	case DAHDI_FORMAT_ULAW:
+	case DAHDI_FORMAT_ALAW:
+		return min(len, (unsigned int)SW_BLOCK);
+	case DAHDI_FORMAT_SLINEAR:
+		return min(len / 2, (unsigned int)SW_BLOCK);
+	case DAHDI_FORMAT_G726:
+		return min(len, (unsigned int)SW_BLOCK / 2) * 2;
+	}
+	return 0;
+}
+
+/* Most bytes that samples will take up in fmt */
+static unsigned int sw_maxbytes(unsigned int fmt, unsigned int samples)
+{
+	switch(fmt) {
+	case DAHDI_FORMAT_SLINEAR:
+		return samples * 2;
+	case DAHDI_FORMAT_G726:
+		return samples / 2 + 1;
+	}
+	return samples;
+}
+
+/* Decode samples from src; returns how many bytes of src that used */
+static unsigned int sw_decode(struct sw_chan *sc, unsigned int fmt, unsigned char *src,
+			      short *lin, unsigned int samples)
+{
+	unsigned int x;
+
+	switch(fmt) {
+	case DAHDI_FORMAT_ULAW:
+		for (x = 0; x < samples; x++)
+			lin[x] = DAHDI_MULAW(src[x]);
+		return samples;
+	case DAHDI_FORMAT_ALAW:
+		for (x = 0; x < samples; x++)
+			lin[x] = DAHDI_ALAW(src[x]);
+		return samples;
+	case DAHDI_FORMAT_SLINEAR:
+		memcpy(lin, src, samples * 2);
+		return samples * 2;
+	case DAHDI_FORMAT_G726:
+		/* First sample in the low half of each byte */
+		for (x = 0; x < samples / 2; x++) {
+			lin[x * 2] = g726_decode(src[x] & 0x0f, &sc->dec);
+			lin[x * 2 + 1] = g726_decode(src[x] >> 4, &sc->dec);
+		}
+		return samples / 2;
+	}
+	return 0;
+}
+
+/* Encode samples into dst; returns how many bytes of dst that filled */
+static unsigned int sw_encode(struct sw_chan *sc, unsigned int fmt, short *lin,
+			      unsigned char *dst, unsigned int samples)
+{
+	unsigned int x, len = 0;
+	int code;
+
+	switch(fmt) {
+	case DAHDI_FORMAT_ULAW:
+		for (x = 0; x < samples; x++)
+			dst[x] = DAHDI_LIN2MU(lin[x]);
+		return samples;
+	case DAHDI_FORMAT_ALAW:
+		for (x = 0; x < samples; x++)
+			dst[x] = DAHDI_LIN2A(lin[x]);
+		return samples;
+	case DAHDI_FORMAT_SLINEAR:
+		memcpy(dst, lin, samples * 2);
+		return samples * 2;
+	case DAHDI_FORMAT_G726:
+		for (x = 0; x < samples; x++) {
+			code = g726_encode(lin[x], &sc->enc);
+			if (sc->half) {
+				dst[len++] = sc->nibble | (code << 4);
+				sc->half = 0;
+			} else {
+				sc->nibble = code;
+				sc->half = 1;
+			}
+		}
+		return len;
+	}
+	return 0;
+}
+
+static int sw_transcode(struct sw_chan *sc, struct dahdi_transcode_header *zth)
+{
+	short lin[SW_BLOCK];
+	unsigned int srcoffset = zth->srcoffset, srclen = zth->srclen;
+	unsigned int dstend = zth->dstoffset + zth->dstlen;
+	unsigned int samples, used, done = 0;
+
+	/* All of these are the user's to scribble on */
+	if ((srcoffset > sizeof(zth->srcdata)) ||
+	    (srclen > sizeof(zth->srcdata) - srcoffset) ||
+	    (zth->dstoffset > sizeof(zth->dstdata)) ||
+	    (zth->dstlen > sizeof(zth->dstdata) - zth->dstoffset))
+		return -EINVAL;
+
+	while ((samples = sw_blocksamples(zth->srcfmt, srclen))) {
+		if (sw_maxbytes(zth->dstfmt, samples) > sizeof(zth->dstdata) - dstend)
+			break;
+		used = sw_decode(sc, zth->srcfmt, zth->srcdata + srcoffset, lin, samples);
+		srcoffset += used;
+		srclen -= used;
+		dstend += sw_encode(sc, zth->dstfmt, lin, zth->dstdata + dstend, samples);
+		done += samples;
+	}
+
+	zth->srcoffset = srcoffset;
+	zth->srclen = srclen;
+	zth->dstlen = dstend - zth->dstoffset;
+	zth->dstsamples += done;
+
+	/* Stopped for want of room before doing anything */
+	if (!done && samples)
+		return -EOVERFLOW;
+	return 0;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,20)
+static void sw_work(struct work_struct *work)
+{
+	struct sw_chan *sc = container_of(work, struct sw_chan, work);
+#else
+static void sw_work(void *data)
+{
+	struct sw_chan *sc = data;
+#endif
+	struct dahdi_transcoder_channel *ztc = sc->ztc;
+
+	if (!sc->zth)
+		return;
+	ztc->errorstatus = sw_transcode(sc, sc->zth);
+	if (debug)
+		printk("dahdi_transcode_sw: channel %d: %d samples, status %d\n",
+		       ztc->offset, sc->zth->dstsamples, ztc->errorstatus);
+	dahdi_transcoder_alert(ztc);
+}
+
+static int sw_operation(struct dahdi_transcoder_channel *ztc, int op)
+{
+	struct sw_chan *sc = ztc->pvt;
+	struct dahdi_transcode_header *zth = ztc->tch;
+
+	switch(op) {
+	case DAHDI_TCOP_ALLOCATE:
+		if (!zth)
+			return -EINVAL;
+		g726_init(&sc->dec);
+		g726_init(&sc->enc);
+		sc->half = 0;
+		ztc->chan_built = 1;
+		ztc->built_fmts = zth->srcfmt | zth->dstfmt;
+		return 0;
+	case DAHDI_TCOP_RELEASE:
+		ztc->chan_built = 0;
+		ztc->built_fmts = 0;
+		return 0;
+	case DAHDI_TCOP_TEST:
+		return 0;
+	case DAHDI_TCOP_TRANSCODE:
+		if (!zth)
+			return -EINVAL;
+		sc->zth = zth;
+		queue_work(sw_wq, &sc->work);
+		return 0;
+	}
+	return -ENOSYS;
+}
+
+static void sw_flush(struct dahdi_transcoder_channel *ztc)
+{
+	struct sw_chan *sc = ztc->pvt;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,22)
+	cancel_work_sync(&sc->work);
+#else
+	flush_workqueue(sw_wq);
+#endif
+	sc->zth = NULL;
+}
+
+static int __init sw_init(void)
+{
+	int x;
+	int res;
+
+	if (numchannels < 1)
+		return -EINVAL;
+
+	if (!(sw_chans = kmalloc(sizeof(*sw_chans) * numchannels, GFP_KERNEL)))
+		return -ENOMEM;
+	memset(sw_chans, 0, sizeof(*sw_chans) * numchannels);
+
+	if (!(sw_tc = dahdi_transcoder_alloc(numchannels))) {
+		kfree(sw_chans);
+		return -ENOMEM;
+	}
+
+	/* One worker per CPU; requests run where they were made */
+	if (!(sw_wq = create_workqueue("dahdi_tcsw"))) {
+		dahdi_transcoder_free(sw_tc);
+		kfree(sw_chans);
+		return -ENOMEM;
+	}
+
+	strcpy(sw_tc->name, "DAHDI software transcoder");
+	sw_tc->srcfmts = SW_FORMATS;
+	sw_tc->dstfmts = SW_FORMATS;
+	sw_tc->operation = sw_operation;
+	sw_tc->flush = sw_flush;
+	sw_tc->fallback = 1;
+	for (x = 0; x < numchannels; x++) {
+		sw_chans[x].ztc = &sw_tc->channels[x];
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,20)
+		INIT_WORK(&sw_chans[x].work, sw_work);
+#else
+		INIT_WORK(&sw_chans[x].work, sw_work, &sw_chans[x]);
+#endif
+		sw_tc->channels[x].pvt = &sw_chans[x];
+	}
+
+	if ((res = dahdi_transcoder_register(sw_tc))) {
+		destroy_workqueue(sw_wq);
+		dahdi_transcoder_free(sw_tc);
+		kfree(sw_chans);
+		return res;
+	}
+
+	return 0;
+}
+
+static void __exit sw_cleanup(void)
+{
+	dahdi_transcoder_unregister(sw_tc);
+	destroy_workqueue(sw_wq);
+	dahdi_transcoder_free(sw_tc);
+	kfree(sw_chans);
+}
+
+module_param(numchannels, int, 0444);
+module_param(debug, int, 0644);
+
+MODULE_DESCRIPTION("DAHDI Software Transcoder");
+#ifdef MODULE_LICENSE
+MODULE_LICENSE("GPL");
+#endif
+
+module_init(sw_init);
+module_exit(sw_cleanup);
@@ -0,0 +1,594 @@
+/*
+ * ecbench: run the software echo cancellers outside the kernel
+ *
+ * Feeds each canceller either synthetic far-end speech through a
+ * simulated hybrid echo path (with a stretch of double talk), or a pair
+ * of recorded files, and reports the echo return loss enhancement it
+ * reaches, how long it took to get there and what it costs per sample.
+ * The 2100 Hz disable tone detector in ecdis.h is checked as well.
+ *
+ * Signals are signed linear 16 bit, 8000 samples per second, and are
+ * passed to the cancellers a chunk at a time, the way dahdi_ec_chunk()
+ * does.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+#include "ecbench.h"
+
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+
+#include "dahdi_config.h"
+#include <dahdi/kernel.h>
+
+#include "arith.h"
+#include "ecdis.h"
+
+#ifdef DAHDI_ARITH_SIMD
+int dahdi_simd;
+int dahdi_simd_on;
+unsigned long dahdi_simd_ctx;
+#endif
+
+#define SAMPLE_RATE	8000
+/* ERLE is measured over windows of 50ms */
+#define WINDOW		400
+/* Peak amplitude of a 0 dBm0 sine */
+#define DBM0_PEAK	22656.0
+/* Far end level of the synthetic signal, and of the near end talker */
+#define TALK_LEVEL	-15.0
+#define MAX_TAPLENS	8
+
+static struct ecbench_can *cans[] = {
+	&ecbench_mg2,
+	&ecbench_kb1,
+	&ecbench_sec,
+	&ecbench_sec2,
+	&ecbench_jpah,
+	NULL
+};
+
+static unsigned int seed;
+
+/* Uniform noise, -32768 to 32767 */
+static int noise(void)
+{
+	seed = seed * 1103515245 + 12345;
+	return (int)((seed >> 16) & 0xffff) - 32768;
+}
+
+static short clip(double v)
+{
+	if (v > 32767.0)
+		return 32767;
+	if (v < -32768.0)
+		return -32768;
+	return (short)lrint(v);
+}
+
+/*
+ * Something like speech, as far as an echo canceller is concerned: low
+ * passed noise at level dBm0 (rms), in talk spurts of 100 to 400ms with
+ * 50 to 200ms of silence between them.
+ */
+static void gen_speech(short *buf, int len, double level, unsigned int s)
+{
+	/* rms of the uniform noise, and of it after the low pass */
+	double rms = 65536.0 / sqrt(12.0) / sqrt(1.0 - 0.7 * 0.7);
+	double scale = DBM0_PEAK / sqrt(2.0) * pow(10.0, level / 20.0) / rms;
+	double lp = 0.0;
+	int left = 0, on = 0;
+	int i;
+
+	seed = s;
+	for (i = 0; i < len; i++) {
+		if (!left) {
+			on = !on;
+			left = on ? 800 + (noise() & 0x7fff) % 2400 :
+				    400 + (noise() & 0x7fff) % 1200;
+		}
+		left--;
+		lp = 0.7 * lp + noise();
+		buf[i] = on ? clip(lp * scale) : 0;
+	}
+}
+
+/*
+ * A hybrid echo path: a pure delay, then a decaying, ringing impulse
+ * response of disp samples, scaled for an echo return loss of erl dB.
+ * Not one of the G.168 models, but of the same shape.
+ */
+static double *make_path(int delay, int disp, double erl, int *len)
+{
+	double *h;
+	double pow2 = 0.0, g;
+	int k;
+
+	*len = delay + disp;
+	if (!(h = calloc(*len, sizeof(*h))))
+		return NULL;
+	for (k = 0; k < disp; k++) {
+		h[delay + k] = exp(-5.0 * k / disp) * cos(0.9 * k + 0.4);
+		pow2 += h[delay + k] * h[delay + k];
+	}
+	g = sqrt(pow(10.0, -erl / 10.0) / pow2);
+	for (k = 0; k < disp; k++)
+		h[delay + k] *= g;
+	return h;
+}
+
+static void add_echo(short *near, const short *far, int len, const double *h, int hlen)
+{
+	int i, k;
+
+	for (i = 0; i < len; i++) {
+		double e = 0.0;
+		for (k = 0; k < hlen && k <= i; k++)
+			e += h[k] * far[i - k];
+		/* plus a little line noise */
+		near[i] = clip(e + (noise() >> 13));
+	}
+}
+
+static short *read_pcm(const char *name, int *len)
+{
+	FILE *f;
+	short *buf = NULL;
+	long size;
+
+	if (!(f = fopen(name, "r"))) {
+		fprintf(stderr, "Unable to open '%s': %s\n", name, strerror(errno));
+		return NULL;
+	}
+	if (fseek(f, 0, SEEK_END) || (size = ftell(f)) < 0 || fseek(f, 0, SEEK_SET)) {
+		fprintf(stderr, "Unable to size '%s': %s\n", name, strerror(errno));
+		fclose(f);
+		return NULL;
+	}
+	*len = size / sizeof(short);
+	if (!(buf = malloc(size + 1)) || fread(buf, sizeof(short), *len, f) != *len) {
+		fprintf(stderr, "Unable to read '%s'\n", name);
+		free(buf);
+		buf = NULL;
+	}
+	fclose(f);
+	return buf;
+}
+
+static int write_pcm(const char *name, const short *buf, int len)
+{
+	FILE *f;
+	int res = 0;
+
+	if (!(f = fopen(name, "w"))) {
+		fprintf(stderr, "Unable to create '%s': %s\n", name, strerror(errno));
+		return -1;
+	}
+	if (fwrite(buf, sizeof(short), len, f) != len) {
+		fprintf(stderr, "Unable to write '%s'\n", name);
+		res = -1;
+	}
+	fclose(f);
+	return res;
+}
+
+/* Run one canceller over the whole signal; returns ns per sample */
+static double run(struct ecbench_can *can, void *ec, const short *far,
+		  const short *near, short *out, int len, int per_sample)
+{
+	struct timespec start, end;
+	int i, x;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < len; i += DAHDI_CHUNKSIZE) {
+#ifdef DAHDI_ARITH_SIMD
+		int simd = dahdi_simd_begin();
+#endif
+		if (can->array_update && !per_sample) {
+			short tx[DAHDI_CHUNKSIZE];
+			memcpy(out + i, near + i, sizeof(tx));
+			memcpy(tx, far + i, sizeof(tx));
+			can->array_update(ec, out + i, tx);
+		} else {
+			for (x = 0; x < DAHDI_CHUNKSIZE; x++)
+				out[i + x] = can->update(ec, far[i + x], near[i + x]);
+		}
+#ifdef DAHDI_ARITH_SIMD
+		if (simd)
+			dahdi_simd_end();
+#endif
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	return ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) / len;
+}
+
+struct window {
+	double far;
+	double near;
+	double out;
+	int valid;
+};
+
+/*
+ * Split the run into windows, and mark as valid those with the far end
+ * talking and the near end not (the double talk stretch, dt_start to
+ * dt_end, is left out).
+ */
+static struct window *measure(const short *far, const short *near, const short *out,
+			      int len, int dt_start, int dt_end, int *nwin)
+{
+	/* Far end power that counts as talking: -40 dBm0 */
+	double active = pow(DBM0_PEAK / sqrt(2.0) * pow(10.0, -40.0 / 20.0), 2.0) * WINDOW;
+	struct window *w;
+	int i, n;
+
+	*nwin = len / WINDOW;
+	if (!(w = calloc(*nwin, sizeof(*w))))
+		return NULL;
+	for (n = 0; n < *nwin; n++) {
+		for (i = n * WINDOW; i < (n + 1) * WINDOW; i++) {
+			w[n].far += (double)far[i] * far[i];
+			w[n].near += (double)near[i] * near[i];
+			w[n].out += (double)out[i] * out[i];
+		}
+		w[n].valid = (w[n].far >= active) &&
+			((n + 1) * WINDOW <= dt_start || n * WINDOW >= dt_end);
+	}
+	return w;
+}
+
+static double erle(double near, double out)
+{
+	if (out < 1.0)
+		out = 1.0;
+	if (near < 1.0)
+		return 0.0;
+	return 10.0 * log10(near / out);
+}
+
+/* ERLE over the valid windows from sample "from" up to "to" */
+static double erle_over(const struct window *w, int nwin, int from, int to)
+{
+	double near = 0.0, out = 0.0;
+	int n;
+
+	for (n = from / WINDOW; n < nwin && (n + 1) * WINDOW <= to; n++) {
+		if (!w[n].valid)
+			continue;
+		near += w[n].near;
+		out += w[n].out;
+	}
+	return erle(near, out);
+}
+
+/* ms until the ERLE first reaches target and holds for three windows, or -1 */
+static int convergence(const struct window *w, int nwin, double target)
+{
+	int n, held = 0;
+
+	for (n = 0; n < nwin; n++) {
+		if (!w[n].valid)
+			continue;
+		if (erle(w[n].near, w[n].out) < target) {
+			held = 0;
+			continue;
+		}
+		if (++held == 3)
+			break;
+	}
+	if (n == nwin)
+		return -1;
+	/* Back to the end of the first of the three */
+	for (held = 0; n >= 0; n--)
+		if (w[n].valid && ++held == 3)
+			break;
+	return (n + 1) * WINDOW * 1000 / SAMPLE_RATE;
+}
+
+static void gen_tone(short *buf, int len, double level, int reversals)
+{
+	double amp = DBM0_PEAK * pow(10.0, level / 20.0);
+	double phase = 0.0;
+	int i;
+
+	for (i = 0; i < len; i++) {
+		/* Phase reversal every 450ms */
+		if (reversals && i && !(i % (450 * SAMPLE_RATE / 1000)))
+			phase += M_PI;
+		buf[i] = clip(amp * sin(2.0 * M_PI * 2100.0 * i / SAMPLE_RATE + phase));
+	}
+}
+
+/* ms until the disable tone detector fires, or -1 */
+static int ecdis_detect(const short *buf, int len)
+{
+	echo_can_disable_detector_state_t det;
+	int i;
+
+	echo_can_disable_detector_init(&det);
+	for (i = 0; i < len; i++)
+		if (echo_can_disable_detector_update(&det, buf[i]))
+			return (i + 1) * 1000 / SAMPLE_RATE;
+	return -1;
+}
+
+static int test_ecdis(void)
+{
+	int len = 5 * SAMPLE_RATE;
+	short *buf;
+	int ms, res = 0;
+
+	if (!(buf = malloc(len * sizeof(*buf))))
+		return -1;
+
+	gen_tone(buf, len, -12.0, 1);
+	if ((ms = ecdis_detect(buf, len)) < 0) {
+		printf("ecdis: 2100 Hz with phase reversals: not detected (FAIL)\n");
+		res = -1;
+	} else
+		printf("ecdis: 2100 Hz with phase reversals: detected after %d ms\n", ms);
+
+	gen_tone(buf, len, -12.0, 0);
+	if ((ms = ecdis_detect(buf, len)) < 0)
+		printf("ecdis: 2100 Hz without phase reversals: not detected\n");
+	else {
+		printf("ecdis: 2100 Hz without phase reversals: detected after %d ms (FAIL)\n", ms);
+		res = -1;
+	}
+
+	gen_speech(buf, len, TALK_LEVEL, 1);
+	if ((ms = ecdis_detect(buf, len)) < 0)
+		printf("ecdis: test speech: not detected\n");
+	else {
+		printf("ecdis: test speech: detected after %d ms (FAIL)\n", ms);
+		res = -1;
+	}
+
+	free(buf);
+	return res;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [options] [canceller ...]\n"
+		"Cancellers: mg2 kb1 sec sec2 jpah (default: all)\n"
+		"  -t taps     filter length, may be given up to %d times (default 128)\n"
+		"  -s secs     length of the synthetic signal (default 10)\n"
+		"  -d ms       echo path delay (default 2)\n"
+		"  -w ms       echo path dispersion (default 6)\n"
+		"  -l dB       echo return loss of the path (default 10)\n"
+		"  -D          no double talk in the synthetic signal\n"
+		"  -f file     recorded far end (transmit) signal instead\n"
+		"  -n file     recorded near end (receive) signal, with the echo\n"
+		"  -o prefix   write each canceller's output to prefix-name-taps.raw\n"
+		"  -1          use echo_can_update() even if there is an array update\n"
+		"  -C dB       ERLE that counts as converged (default 20)\n"
+		"  -e dB       fail if the final ERLE is below this\n"
+		"  -c ms       fail if convergence takes longer than this\n"
+#ifdef DAHDI_ARITH_SIMD
+		"  -v level    vector unit to use: 0 none, 1 SSE2, 2 AVX2 (default: best)\n"
+#endif
+		, prog, MAX_TAPLENS);
+	exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+	int taplens[MAX_TAPLENS];
+	int ntaplens = 0;
+	double secs = 10.0, delay = 2.0, disp = 6.0, erl = 10.0;
+	double target = 20.0, min_erle = 0.0;
+	int max_conv = 0, double_talk = 1, per_sample = 0;
+	char *farfile = NULL, *nearfile = NULL, *prefix = NULL;
+	short *far, *near, *out;
+	int len, dt_start = 0, dt_end = 0;
+	int c, x, t, res = 0;
+#ifdef DAHDI_ARITH_SIMD
+	int simd = -1;
+#endif
+
+	while ((c = getopt(argc, argv, "t:s:d:w:l:Df:n:o:1C:e:c:v:h")) != -1) {
+		switch (c) {
+		case 't':
+			if (ntaplens == MAX_TAPLENS || (taplens[ntaplens++] = atoi(optarg)) <= 0)
+				usage(argv[0]);
+			break;
+		case 's':
+			secs = atof(optarg);
+			break;
+		case 'd':
+			delay = atof(optarg);
+			break;
+		case 'w':
+			disp = atof(optarg);
+			break;
+		case 'l':
+			erl = atof(optarg);
+			break;
+		case 'D':
+			double_talk = 0;
+			break;
+		case 'f':
+			farfile = optarg;
+			break;
+		case 'n':
+			nearfile = optarg;
+			break;
+		case 'o':
+			prefix = optarg;
+			break;
+		case '1':
+			per_sample = 1;
+			break;
+		case 'C':
+			target = atof(optarg);
+			break;
+		case 'e':
+			min_erle = atof(optarg);
+			break;
+		case 'c':
+			max_conv = atoi(optarg);
+			break;
+#ifdef DAHDI_ARITH_SIMD
+		case 'v':
+			simd = atoi(optarg);
+			break;
+#endif
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (!ntaplens)
+		taplens[ntaplens++] = 128;
+	if (!farfile != !nearfile)
+		usage(argv[0]);
+
+	/* Pick the cancellers named on the command line, if any */
+	if (optind < argc) {
+		int n = 0;
+		for (x = optind; x < argc; x++) {
+			for (t = n; t < ARRAY_SIZE(cans); t++) {
+				if (cans[t] && !strcmp(cans[t]->name, argv[x])) {
+					struct ecbench_can *tmp = cans[n];
+					cans[n++] = cans[t];
+					cans[t] = tmp;
+					break;
+				}
+			}
+			if (t == ARRAY_SIZE(cans)) {
+				fprintf(stderr, "Unknown canceller '%s'\n", argv[x]);
+				usage(argv[0]);
+			}
+		}
+		cans[n] = NULL;
+	}
+
+#ifdef DAHDI_ARITH_SIMD
+	dahdi_simd = DAHDI_SIMD_NONE;
+	if (__builtin_cpu_supports("sse2"))
+		dahdi_simd = DAHDI_SIMD_SSE2;
+#ifdef DAHDI_ARITH_AVX2
+	if (__builtin_cpu_supports("avx2"))
+		dahdi_simd = DAHDI_SIMD_AVX2;
+#endif
+	if (simd >= 0 && simd < dahdi_simd)
+		dahdi_simd = simd;
+	printf("Vector unit: %s\n", dahdi_simd == DAHDI_SIMD_AVX2 ? "AVX2" :
+	       dahdi_simd == DAHDI_SIMD_SSE2 ? "SSE2" : "none");
+#endif
+
+	if (farfile) {
+		int nlen;
+		if (!(far = read_pcm(farfile, &len)) || !(near = read_pcm(nearfile, &nlen)))
+			exit(1);
+		if (nlen < len)
+			len = nlen;
+		double_talk = 0;
+	} else {
+		double *h;
+		int hlen;
+
+		len = secs * SAMPLE_RATE;
+		if (len < WINDOW || !(far = malloc(len * sizeof(*far))) ||
+		    !(near = malloc(len * sizeof(*near))))
+			usage(argv[0]);
+		if (!(h = make_path(delay * SAMPLE_RATE / 1000, disp * SAMPLE_RATE / 1000, erl, &hlen)))
+			exit(1);
+		gen_speech(far, len, TALK_LEVEL, 12345);
+		add_echo(near, far, len, h, hlen);
+		free(h);
+		if (double_talk) {
+			/* The near end talks over 40% to 55% of the run */
+			short *talk;
+			dt_start = len * 40 / 100;
+			dt_end = len * 55 / 100;
+			if (!(talk = malloc((dt_end - dt_start) * sizeof(*talk))))
+				exit(1);
+			gen_speech(talk, dt_end - dt_start, TALK_LEVEL, 54321);
+			for (x = dt_start; x < dt_end; x++)
+				near[x] = clip((double)near[x] + talk[x - dt_start]);
+			free(talk);
+		}
+		printf("Echo path: %.1f ms delay, %.1f ms dispersion, ERL %.1f dB%s\n",
+		       delay, disp, erl, double_talk ? ", double talk at 40-55%" : "");
+	}
+	len -= len % DAHDI_CHUNKSIZE;
+	if (!(out = malloc(len * sizeof(*out))))
+		exit(1);
+
+	printf("%-6s %5s %9s %8s %11s %10s %8s\n",
+	       "canc", "taps", "ERLE(dB)", "conv(ms)", "postDT(dB)", "ns/sample", "ch/core");
+	for (x = 0; cans[x]; x++) {
+		cans[x]->init();
+		for (t = 0; t < ntaplens; t++) {
+			struct window *w;
+			void *ec;
+			double ns, final;
+			int nwin, conv;
+
+			if (!(ec = cans[x]->create(taplens[t]))) {
+				fprintf(stderr, "%s: unable to create with %d taps\n", cans[x]->name, taplens[t]);
+				res = 1;
+				continue;
+			}
+			ns = run(cans[x], ec, far, near, out, len, per_sample);
+			cans[x]->free(ec);
+
+			if (!(w = measure(far, near, out, len, dt_start, dt_end, &nwin)))
+				exit(1);
+			/* Steady state: the last quarter of the run */
+			final = erle_over(w, nwin, len * 3 / 4, len);
+			conv = convergence(w, nwin, target);
+
+			printf("%-6s %5d %9.1f ", cans[x]->name, taplens[t], final);
+			if (conv < 0)
+				printf("%8s ", "-");
+			else
+				printf("%8d ", conv);
+			if (double_talk)
+				printf("%11.1f ", erle_over(w, nwin, dt_end, len * 3 / 4));
+			else
+				printf("%11s ", "-");
+			printf("%10.1f %8.0f\n", ns, 1e9 / (ns * SAMPLE_RATE));
+
+			if ((min_erle && final < min_erle) ||
+			    (max_conv && (conv < 0 || conv > max_conv))) {
+				printf("%s with %d taps: FAIL\n", cans[x]->name, taplens[t]);
+				res = 1;
+			}
+			if (prefix) {
+				char name[256];
+				snprintf(name, sizeof(name), "%s-%s-%d.raw", prefix, cans[x]->name, taplens[t]);
+				if (write_pcm(name, out, len))
+					res = 1;
+			}
+			free(w);
+		}
+		cans[x]->shutdown();
+	}
+
+	if (test_ecdis())
+		res = 1;
+
+	free(far);
+	free(near);
+	free(out);
+	return res;
+}
@@ -0,0 +1,57 @@
+/*
+ * ecbench: userspace harness for the software echo cancellers
+ *
+ * Each canceller header is built into its own object from ecbench_can.c,
+ * and shows up in ecbench.c as one of these.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+#ifndef _DAHDI_ECBENCH_H
+#define _DAHDI_ECBENCH_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <linux/version.h>
+
+/* Just enough of the kernel for the canceller headers */
+#define printk(fmt, args...) fprintf(stderr, fmt, ## args)
+#define KERN_INFO ""
+#define KERN_NOTICE ""
+#define KERN_WARNING ""
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+struct ecbench_can {
+	const char *name;
+	void (*init)(void);
+	void (*shutdown)(void);
+	void *(*create)(int taps);
+	void (*free)(void *ec);
+	/* As dahdi_ec_chunk() calls them: tx is the far end, rx the near */
+	short (*update)(void *ec, short tx, short rx);
+	void (*array_update)(void *ec, short *rx, short *tx);
+};
+
+extern struct ecbench_can ecbench_mg2;
+extern struct ecbench_can ecbench_kb1;
+extern struct ecbench_can ecbench_sec;
+extern struct ecbench_can ecbench_sec2;
+extern struct ecbench_can ecbench_jpah;
+
+#endif /* _DAHDI_ECBENCH_H */
@@ -0,0 +1,93 @@
+/*
+ * ecbench: one echo canceller, wrapped for the harness
+ *
+ * Built once per canceller, with ECHO_CAN_FROMENV and the ECHO_CAN_ for
+ * that canceller defined, since every canceller header defines the same
+ * names.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+#include "ecbench.h"
+
+#include "dahdi_config.h"
+#include <dahdi/kernel.h>
+
+#if defined(ECHO_CAN_MG2)
+#include "mg2ec.h"
+#define ECBENCH_CAN ecbench_mg2
+#define ECBENCH_NAME "mg2"
+#define ECBENCH_ARRAY_UPDATE
+#elif defined(ECHO_CAN_KB1)
+#include "kb1ec.h"
+#define ECBENCH_CAN ecbench_kb1
+#define ECBENCH_NAME "kb1"
+#elif defined(ECHO_CAN_STEVE)
+#include "sec.h"
+#define ECBENCH_CAN ecbench_sec
+#define ECBENCH_NAME "sec"
+#elif defined(ECHO_CAN_STEVE2)
+#include "sec-2.h"
+#define ECBENCH_CAN ecbench_sec2
+#define ECBENCH_NAME "sec2"
+#elif defined(ECHO_CAN_JP1)
+#include "jpah.h"
+#define ECBENCH_CAN ecbench_jpah
+#define ECBENCH_NAME "jpah"
+#else
+#error Define one of ECHO_CAN_MG2, ECHO_CAN_KB1, ECHO_CAN_STEVE, ECHO_CAN_STEVE2 or ECHO_CAN_JP1
+#endif
+
+static void *bench_create(int taps)
+{
+	struct dahdi_echocanparams ecp;
+	struct echo_can_state *ec;
+
+	memset(&ecp, 0, sizeof(ecp));
+	ecp.tap_length = taps;
+	if (echo_can_create(&ecp, NULL, &ec))
+		return NULL;
+	return ec;
+}
+
+static void bench_free(void *ec)
+{
+	echo_can_free(ec);
+}
+
+static short bench_update(void *ec, short tx, short rx)
+{
+	return echo_can_update(ec, tx, rx);
+}
+
+#ifdef ECBENCH_ARRAY_UPDATE
+static void bench_array_update(void *ec, short *rx, short *tx)
+{
+	echo_can_array_update(ec, rx, tx);
+}
+#endif
+
+struct ecbench_can ECBENCH_CAN = {
+	.name = ECBENCH_NAME,
+	.init = echo_can_init,
+	.shutdown = echo_can_shutdown,
+	.create = bench_create,
+	.free = bench_free,
+	.update = bench_update,
+#ifdef ECBENCH_ARRAY_UPDATE
+	.array_update = bench_array_update,
+#endif
+};
@@ -458,5 +458,125 @@ static inline int fasthdlc_rx_run(struct fasthdlc_state *h)
 	}
 	return retval;
 }
+/*
+   Bulk versions of the above, for a chunk or a buffer at a time.  The
+   state is kept in registers for the whole run instead of going back
+   to the fasthdlc_state after every byte.  They still look up one byte
+   (or one up-to-10-bit symbol) at a time in the same tables; only the
+   loop is unrolled to move two bytes between lookups.  Tables indexed
+   by two bytes would be 6x65536 entries or more, far too big to stay
+   in cache.
+   */
+
+/*
+   Encode up to srclen bytes from src into at most dstlen bytes at dst,
+   loading only as much as that needs.  Stops when dst is full, or when
+   src is used up and less than a byte of bits is left.  Sets *used to
+   the number of bytes taken from src and returns the number of bytes
+   put in dst.  Leaves no more than 24 bits queued, so a
+   fasthdlc_tx_frame_nocheck() can always follow.
+   */
+static inline int fasthdlc_tx_bulk(struct fasthdlc_state *h, const unsigned char *src, int srclen, unsigned char *dst, int dstlen, int *used)
+{
+	unsigned int data = h->data;
+	unsigned int res;
+	int bits = h->bits;
+	int ones = h->ones;
+	int s = 0, d = 0;
+
+	while (d < dstlen) {
+		/* Each byte is at most 10 bits once stuffed */
+		while ((bits <= 14) && (s < srclen)) {
+			res = hdlc_encode[ones][src[s++]];
+			ones = (res & 0xf00) >> 8;
+			data |= (res & 0xffc00000) >> bits;
+			bits += (res & 0xf);
+		}
+		if (bits < 8)
+			break;
+		dst[d++] = data >> 24;
+		data <<= 8;
+		bits -= 8;
+		if ((bits >= 8) && (d < dstlen)) {
+			dst[d++] = data >> 24;
+			data <<= 8;
+			bits -= 8;
+		}
+	}
+	h->data = data;
+	h->bits = bits;
+	h->ones = ones;
+	*used = s;
+	return d;
+}
+
+/*
+   Deframe up to srclen bytes from src, putting data into at most dstlen
+   bytes at dst.  Stops at the end of a frame or an abort, returning
+   RETURN_COMPLETE_FLAG or RETURN_DISCARD_FLAG, or else when dst is full
+   or src is used up, returning RETURN_EMPTY_FLAG.  Sets *used to the
+   number of bytes taken from src and *got to the number put in dst.
+   */
+static inline int fasthdlc_rx_bulk(struct fasthdlc_state *h, const unsigned char *src, int srclen, unsigned char *dst, int dstlen, int *used, int *got)
+{
+	unsigned int data = h->data;
+	unsigned short next;
+	int bits = h->bits;
+	int state = h->state;
+	int ones = h->ones;
+	int retval = RETURN_EMPTY_FLAG;
+	int s = 0, d = 0;
+
+	for (;;) {
+		/* Decode everything we have.  This leaves less than 10 bits,
+		   so there is always room for 16 more */
+		while (bits >= minbits[state]) {
+			if (state == FRAME_SEARCH) {
+				next = hdlc_search[data >> 24];
+				bits -= next & 0x0f;
+				data <<= next & 0x0f;
+				state = next >> 4;
+				ones = 0;
+				continue;
+			}
+			next = hdlc_frame[ones][data >> 22];
+			bits -= ((next & 0x0f00) >> 8);
+			data <<= ((next & 0x0f00) >> 8);
+			state = (next & STATE_MASK) >> 15;
+			ones = (next & ONES_MASK) >> 12;
+			if ((next & STATUS_MASK) == STATUS_CONTROL) {
+				if (next & CONTROL_COMPLETE) {
+					/* A complete, valid frame received */
+					retval = RETURN_COMPLETE_FLAG;
+					/* Stay in this state */
+					state = 1;
+				} else {
+					/* An abort (either out of sync of explicit) */
+					retval = RETURN_DISCARD_FLAG;
+				}
+				goto out;
+			}
+			dst[d++] = next & DATA_MASK;
+			if (d >= dstlen)
+				goto out;
+		}
+		if (s >= srclen)
+			break;
+		data |= src[s++] << (24 - bits);
+		bits += 8;
+		if (s < srclen) {
+			data |= src[s++] << (24 - bits);
+			bits += 8;
+		}
+	}
+out:
+	h->data = data;
+	h->bits = bits;
+	h->state = state;
+	h->ones = ones;
+	*used = s;
+	*got = d;
+	return retval;
+}
 #endif /* FAST_HDLC_NEED_TABLES */
 #endif
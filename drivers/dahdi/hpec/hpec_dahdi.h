@@ -65,11 +65,6 @@ static void echo_can_init(void)
 	hpec_init(logger, debug, DAHDI_CHUNKSIZE, memalloc, memfree);
 }
 
-static void echo_can_identify(char *buf, size_t len)
-{
-	dahdi_copy_string(buf, "HPEC", len);
-}
-
 static void echo_can_shutdown(void)
 {
 	hpec_shutdown();
@@ -47,11 +47,6 @@ static void echo_can_init(void)
 	printk("DAHDI Audio Hoser: JP1\n");
 }
 
-static void echo_can_identify(char *buf, size_t len)
-{
-	dahdi_copy_string(buf, "JP1", len);
-}
-
 static void echo_can_shutdown(void)
 {
 }
@@ -86,15 +81,21 @@ static inline short echo_can_update(struct echo_can_state *ec, short iref, short
 	}
 }
 
-static inline struct echo_can_state *echo_can_create(int len, int adaption_mode)
+static int echo_can_create(struct dahdi_echocanparams *ecp, struct dahdi_echocanparam *p,
+			   struct echo_can_state **ec)
 {
-	struct echo_can_state *ec;
-	ec = (struct echo_can_state *)MALLOC(sizeof(struct echo_can_state) + 4); /* align */
-	if (ec) {
-		memset(ec, 0, sizeof(struct echo_can_state) + 4); /* align */
-		init_cc(ec);
+	if (ecp->param_count > 0) {
+		printk(KERN_WARNING "JP1 echo canceler does not support parameters; failing request\n");
+		return -EINVAL;
 	}
-	return ec;
+
+	if (!(*ec = MALLOC(sizeof(**ec) + 4))) /* align */
+		return -ENOMEM;
+
+	memset(*ec, 0, sizeof(**ec) + 4); /* align */
+	init_cc(*ec);
+
+	return 0;
 }
 
 static inline int echo_can_traintap(struct echo_can_state *ec, int pos, short val)
@@ -26,12 +26,19 @@
 #ifndef _MARK2_ECHO_H
 #define _MARK2_ECHO_H
 
+#ifdef __KERNEL__
 #include <linux/kernel.h>
 #include <linux/slab.h>
 #include <linux/ctype.h>
-
 #define MALLOC(a) kmalloc((a), GFP_KERNEL)
 #define FREE(a) kfree(a)
+#else
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#define MALLOC(a) malloc(a)
+#define FREE(a) free(a)
+#endif
 
 /* Uncomment to provide summary statistics for overall echo can performance every 4000 samples */ 
 /* #define MEC2_STATS 4000 */
@@ -138,11 +145,6 @@ static void echo_can_init(void)
 	printk("DAHDI Echo Canceller: KB1\n");
 }
 
-static void echo_can_identify(char *buf, size_t len)
-{
-	dahdi_copy_string(buf, "KB1", len);
-}
-
 static void echo_can_shutdown(void)
 {
 }
@@ -539,7 +541,7 @@ static int echo_can_create(struct dahdi_echocanparams *ecp, struct dahdi_echocan
 	if (maxu < (1 << DEFAULT_SIGMA_LU_I))
 		maxu = (1 << DEFAULT_SIGMA_LU_I);
 
-	size = sizeof(*ec) +
+	size = sizeof(**ec) +
 		4 + 						/* align */
 		sizeof(int) * ecp->tap_length +			/* a_i */
 		sizeof(short) * ecp->tap_length + 		/* a_s */
@@ -564,7 +566,7 @@ static int echo_can_create(struct dahdi_echocanparams *ecp, struct dahdi_echocan
 			(*ec)->aggressive = p[x].value ? 1 : 0;
 		} else {
 			printk(KERN_WARNING "Unknown parameter supplied to KB1 echo canceler: '%s'\n", p[x].name);
-			kfree(*ec);
+			FREE(*ec);
 
 			return -EINVAL;
 		}
@@ -26,20 +26,31 @@
 #ifndef _MG2_ECHO_H
 #define _MG2_ECHO_H
 
+#ifdef __KERNEL__
 #include <linux/kernel.h>
 #include <linux/slab.h>
 #include <linux/ctype.h>
-
 #define MALLOC(a) kmalloc((a), GFP_KERNEL)
 #define FREE(a) kfree(a)
+#else
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#define MALLOC(a) malloc(a)
+#define FREE(a) free(a)
+#endif
 
 #define ABS(a) abs(a!=-32768?a:-32767)
 
 #define RESTORE_COEFFS {\
 				int x;\
-				memcpy(ec->a_i, ec->c_i, ec->N_d*sizeof(int));\
-				for (x=0;x<ec->N_d;x++) {\
-					ec->a_s[x] = ec->a_i[x] >> 16;\
+				if (!ec->coeffs_restored) {\
+					memcpy(ec->a_i, ec->c_i, ec->N_d*sizeof(int));\
+					for (x=0;x<ec->N_d;x++) {\
+						ec->a_s[x] = ec->a_i[x] >> 16;\
+					}\
+					ec->coeffs_restored = 1;\
+					ec->coeffs_changed = 1;\
 				}\
 				ec->backup = BACKUP;\
 			}
@@ -61,6 +72,9 @@
 
 #define DC_NORMALIZE
 
+/* Number of coefficients whose gradients are worked out together */
+#define MG2_GRAD_BLOCK 16
+
 #ifndef NULL
 #define NULL 0
 #endif
@@ -150,6 +164,12 @@ struct echo_can_state {
 	int avg_Lu_i_ok;
 #endif 
 	unsigned int aggressive:1;
+	/* Set whenever a_s changes, so echo_can_array_update() knows to
+	   recompute the echo estimates for the rest of its chunk */
+	unsigned int coeffs_changed:1;
+	/* Set while a_i is still a copy of c_i, so that holding the
+	   coefficients through near-end speech doesn't copy them every sample */
+	unsigned int coeffs_restored:1;
 	short lastsig;
 	int lastcount;
 	int backup;
@@ -164,11 +184,6 @@ static void echo_can_init(void)
 	printk("DAHDI Echo Canceller: MG2\n");
 }
 
-static void echo_can_identify(char *buf, size_t len)
-{
-	dahdi_copy_string(buf, "MG2", len);
-}
-
 static void echo_can_shutdown(void)
 {
 }
@@ -286,7 +301,7 @@ short inline dc_removal(int *dc_estimate, short samp)
 }
 #endif
 
-static inline short echo_can_update(struct echo_can_state *ec, short iref, short isig) 
+static inline short __echo_can_update(struct echo_can_state *ec, short iref, short isig, const int *rs_block)
 {
 
 	/* Declare local variables that are used more than once */
@@ -327,10 +342,13 @@ static inline short echo_can_update(struct echo_can_state *ec, short iref, short
 	add_cc_s(&ec->y_s, iref);
  
 
-	/* eq. (2): compute r in fixed-point */
-	rs = CONVOLVE2(ec->a_s, 
-  			ec->y_s.buf_d + ec->y_s.idx_d, 
-  			ec->N_d);
+	/* eq. (2): compute r in fixed-point, unless the caller already has */
+	if (rs_block)
+		rs = *rs_block;
+	else
+		rs = CONVOLVE2(ec->a_s, 
+	  			ec->y_s.buf_d + ec->y_s.idx_d, 
+	  			ec->N_d);
 	rs >>= 15;
 
 	if (ec->lastsig == isig) {
@@ -381,6 +399,7 @@ static inline short echo_can_update(struct echo_can_state *ec, short iref, short
 		ec->backup = BACKUP;
 		memcpy(ec->c_i,ec->b_i,ec->N_d*sizeof(int));
 		memcpy(ec->b_i,ec->a_i,ec->N_d*sizeof(int));
+		ec->coeffs_restored = 0;
 	} else
 		ec->backup--;
 
@@ -492,6 +511,7 @@ static inline short echo_can_update(struct echo_can_state *ec, short iref, short
 		!(ec->i_d % DEFAULT_M)) {		/* we only update on every DEFAULM_M'th sample from the stream */
   			if (ec->Lu_i > MIN_UPDATE_THRESH_I) {	/* there is sufficient energy above the noise floor to contain meaningful data */
   							/* so loop over all the filter coefficients */
+				int grad2[MG2_GRAD_BLOCK];
 #ifdef USED_COEFFS
 				int max_coeffs[USED_COEFFS];
 				int *pos;
@@ -506,14 +526,21 @@ static inline short echo_can_update(struct echo_can_state *ec, short iref, short
 				ec->avg_Lu_i_ok = ec->avg_Lu_i_ok + ec->Lu_i;  
 				++ec->cntr_coeff_updates;
 #endif
+				ec->coeffs_changed = 1;
+				ec->coeffs_restored = 0;
 				for (k=0; k < ec->N_d; k++) {
-					/* eq. (7): compute an expectation over M_d samples */
-					int grad2;
-					grad2 = CONVOLVE2(ec->u_s.buf_d + ec->u_s.idx_d,
-							  ec->y_s.buf_d + ec->y_s.idx_d + k,
-							  DEFAULT_M);
+					/* eq. (7): compute an expectation over M_d samples,
+					 * for a block of coefficients at a time */
+					if (!(k % MG2_GRAD_BLOCK)) {
+						int n = ec->N_d - k;
+						if (n > MG2_GRAD_BLOCK)
+							n = MG2_GRAD_BLOCK;
+						CONVOLVE2_BLOCK(ec->u_s.buf_d + ec->u_s.idx_d,
+								ec->y_s.buf_d + ec->y_s.idx_d + k,
+								DEFAULT_M, grad2, n);
+					}
 					/* eq. (7): update the coefficient */
-					ec->a_i[k] += grad2 / two_beta_i;
+					ec->a_i[k] += grad2[k % MG2_GRAD_BLOCK] / two_beta_i;
 					ec->a_s[k] = ec->a_i[k] >> 16;
 
 #ifdef USED_COEFFS
@@ -642,6 +669,50 @@ static inline short echo_can_update(struct echo_can_state *ec, short iref, short
 	return u;
 }
 
+static inline short echo_can_update(struct echo_can_state *ec, short iref, short isig)
+{
+	return __echo_can_update(ec, iref, isig, NULL);
+}
+
+/*
+ * Cancel a whole chunk: isig is the near-end signal, corrected in place,
+ * and iref the far-end reference.  The far-end samples of the chunk are
+ * all pushed into y_s first, so that the echo estimates of the chunk can
+ * be done as one block convolution that reads each tap once for several
+ * samples.  Everything else is done sample by sample exactly as in
+ * echo_can_update(); if the coefficients change part way through the
+ * chunk (an update, or a restore from the backup), the estimates for the
+ * samples left are worked out again, so the result is the same as that
+ * of DAHDI_CHUNKSIZE calls to echo_can_update().
+ */
+static inline void echo_can_array_update(struct echo_can_state *ec, short *isig, short *iref)
+{
+	int rs[DAHDI_CHUNKSIZE];
+	int idx, end;
+	int x;
+
+	idx = ec->y_s.idx_d;
+	for (x = 0; x < DAHDI_CHUNKSIZE; x++)
+		add_cc_s(&ec->y_s, iref[x]);
+	end = ec->y_s.idx_d;
+
+	/* y_s is newest first, so rs[j] is the estimate for sample
+	   DAHDI_CHUNKSIZE - 1 - j */
+	CONVOLVE2_BLOCK(ec->a_s, ec->y_s.buf_d + end, ec->N_d, rs, DAHDI_CHUNKSIZE);
+	ec->coeffs_changed = 0;
+
+	/* Rewind; __echo_can_update() pushes each sample again as it goes,
+	   writing the same value to the same place */
+	ec->y_s.idx_d = idx;
+	for (x = 0; x < DAHDI_CHUNKSIZE; x++) {
+		isig[x] = __echo_can_update(ec, iref[x], isig[x], &rs[DAHDI_CHUNKSIZE - 1 - x]);
+		if (ec->coeffs_changed) {
+			CONVOLVE2_BLOCK(ec->a_s, ec->y_s.buf_d + end, ec->N_d, rs, DAHDI_CHUNKSIZE - 1 - x);
+			ec->coeffs_changed = 0;
+		}
+	}
+}
+
 static int echo_can_create(struct dahdi_echocanparams *ecp, struct dahdi_echocanparam *p,
 			   struct echo_can_state **ec)
 {
@@ -659,6 +730,8 @@ static int echo_can_create(struct dahdi_echocanparams *ecp, struct dahdi_echocan
 		maxy = (1 << DEFAULT_SIGMA_LY_I);
 	if (maxu < (1 << DEFAULT_SIGMA_LU_I))
 		maxu = (1 << DEFAULT_SIGMA_LU_I);
+	/* Room for echo_can_array_update() to push a chunk ahead */
+	maxy += DAHDI_CHUNKSIZE;
 	size = sizeof(**ec) +
 		4 + 						/* align */
 		sizeof(int) * ecp->tap_length +			/* a_i */
@@ -686,7 +759,7 @@ static int echo_can_create(struct dahdi_echocanparams *ecp, struct dahdi_echocan
 			(*ec)->aggressive = p[x].value ? 1 : 0;
 		} else {
 			printk(KERN_WARNING "Unknown parameter supplied to MG2 echo canceler: '%s'\n", p[x].name);
-			kfree(*ec);
+			FREE(*ec);
 
 			return -EINVAL;
 		}
@@ -712,6 +785,7 @@ static inline int echo_can_traintap(struct echo_can_state *ec, int pos, short va
 
 	ec->a_i[pos] = val << 17;
 	ec->a_s[pos] = val << 1;
+	ec->coeffs_restored = 0;
 
 	if (++pos >= ec->N_d) {
 		memcpy(ec->b_i,ec->a_i,ec->N_d*sizeof(int));
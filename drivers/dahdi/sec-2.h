@@ -105,11 +105,6 @@ static void echo_can_init(void)
 	printk("DAHDI Echo Canceller: STEVE2%s\n", DAHDI_ECHO_AGGRESSIVE);
 }
 
-static void echo_can_identify(char *buf, size_t len)
-{
-	dahdi_copy_string(buf, "STEVE2", len);
-}
-
 static void echo_can_shutdown(void)
 {
 }
@@ -146,8 +141,8 @@ static int echo_can_create(struct dahdi_echocanparams *ecp, struct dahdi_echocan
 	(*ec)->taps = ecp->tap_length;
 	(*ec)->curr_pos = ecp->tap_length - 1;
 	(*ec)->tap_mask = ecp->tap_length - 1;
-	(*ec)->fir_taps32 = (int32_t *) (*ec + sizeof(**ec));
-	(*ec)->fir_taps16 = (int16_t *) (*ec + sizeof(**ec) + ecp->tap_length * sizeof(int32_t));
+	(*ec)->fir_taps32 = (int32_t *) ((char *) *ec + sizeof(**ec));
+	(*ec)->fir_taps16 = (int16_t *) ((char *) *ec + sizeof(**ec) + ecp->tap_length * sizeof(int32_t));
 	/* Create FIR filter */
 	fir16_create(&(*ec)->fir_state, (*ec)->fir_taps16, (*ec)->taps);
 	(*ec)->rx_power_threshold = 10000000;
@@ -105,11 +105,6 @@ static void echo_can_init(void)
 	printk("DAHDI Echo Canceller: STEVE%s\n", DAHDI_ECHO_AGGRESSIVE);
 }
 
-static void echo_can_identify(char *buf, size_t len)
-{
-	dahdi_copy_string(buf, "STEVE", len);
-}
-
 static void echo_can_shutdown(void)
 {
 }
@@ -149,10 +144,10 @@ static int echo_can_create(struct dahdi_echocanparams *ecp, struct dahdi_echocan
 
 	(*ec)->taps = ecp->tap_length;
 	(*ec)->tap_mask = ecp->tap_length - 1;
-	(*ec)->tx_history = (int16_t *) (*ec + sizeof(**ec));
-	(*ec)->fir_taps = (int32_t *) (*ec + sizeof(**ec) +
+	(*ec)->tx_history = (int16_t *) ((char *) *ec + sizeof(**ec));
+	(*ec)->fir_taps = (int32_t *) ((char *) *ec + sizeof(**ec) +
 				       ecp->tap_length * 2 * sizeof(int16_t));
-	(*ec)->fir_taps_short = (int16_t *) (*ec + sizeof(**ec) +
+	(*ec)->fir_taps_short = (int16_t *) ((char *) *ec + sizeof(**ec) +
 					     ecp->tap_length * sizeof(int32_t) +
 					     ecp->tap_length * 2 * sizeof(int16_t));
 	(*ec)->rx_power_threshold = 10000000;
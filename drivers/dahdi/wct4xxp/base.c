@@ -761,8 +761,8 @@ static void t4_check_vpm450(struct t4 *wc)
 						int y;
 						spin_lock_irqsave(&chan->lock, flags);
 						for (y=0;y<chan->numbufs;y++) {
-							if ((chan->inreadbuf > -1) && (chan->readidx[y]))
-								memset(chan->readbuf[chan->inreadbuf], DAHDI_XLAW(0, chan), chan->readidx[y]);
+							if ((dahdi_inreadbuf(chan) > -1) && (chan->readidx[y]))
+								memset(chan->readbuf[dahdi_inreadbuf(chan)], DAHDI_XLAW(0, chan), chan->readidx[y]);
 						}
 						spin_unlock_irqrestore(&chan->lock, flags);
 					}
@@ -832,8 +832,8 @@ static void t4_check_vpm400(struct t4 *wc, unsigned int newio)
 					int y;
 					spin_lock_irqsave(&chan->lock, flags);
 					for (y=0;y<chan->numbufs;y++) {
-						if ((chan->inreadbuf > -1) && (chan->readidx[y]))
-							memset(chan->readbuf[chan->inreadbuf], DAHDI_XLAW(0, chan), chan->readidx[y]);
+						if ((dahdi_inreadbuf(chan) > -1) && (chan->readidx[y]))
+							memset(chan->readbuf[dahdi_inreadbuf(chan)], DAHDI_XLAW(0, chan), chan->readidx[y]);
 					}
 					spin_unlock_irqrestore(&chan->lock, flags);
 				}
@@ -2252,8 +2252,7 @@ static inline void __receive_span(struct t4_span *ts)
 	prefetch((void *)(ts->writechunk + 56));
 #endif
 
-	dahdi_ec_span(&ts->span);
-	dahdi_receive(&ts->span);
+	dahdi_ec_receive(&ts->span);
 }
 
 static inline void __transmit_span(struct t4_span *ts)
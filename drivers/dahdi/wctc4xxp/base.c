@@ -43,6 +43,8 @@
 #include <linux/workqueue.h>
 #include <linux/moduleparam.h>
 #include <linux/firmware.h>
+#include <linux/proc_fs.h>
+#include <linux/timer.h>
 
 #include <dahdi/kernel.h>
 #include <dahdi/user.h>
@@ -365,6 +367,23 @@ struct wcdte {
 	struct workqueue_struct *dte_wq;
 	struct work_struct dte_work;
 
+	/* Interrupt coalescing: while polling, packet interrupts are
+	   masked and polltimer runs dte_work instead */
+	int running;
+	int polling;
+	struct timer_list polltimer;
+	unsigned int polls;
+
+	/* intcount and rxints above, and these, over the last second */
+	unsigned int txpackets;
+	unsigned int kicks;			/* Transmit poll demands */
+	unsigned int lastints, lastrx, lasttx, lastkicks;
+	unsigned int intrate, rxrate, txrate, kickrate;
+	struct timer_list stattimer;
+#ifdef CONFIG_PROC_FS
+	char procname[20];
+#endif
+
 	struct dahdi_transcoder *uencode;
 	struct dahdi_transcoder *udecode;
 };
@@ -426,6 +445,8 @@ static int force_alert = 0;
 static int debug_notimeout = 0;
 static char *mode;
 static int debug_packets = 0;
+static int coalesce = 0;			/* Milliseconds between polls once busy, 0 for an interrupt per packet */
+static int coalesce_thresh = 4;			/* Packets a poll has to find to go on polling */
 
 static int wcdte_create_channel(struct wcdte *wc, int simple, int complicated, int part1_id, int part2_id, unsigned int *dte_chan1, unsigned int *dte_chan2);
 static int wcdte_destroy_channel(struct wcdte *wc, unsigned int chan1, unsigned int chan2);
@@ -600,11 +621,15 @@ static inline unsigned int wcdte_getctl(struct wcdte *wc, unsigned int addr)
 	return val;
 }
 
+/* Put as much of the command queue as there are free descriptors for
+   on the ring, and demand transmission once for all of it.  Whatever
+   doesn't fit goes when a transmit interrupt says there is room. */
 static inline int __transmit_demand(struct wcdte *wc)
 {
 	volatile unsigned char *writechunk;
 	int o2,i,j;
 	unsigned int reg, xmt_length;
+	int sent = 0;
 
 	reg = wcdte_getctl(wc, 0x0028) & 0x00700000;
 	
@@ -612,55 +637,128 @@ static inline int __transmit_demand(struct wcdte *wc)
 	if (!((reg == 0) || (reg = 6)))
 		return(1);
 
-	/* Nothing to transmit */
-	if (wc->cmdq_rndx == wc->cmdq_wndx)
-		return(1);
+	while ((wc->cmdq_rndx != wc->cmdq_wndx) && wc->cmdq[wc->cmdq_rndx].cmdlen) {
+		o2 = wc->tdbl * 4;
 
-	/* Nothing to transmit */
-	if (wc->cmdq[wc->cmdq_rndx].cmdlen == 0 )
-		return(1);
+		/* Ring is full */
+		if (le32_to_cpu(wc->descripchunk[o2]) & 0x80000000)
+			break;
 
-	writechunk = (volatile unsigned char *)(wc->writechunk);
+		writechunk = (volatile unsigned char *)(wc->writechunk);
+		writechunk += wc->tdbl * SFRAME_SIZE;
 
-	writechunk += wc->tdbl * SFRAME_SIZE;
+		xmt_length = wc->cmdq[wc->cmdq_rndx].cmdlen;
+		if (xmt_length < 64)
+			xmt_length = 64;
+	
+		wc->descripchunk[o2+1] = cpu_to_le32((le32_to_cpu(wc->descripchunk[o2+1]) & 0xFBFFF800) | xmt_length);
+				
+		for(i = 0; i < wc->cmdq[wc->cmdq_rndx].cmdlen; i++)
+			writechunk[i] = wc->cmdq[wc->cmdq_rndx].cmd[i];
+		for (j = i; j < xmt_length; j++)
+			writechunk[j] = 0;
 
-	o2 = wc->tdbl * 4;
+		if (debug_packets && (writechunk[12] == 0x88) && (writechunk[13] == 0x9B))
+		{
+			printk("wcdte debug: TX: ");
+			for (i=0; i<debug_packets; i++)
+				printk("%02X ", writechunk[i]);
+			printk("\n");
+		}
 
-	do
-	{
-	} while ((le32_to_cpu(wc->descripchunk[o2]) & 0x80000000));
+		wc->cmdq[wc->cmdq_rndx].cmdlen = 0;
 
-	xmt_length = wc->cmdq[wc->cmdq_rndx].cmdlen;
-	if (xmt_length < 64)
-		xmt_length = 64;
+		wmb();
+		wc->descripchunk[o2] = cpu_to_le32(0x80000000);
 	
-	wc->descripchunk[o2+1] = cpu_to_le32((le32_to_cpu(wc->descripchunk[o2+1]) & 0xFBFFF800) | xmt_length);
-				
-	for(i = 0; i < wc->cmdq[wc->cmdq_rndx].cmdlen; i++)
-		writechunk[i] = wc->cmdq[wc->cmdq_rndx].cmd[i];
-	for (j = i; j < xmt_length; j++)
-		writechunk[j] = 0;
+		wc->tdbl = (wc->tdbl + 1) % ERING_SIZE;
 
-	if (debug_packets && (writechunk[12] == 0x88) && (writechunk[13] == 0x9B))
-	{
-		printk("wcdte debug: TX: ");
-		for (i=0; i<debug_packets; i++)
-			printk("%02X ", writechunk[i]);
-		printk("\n");
+		wc->cmdq_rndx = (wc->cmdq_rndx + 1) % MAX_COMMANDS;
+		sent++;
 	}
 
-	wc->cmdq[wc->cmdq_rndx].cmdlen = 0;
+	/* Nothing to transmit */
+	if (!sent)
+		return(1);
 
-	wc->descripchunk[o2] = cpu_to_le32(0x80000000);
 	wcdte_setctl(wc, 0x0008, 0x00000000);			/* Transmit Poll Demand */
-	
-	wc->tdbl = (wc->tdbl + 1) % ERING_SIZE;
-
-	wc->cmdq_rndx = (wc->cmdq_rndx + 1) % MAX_COMMANDS;
+	wc->txpackets += sent;
+	wc->kicks++;
 
 	return(0);
 }
 
+/* Wait for the card to take enough off the command queue to add n more,
+   sleeping while it has nowhere to put them.  Called with cmdqsem held,
+   from process context; gives up with -EBUSY after CMDQ_TIMEOUT */
+#define CMDQ_TIMEOUT (HZ / 10)
+static int __wcdte_cmdq_room(struct wcdte *wc, int n)
+{
+	unsigned long timeout = jiffies + CMDQ_TIMEOUT;
+
+	if (n > MAX_COMMANDS - 1)
+		return -EINVAL;
+	while ((wc->cmdq_rndx + MAX_COMMANDS - wc->cmdq_wndx - 1) % MAX_COMMANDS < n) {
+		if (!__transmit_demand(wc))
+			continue;
+		if (time_after(jiffies, timeout)) {
+			if (debug)
+				printk("wcdte error: timed out waiting for room in cmdq.\n");
+			return -EBUSY;
+		}
+		msleep(1);
+	}
+	return 0;
+}
+
+/* Whether srclen bytes left of the source make another frame */
+static inline int wcdte_frame_ready(struct dahdi_transcode_header *zth, unsigned int srclen)
+{
+	return (((zth->srcfmt == DAHDI_FORMAT_ULAW) || (zth->srcfmt == DAHDI_FORMAT_ALAW)) && ((zth->dstfmt == DAHDI_FORMAT_G729A  && srclen >= G729_SAMPLES) ||(zth->dstfmt == DAHDI_FORMAT_G723_1  && srclen >= G723_SAMPLES)) )
+		|| ((zth->srcfmt == DAHDI_FORMAT_G729A) && (srclen >= G729_BYTES))
+		|| ((zth->srcfmt == DAHDI_FORMAT_G723_1) && (srclen >= G723_SID_BYTES));
+}
+
+/* Bytes of source in the frame at chars, and the samples it stands for */
+static unsigned int wcdte_frame_bytes(struct dahdi_transcode_header *zth, unsigned char *chars, unsigned int *samples)
+{
+	unsigned int inbytes = 0;
+
+	*samples = 0;
+	if ((zth->srcfmt == DAHDI_FORMAT_ULAW) || (zth->srcfmt == DAHDI_FORMAT_ALAW)) {
+		if (zth->dstfmt == DAHDI_FORMAT_G729A) {
+			inbytes = G729_SAMPLES;
+			*samples = G729_SAMPLES;
+		} else if (zth->dstfmt == DAHDI_FORMAT_G723_1) {
+			inbytes = G723_SAMPLES;
+			*samples = G723_SAMPLES;
+		}
+	} else if (zth->srcfmt == DAHDI_FORMAT_G729A) {
+		inbytes = G729_BYTES;
+		*samples = G729_SAMPLES;
+	} else if (zth->srcfmt == DAHDI_FORMAT_G723_1) {
+		/* determine the size of the frame */
+		switch (chars[0] & 0x03) {
+		case 0x00:
+			inbytes = G723_6K_BYTES;
+			break;
+		case 0x01:
+			inbytes = G723_5K_BYTES;
+			break;
+		case 0x02:
+			inbytes = G723_SID_BYTES;
+			break;
+		case 0x03:
+			/* this is a 'reserved' value in the G.723.1
+			   spec and should never occur in real media streams */
+			inbytes = G723_SID_BYTES;
+			break;
+		}
+		*samples = G723_SAMPLES;
+	}
+	return inbytes;
+}
+
 static inline int transmit_demand(struct wcdte *wc)
 {
 	int val;
@@ -681,7 +779,8 @@ static int dte_operation(struct dahdi_transcoder_channel *ztc, int op)
 	unsigned int timestamp_inc = 0;
 	int i = 0;
 	int res = 0;
-	unsigned int ipchksum, ndx;
+	unsigned int ipchksum, ndx, srclen, srcoffset;
+	int frames;
 	switch(op) {
 	case DAHDI_TCOP_ALLOCATE:
 		down(&wc->chansem);
@@ -745,45 +844,30 @@ static int dte_operation(struct dahdi_transcoder_channel *ztc, int op)
 		up(&wc->chansem);
 		break;
 	case DAHDI_TCOP_TRANSCODE:
-		if ( (((zth->srcfmt == DAHDI_FORMAT_ULAW) || (zth->srcfmt == DAHDI_FORMAT_ALAW)) && ((zth->dstfmt == DAHDI_FORMAT_G729A  && zth->srclen >= G729_SAMPLES) ||(zth->dstfmt == DAHDI_FORMAT_G723_1  && zth->srclen >= G723_SAMPLES)) )
-			|| ((zth->srcfmt == DAHDI_FORMAT_G729A) && (zth->srclen >= G729_BYTES))
-			|| ((zth->srcfmt == DAHDI_FORMAT_G723_1) && (zth->srclen >= G723_SID_BYTES)) )
+		if (wcdte_frame_ready(zth, zth->srclen))
 		{
+			/* Count the frames first, and make room for all of them,
+			   so that the block goes to the card whole or not at all.
+			   Otherwise results of frames that went out would come
+			   back after the caller had given up on the block. */
+			frames = 0;
+			srcoffset = zth->srcoffset;
+			for (srclen = zth->srclen; wcdte_frame_ready(zth, srclen); srclen -= inbytes) {
+				inbytes = wcdte_frame_bytes(zth, zth->srcdata + srcoffset, &timestamp_inc);
+				if (inbytes > srclen)
+					break;
+				srcoffset += inbytes;
+				frames++;
+			}
+			down(&wc->cmdqsem);
+			if ((res = __wcdte_cmdq_room(wc, frames))) {
+				up(&wc->cmdqsem);
+				break;
+			}
 			do
 			{
 				chars = (unsigned char *)(zth->srcdata + zth->srcoffset);
-					
-				if ((zth->srcfmt == DAHDI_FORMAT_ULAW) || (zth->srcfmt == DAHDI_FORMAT_ALAW)) {
-					if (zth->dstfmt == DAHDI_FORMAT_G729A) {
-						inbytes = G729_SAMPLES; 
-						timestamp_inc = G729_SAMPLES; 
-					} else if (zth->dstfmt == DAHDI_FORMAT_G723_1) {
-						inbytes = G723_SAMPLES; 
-						timestamp_inc = G723_SAMPLES; 
-					}
-				} else if (zth->srcfmt == DAHDI_FORMAT_G729A) {
-					inbytes = G729_BYTES;
-					timestamp_inc = G729_SAMPLES;
-				} else if (zth->srcfmt == DAHDI_FORMAT_G723_1) {
-					/* determine the size of the frame */
-					switch (chars[0] & 0x03) {
-					case 0x00:
-						inbytes = G723_6K_BYTES;
-						break;
-					case 0x01:
-						inbytes = G723_5K_BYTES;
-						break;
-					case 0x02:
-						inbytes = G723_SID_BYTES;
-						break;
-					case 0x03:
-						/* this is a 'reserved' value in the G.723.1
-						   spec and should never occur in real media streams */
-						inbytes = G723_SID_BYTES;
-						break;
-					}
-					timestamp_inc = G723_SAMPLES;
-				}
+				inbytes = wcdte_frame_bytes(zth, chars, &timestamp_inc);
 
 				zth->srclen -= inbytes;
 
@@ -826,20 +910,12 @@ static int dte_operation(struct dahdi_transcoder_channel *ztc, int op)
 					for (i = 0; i < inbytes; i++)
 						fifo[i+CMD_MSG_IP_UDP_RTP_LEN]= chars[i];
 
-					down(&wc->cmdqsem);
-		
-					if ( (((wc->cmdq_wndx + 1) % MAX_COMMANDS) == wc->cmdq_rndx) && debug )
-						printk("wcdte error: cmdq is full.\n");
-					else
-					{
-						wc->cmdq[wc->cmdq_wndx].cmdlen = CMD_MSG_IP_UDP_RTP_LEN+inbytes;
-						for (i = 0; i < CMD_MSG_IP_UDP_RTP_LEN+inbytes; i++)
-							wc->cmdq[wc->cmdq_wndx].cmd[i] = fifo[i];
-						wc->cmdq_wndx = (wc->cmdq_wndx + 1) % MAX_COMMANDS;
-					}
-					
-					__transmit_demand(wc);
-					up(&wc->cmdqsem);
+					/* Queue it; the whole block goes to the card
+					   in one go below */
+					wc->cmdq[wc->cmdq_wndx].cmdlen = CMD_MSG_IP_UDP_RTP_LEN+inbytes;
+					for (i = 0; i < CMD_MSG_IP_UDP_RTP_LEN+inbytes; i++)
+						wc->cmdq[wc->cmdq_wndx].cmd[i] = fifo[i];
+					wc->cmdq_wndx = (wc->cmdq_wndx + 1) % MAX_COMMANDS;
 				}
 				st->packets_sent++;
 
@@ -848,15 +924,15 @@ static int dte_operation(struct dahdi_transcoder_channel *ztc, int op)
 				zth->srcoffset += inbytes;
 
 
-			} while ((((zth->srcfmt == DAHDI_FORMAT_ULAW) || (zth->srcfmt == DAHDI_FORMAT_ALAW)) && ((zth->dstfmt == DAHDI_FORMAT_G729A  && zth->srclen >= G729_SAMPLES) ||(zth->dstfmt == DAHDI_FORMAT_G723_1  && zth->srclen >= G723_SAMPLES)) )
-				|| ((zth->srcfmt == DAHDI_FORMAT_G729A) && (zth->srclen >= G729_BYTES))
-				|| ((zth->srcfmt == DAHDI_FORMAT_G723_1) && (zth->srclen >= G723_SID_BYTES)) );
+				/* The source is mapped, so don't go past the
+				   frames we made room for */
+			} while (--frames && wcdte_frame_ready(zth, zth->srclen));
+			up(&wc->cmdqsem);
 
+			transmit_demand(wc);
 		} else {
 			dahdi_transcoder_alert(ztc);
 		}
-
-		res = 0;
 		break;
 	}
 	return res;
@@ -1170,15 +1246,86 @@ static void dte_wque_run(void *work_data)
 {
 	struct wcdte *wc = work_data;
 #endif
-	int res;
+	int res, found = 0;
 
 	do {
 		res = wcdte_check_descriptor(wc);
+		found += res;
 	} while(res);
 	
 	transmit_demand(wc);
+
+	if (wc->polling) {
+		if (wc->running && coalesce && (found >= coalesce_thresh)) {
+			/* Busy enough that waiting a little for the next lot
+			   beats an interrupt for every packet */
+			mod_timer(&wc->polltimer, jiffies + max(1, coalesce * HZ / 1000));
+		} else {
+			wc->polling = 0;
+			wcdte_setctl(wc, 0x0038, wc->intmask);
+			/* Pick up anything that came in while masked */
+			while (wcdte_check_descriptor(wc))
+				;
+		}
+	}
 }
 
+static void wcdte_polltimer(unsigned long data)
+{
+	struct wcdte *wc = (struct wcdte *)data;
+
+	wc->polls++;
+	if (wc->running)
+		queue_work(wc->dte_wq, &wc->dte_work);
+}
+
+static void wcdte_stattimer(unsigned long data)
+{
+	struct wcdte *wc = (struct wcdte *)data;
+
+	wc->intrate = wc->intcount - wc->lastints;
+	wc->lastints = wc->intcount;
+	wc->rxrate = wc->rxints - wc->lastrx;
+	wc->lastrx = wc->rxints;
+	wc->txrate = wc->txpackets - wc->lasttx;
+	wc->lasttx = wc->txpackets;
+	wc->kickrate = wc->kicks - wc->lastkicks;
+	wc->lastkicks = wc->kicks;
+
+	if (wc->running)
+		mod_timer(&wc->stattimer, jiffies + HZ);
+}
+
+#ifdef CONFIG_PROC_FS
+static int wcdte_proc_read(char *page, char **start, off_t off, int count, int *eof, void *data)
+{
+	struct wcdte *wc = data;
+	int len = 0;
+
+	len += sprintf(page + len, "%s\n", wc->variety);
+	len += sprintf(page + len, "Interrupts: %u total, %u/s\n",
+		wc->intcount, wc->intrate);
+	len += sprintf(page + len, "Received: %u packets, %u/s\n",
+		wc->rxints, wc->rxrate);
+	len += sprintf(page + len, "Sent: %u packets, %u/s, %u batches/s\n",
+		wc->txpackets, wc->txrate, wc->kickrate);
+	if (coalesce)
+		len += sprintf(page + len, "Coalescing: every %d ms, %s, %u polls\n",
+			coalesce, wc->polling ? "polling" : "on interrupts", wc->polls);
+	else
+		len += sprintf(page + len, "Coalescing: off\n");
+	if (len <= off) {
+		*eof = 1;
+		return 0;
+	}
+	*start = page + off;
+	len -= off;
+	if (len > count) len = count;
+	else *eof = 1;
+	return len;
+}
+#endif
+
 DAHDI_IRQ_HANDLER(wcdte_interrupt)
 {
 	struct wcdte *wc = dev_id;
@@ -1191,9 +1338,15 @@ DAHDI_IRQ_HANDLER(wcdte_interrupt)
 	if (!ints)
 		return IRQ_NONE;
 	ints &= wc->intmask;
+	wc->intcount++;
 
 	if (ints & 0x00000041) {
 		wc->wqueints = ints;
+		if (coalesce && wc->running && !wc->polling) {
+			/* No more packet interrupts until dte_work is done */
+			wc->polling = 1;
+			wcdte_setctl(wc, 0x0038, wc->intmask & ~0x00000041);
+		}
 		queue_work(wc->dte_wq, &wc->dte_work);
 	}
 		
@@ -1743,6 +1896,12 @@ static int __devinit wcdte_init_one(struct pci_dev *pdev, const struct pci_devic
 #else
 			INIT_WORK(&wc->dte_work, dte_wque_run, wc);
 #endif
+			init_timer(&wc->polltimer);
+			wc->polltimer.function = wcdte_polltimer;
+			wc->polltimer.data = (unsigned long)wc;
+			init_timer(&wc->stattimer);
+			wc->stattimer.function = wcdte_stattimer;
+			wc->stattimer.data = (unsigned long)wc;
 
 #if defined(HOTPLUG_FIRMWARE)
 			if ((request_firmware(&firmware, tc400m_firmware, &wc->dev->dev) != 0) ||
@@ -1900,6 +2059,13 @@ static int __devinit wcdte_init_one(struct pci_dev *pdev, const struct pci_devic
 			if (debug)
 				printk("wcdte debug: (post-boot) Reg fc is %08x\n", reg);
 			
+			wc->running = 1;
+			mod_timer(&wc->stattimer, jiffies + HZ);
+#ifdef CONFIG_PROC_FS
+			sprintf(wc->procname, "dahdi/wctc4xxp%d", wc->pos);
+			create_proc_read_entry(wc->procname, 0444, NULL, wcdte_proc_read, wc);
+#endif
+
 			printk("Found and successfully installed a Wildcard TC: %s \n", wc->variety);
 			if (debug) {
 				printk("TC400B operating in DEBUG mode\n");
@@ -1946,6 +2112,9 @@ static void __devexit wcdte_remove_one(struct pci_dev *pdev)
 			}
 		}
 
+#ifdef CONFIG_PROC_FS
+		remove_proc_entry(wc->procname, NULL);
+#endif
 		dahdi_transcoder_unregister(wc->udecode);
 		dahdi_transcoder_unregister(wc->uencode);
 		dahdi_transcoder_free(wc->uencode);
@@ -1959,6 +2128,13 @@ static void __devexit wcdte_remove_one(struct pci_dev *pdev)
 		/* In case hardware is still there */
 		wcdte_disable_interrupts(wc);
 
+		/* Stop the timers, so nothing queues more work */
+		wc->running = 0;
+		del_timer_sync(&wc->stattimer);
+		del_timer_sync(&wc->polltimer);
+		flush_workqueue(wc->dte_wq);
+		del_timer_sync(&wc->polltimer);
+
 		/* Kill workqueue */
 		destroy_workqueue(wc->dte_wq);
 		
@@ -2013,6 +2189,8 @@ module_param(debug_des_cnt, int, S_IRUGO | S_IWUSR);
 module_param(debug_notimeout, int, S_IRUGO | S_IWUSR);
 module_param(force_alert, int, S_IRUGO | S_IWUSR);
 module_param(mode, charp, S_IRUGO | S_IWUSR);
+module_param(coalesce, int, S_IRUGO | S_IWUSR);
+module_param(coalesce_thresh, int, S_IRUGO | S_IWUSR);
 MODULE_DESCRIPTION("Wildcard TC400P+TC400M Driver");
 MODULE_AUTHOR("John Sloan <jsloan@digium.com>");
 #ifdef MODULE_LICENSE
@@ -663,8 +663,8 @@ static void vpm150m_dtmf_bh(struct work_struct *data)
 							/* Mute the audio data buffers */
 							spin_lock_irqsave(&chan->lock, flags);
 							for (y = 0; y < chan->numbufs; y++) {
-								if ((chan->inreadbuf > -1) && (chan->readidx[y]))
-									memset(chan->readbuf[chan->inreadbuf], DAHDI_XLAW(0, chan), chan->readidx[y]);
+								if ((dahdi_inreadbuf(chan) > -1) && (chan->readidx[y]))
+									memset(chan->readbuf[dahdi_inreadbuf(chan)], DAHDI_XLAW(0, chan), chan->readidx[y]);
 							}
 							spin_unlock_irqrestore(&chan->lock, flags);
 						}
@@ -36,6 +36,11 @@
 #endif
 #include <linux/fs.h>
 #include <linux/ioctl.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,26)
+#include <linux/semaphore.h>
+#else
+#include <asm/semaphore.h>
+#endif
 
 #ifdef CONFIG_DAHDI_NET	
 #include <linux/hdlc.h>
@@ -590,6 +595,13 @@ struct dahdi_hwgain{
  */
 #define DAHDI_TIMERCONFIG	_IOW (DAHDI_CODE, 47, int)
 
+/*
+ * Set timer expiration (in samples), tripping on the samples that are
+ * phase (in samples) past a multiple of the expiration.  Timers with the
+ * same expiration and phase are woken together.
+ */
+#define DAHDI_TIMERCONFIG_PHASE	_IOW (DAHDI_CODE, 97, struct dahdi_timerconf)
+
 /*
  * Acknowledge timer expiration (number to acknowledge, or -1 for all)
  */
@@ -644,6 +656,13 @@ struct dahdi_hwgain{
  */
 #define DAHDI_LOOPBACK _IOW(DAHDI_CODE, 58, int)
 
+/*
+ * Choose the software echo canceller a channel uses from now on, by name
+ * (e.g. "mg2" or "kb1").  An empty name goes back to the default.  The
+ * module providing it is loaded if needed.
+ */
+#define DAHDI_ATTACH_ECHOCAN _IOW(DAHDI_CODE, 59, struct dahdi_attach_echocan)
+
 
 /*
  *  60-80 are reserved for private drivers
@@ -686,6 +705,17 @@ struct dahdi_hwgain{
  */
 #define DAHDI_VMWI			_IOWR(DAHDI_CODE, 94, int)
 
+/*
+ * Read from or write to many channels in one go, as read() or write() on
+ * each channel would in non-blocking mode.  Each entry names a channel by
+ * a file descriptor the caller has it open on.  Each entry's res gets the
+ * byte count or error (-EAGAIN if there was nothing to read or no room
+ * to write, -ELAST if there are events waiting, -EBADF if the fd isn't an
+ * open DAHDI channel).  Returns the number of entries that moved any data.
+ */
+#define DAHDI_READV			_IOW(DAHDI_CODE, 95, struct dahdi_bufvecs)
+#define DAHDI_WRITEV			_IOW(DAHDI_CODE, 96, struct dahdi_bufvecs)
+
 /* 
  * Startup or Shutdown a span
  */
@@ -809,6 +839,8 @@ enum {
 #define DAHDI_TCOP_GETINFO		3			/* Get information (use dahdi_transcode_info) */
 #define DAHDI_TCOP_RELEASE         4                       /* Release DTE channel */
 #define DAHDI_TCOP_TEST            5                       /* test DTE device */
+#define DAHDI_TCOP_RINGON	6			/* Set up the frame ring (see dahdi_transcode_ring) */
+#define DAHDI_TCOP_SUBMIT	7			/* Start on frames queued in the ring */
 typedef struct dahdi_transcode_info {
 	unsigned int op;
 	unsigned int tcnum;
@@ -852,6 +884,80 @@ typedef struct dahdi_transcode_header {
 	unsigned char dstdata[DAHDI_TRANSCODE_BUFSIZ / 2];	/* Storage of destination data */
 } DAHDI_TRANSCODE_HEADER;
 
+/*
+ * After DAHDI_TCOP_RINGON, mmap() of a transcoder at
+ * DAHDI_TRANSCODE_RINGOFFSET maps one of these, rounded up to whole
+ * pages: the length of the mapping must be sizeof() the ring rounded up
+ * to the page size.  Queue frames in sq[]
+ * and advance sqhead, then DAHDI_TCOP_SUBMIT starts on all of them.
+ * Results come back in cq[] as they finish, in the order they were
+ * queued unless a frame is rejected outright; poll() gives POLLIN while
+ * any are waiting.  The formats are those in the transcode header, and
+ * the header's own buffers belong to the ring, which lasts until the
+ * transcoder is closed.  A transcoder that returns errors should be
+ * allocated again; a batch in flight when it is moved to another
+ * transcoder comes back with -EIO.
+ */
+#define DAHDI_TCRING_MAGIC	0x74637267
+#define DAHDI_TCRING_ENTRIES	128		/* Must be a power of two */
+#define DAHDI_TCRING_DATALEN	480		/* Bytes of data each entry can hold */
+#define DAHDI_TCRING_HDRLEN	256
+#define DAHDI_TRANSCODE_RINGOFFSET	0x100000	/* mmap() offset of the ring */
+
+struct dahdi_transcode_sqe {
+	unsigned int user;		/* Handed back in the completion -- written by user */
+	unsigned int srclen;		/* In bytes -- written by user */
+	unsigned char srcdata[DAHDI_TCRING_DATALEN];
+};
+
+struct dahdi_transcode_cqe {
+	unsigned int user;		/* From the submission */
+	int res;			/* 0, or -errno if the frame was not transcoded */
+	unsigned int dstlen;		/* In bytes */
+	unsigned int dstsamples;	/* In timestamp units */
+	unsigned char dstdata[DAHDI_TCRING_DATALEN];
+};
+
+typedef struct dahdi_transcode_ring {
+	unsigned int magic;		/* Magic value -- DAHDI_TCRING_MAGIC, read by user */
+	unsigned int entries;		/* DAHDI_TCRING_ENTRIES -- read by user */
+	unsigned int sqhead;		/* Frames queued so far -- written by user */
+	unsigned int sqtail;		/* Frames taken so far -- read by user */
+	unsigned int cqhead;		/* Results posted so far -- read by user */
+	unsigned int cqtail;		/* Results consumed so far -- written by user */
+	unsigned char userhdr[DAHDI_TCRING_HDRLEN - (sizeof(unsigned int) * 6)];
+	struct dahdi_transcode_sqe sq[DAHDI_TCRING_ENTRIES];
+	struct dahdi_transcode_cqe cq[DAHDI_TCRING_ENTRIES];
+} DAHDI_TRANSCODE_RING;
+
+/*
+ * mmap() of a channel device maps one of these.  While it is mapped, the
+ * channel's audio goes through rxdata and txdata instead of read() and
+ * write().  Both are rings of DAHDI_MMAP_RINGSIZE bytes, in the channel's
+ * law, indexed by free running byte counters: the data waiting is always
+ * head - tail, and byte n lives at n & (DAHDI_MMAP_RINGSIZE - 1).
+ */
+#define DAHDI_MMAP_MAGIC	0x6d6d6170
+#define DAHDI_MMAP_HDRLEN	256
+#define DAHDI_MMAP_RINGSIZE	4096		/* Must be a power of two */
+#define DAHDI_MMAP_THRESHOLD	160		/* Default for both thresholds */
+
+typedef struct dahdi_mmap_header {
+	unsigned int magic;		/* Magic value -- DAHDI_MMAP_MAGIC, read by user */
+	unsigned int ringsize;		/* DAHDI_MMAP_RINGSIZE -- read by user */
+	unsigned int rxhead;		/* Bytes received so far -- read by user */
+	unsigned int rxtail;		/* Bytes consumed so far -- written by user */
+	unsigned int rxthreshold;	/* poll() gives POLLIN with this many waiting -- written by user */
+	unsigned int rxoverruns;	/* Bytes dropped because rxdata was full -- read by user */
+	unsigned int txhead;		/* Bytes queued so far -- written by user */
+	unsigned int txtail;		/* Bytes sent so far -- read by user */
+	unsigned int txthreshold;	/* poll() gives POLLOUT with fewer than this queued -- written by user */
+	unsigned int txunderruns;	/* Chunks txdata could not fill -- read by user */
+	unsigned char userhdr[DAHDI_MMAP_HDRLEN - (sizeof(unsigned int) * 10)];
+	unsigned char rxdata[DAHDI_MMAP_RINGSIZE];
+	unsigned char txdata[DAHDI_MMAP_RINGSIZE];
+} DAHDI_MMAP_HEADER;
+
 struct dahdi_ring_cadence {
 	int ringcadence[DAHDI_MAX_CADENCE];
 };
@@ -870,6 +976,33 @@ struct dahdi_echocanparams {
 	struct dahdi_echocanparam params[0];
 };
 
+#define DAHDI_MAX_ECHOCANNAME 16
+
+struct dahdi_attach_echocan {
+	int	chan;					/* Channel to attach the canceller to */
+	char	echocan[DAHDI_MAX_ECHOCANNAME];		/* Name of the canceller, empty for default */
+};
+
+#define DAHDI_MAX_BUFVEC	1024
+
+/* One channel's share of a DAHDI_READV or DAHDI_WRITEV */
+struct dahdi_bufvec {
+	int	fd;			/* Caller's open channel or pseudo channel */
+	int	len;			/* Size of buf in bytes */
+	void	*buf;			/* Where the data goes to or comes from */
+	int	res;			/* Bytes moved, or -errno -- written by DAHDI */
+};
+
+struct dahdi_bufvecs {
+	int	count;			/* Entries in vec, at most DAHDI_MAX_BUFVEC */
+	struct dahdi_bufvec *vec;
+};
+
+struct dahdi_timerconf {
+	int samples;		/* Timer expiration, in samples, or 0 to stop */
+	int phase;		/* Offset of each expiry, in samples */
+};
+
 struct dahdi_tone_def_header {
 	int count;		/* How many samples follow */
 	int zone;		/* Which zone we are loading */
@@ -1143,6 +1276,7 @@ struct dahdi_tone_def {		/* Structure for zone programming */
 
 struct dahdi_span;
 struct dahdi_chan;
+struct dahdi_mmap_area;
 
 struct dahdi_tone_state {
 	int v1_1;
@@ -1162,10 +1296,22 @@ struct dahdi_chardev {
 int dahdi_register_chardev(struct dahdi_chardev *dev);
 int dahdi_unregister_chardev(struct dahdi_chardev *dev);
 
+/* Most frames a NAPI poll (or the PPP tasklet) passes up per run */
+#define DAHDI_NET_WEIGHT	64
+
 #ifdef CONFIG_DAHDI_NET
+/* Received frames go up through a NAPI poll, with GRO, where the kernel has it */
+#if !defined(CONFIG_OLD_HDLC_API) && (LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,29))
+#define DAHDI_NET_NAPI
+#endif
+
 struct dahdi_hdlc {
 	struct net_device *netdev;
 	struct dahdi_chan *chan;
+#ifdef DAHDI_NET_NAPI
+	struct napi_struct napi;
+	struct sk_buff_head rxq;	/* Frames waiting for dahdi_net_poll() */
+#endif
 };
 #endif
 
@@ -1183,6 +1329,22 @@ void echo_can_array_update(struct echo_can_state *ec, short *iref, short *isig);
 int echo_can_traintap(struct echo_can_state *ec, int pos, short val);
 #endif
 
+/* A software echo canceller, registered by its module */
+struct dahdi_echocan {
+	const char *name;		/* Lower case, as in DAHDI_ATTACH_ECHOCAN */
+	struct module *owner;
+	int (*echo_can_create)(struct dahdi_echocanparams *ecp, struct dahdi_echocanparam *p, struct echo_can_state **ec);
+	void (*echo_can_free)(struct echo_can_state *ec);
+	/* Provide at least one of these two */
+	short (*echo_can_update)(struct echo_can_state *ec, short iref, short isig);
+	void (*echo_can_array_update)(struct echo_can_state *ec, short *iref, short *isig);
+	int (*echo_can_traintap)(struct echo_can_state *ec, int pos, short val);
+	struct list_head list;		/* Private to dahdi-base */
+};
+
+int dahdi_register_echocan(struct dahdi_echocan *ec);
+void dahdi_unregister_echocan(struct dahdi_echocan *ec);
+
 /* Conference queue stucture */
 struct confq {
 	u_char buffer[DAHDI_CHUNKSIZE * DAHDI_CB_SIZE];
@@ -1203,6 +1365,8 @@ typedef struct
 	int	lastdetect;
 } sf_detect_state_t;
 
+struct sk_buff;
+
 struct dahdi_chan {
 #ifdef CONFIG_DAHDI_NET
 	/* Must be first */
@@ -1261,16 +1425,23 @@ struct dahdi_chan {
 	__u32		chan_alarms;		/* alarms status */
 
 	/* Used only by DAHDI -- NO DRIVER SERVICEABLE PARTS BELOW */
-	/* Buffer declarations */
+	/* Buffer declarations.  The read and write buffers are rings with a
+	   single producer and a single consumer: each side only ever moves
+	   its own index, so read() and write() don't need chan->lock to
+	   hand buffers to and from the span.  See dahdi_inreadbuf() below.
+	   readsem and writesem keep it to one reader and one writer at a
+	   time, and keep the buffers from being reallocated under them. */
 	u_char		*readbuf[DAHDI_MAX_NUM_BUFS];	/* read buffer */
-	int		inreadbuf;
-	int		outreadbuf;
+	int		readhead;	/* Next buffer the span fills */
+	int		readtail;	/* Next buffer read() empties */
 	wait_queue_head_t readbufq; /* read wait queue */
+	struct semaphore readsem;
 
 	u_char		*writebuf[DAHDI_MAX_NUM_BUFS]; /* write buffers */
-	int		inwritebuf;
-	int		outwritebuf;
+	int		writehead;	/* Next buffer write() fills */
+	int		writetail;	/* Next buffer the span empties */
 	wait_queue_head_t writebufq; /* write wait queue */
+	struct semaphore writesem;
 	
 	int		blocksize;	/* Block size */
 
@@ -1285,12 +1456,14 @@ struct dahdi_chan {
 	int		readidx[DAHDI_MAX_NUM_BUFS];  /* current read pointer */
 	int		writen[DAHDI_MAX_NUM_BUFS];  /* # of bytes ready in write buf */
 	int		writeidx[DAHDI_MAX_NUM_BUFS];  /* current write pointer */
+	struct sk_buff	*writeskb[DAHDI_MAX_NUM_BUFS];  /* Net/PPP frame queued in place of writebuf, which then only holds its FCS */
 	
 	int		numbufs;			/* How many buffers in channel */
 	int		txbufpolicy;			/* Buffer policy */
 	int		rxbufpolicy;			/* Buffer policy */
 	int		txdisable;				/* Disable transmitter */
 	int 	rxdisable;				/* Disable receiver */
+	struct dahdi_mmap_area *mmap;	/* Shared audio rings, if mmap()ed */
 	
 	
 	/* Tone zone stuff */
@@ -1328,6 +1501,8 @@ struct dahdi_chan {
 	int		_confn;	/* Actual conference number */
 	int		confmode;  /* conference mode */
 	int		confmute; /* conference mute mode */
+	int		pipeline; /* DAHDI_PIPE_* stages this channel's audio needs */
+	struct list_head active_node;	/* On the master tick's pseudo or conference list */
 
 	/* Incoming and outgoing conference chunk queues for
 	   communicating between DAHDI master time and
@@ -1348,6 +1523,8 @@ struct dahdi_chan {
 	/* Is echo cancellation enabled or disabled */
 	int		echocancel;
 	struct echo_can_state	*ec;
+	struct dahdi_echocan	*ec_factory;	/* What ec was created by */
+	char		echocan_name[DAHDI_MAX_ECHOCANNAME];	/* Canceller to create, empty for default */
 	echo_can_disable_detector_state_t txecdis;
 	echo_can_disable_detector_state_t rxecdis;
 	
@@ -1400,6 +1577,7 @@ struct dahdi_chan {
 
 	int deflaw;		/* 1 = mulaw, 2=alaw, 0=undefined */
 	short *xlaw;
+	short *rxgainlin;	/* xlaw[rxgain[]]: rx gain and law conversion in one lookup */
 #ifdef	OPTIMIZE_CHANMUTE
 	int chanmute;		/*!< no need for PCM data */
 #endif
@@ -1478,6 +1656,13 @@ enum {
 	DAHDI_FLAGBIT_MTP2       = 19,
 };
 
+/* Audio processing stages a channel needs, kept in dahdi_chan.pipeline.
+   With none of them set its audio chunks are simply copied through. */
+#define DAHDI_PIPE_EC		(1 << 0)	/* Echo canceller attached */
+#define DAHDI_PIPE_GAIN		(1 << 1)	/* Gain other than unity */
+#define DAHDI_PIPE_CONF		(1 << 2)	/* In a conference or monitor mode */
+#define DAHDI_PIPE_RXTONE	(1 << 3)	/* Receive tone (SF) detection */
+
 struct dahdi_span {
 	spinlock_t lock;
 	void *pvt;			/* Private stuff */
@@ -1511,6 +1696,9 @@ struct dahdi_span {
 
 	int timingslips;			/* Clock slips */
 
+	unsigned int fastchunks;	/* Audio chunks that were a plain copy */
+	unsigned int slowchunks;	/* Audio chunks that ran the full pipeline */
+
 	struct dahdi_chan *chans;		/* Member channel structures */
 
 	/*   ==== Span Callback Operations ====   */
@@ -1592,6 +1780,9 @@ struct dahdi_span {
 #endif	
 };
 
+struct dahdi_tc_ring;
+struct dahdi_tc_stats;
+
 struct dahdi_transcoder_channel {
 	void *pvt;
 	struct dahdi_transcoder *parent;
@@ -1604,6 +1795,9 @@ struct dahdi_transcoder_channel {
 	unsigned int srcfmt;
 	unsigned int dstfmt;
 	struct dahdi_transcode_header *tch;
+	struct dahdi_tc_ring *ring;	/* Frame ring, if set up; moves with tch */
+	struct list_head free_node;	/* On parent's free list while not busy */
+	unsigned long submitted;	/* When the transcode in progress started */
 };
 
 #define DAHDI_TC_FLAG_BUSY       (1 << 0)
@@ -1617,6 +1811,17 @@ struct dahdi_transcoder {
 	unsigned int srcfmts;
 	unsigned int dstfmts;
 	int (*operation)(struct dahdi_transcoder_channel *channel, int op);
+	/* Optional: called on close, and must not return until nothing
+	   the transcoder is still doing can touch the channel's header */
+	void (*flush)(struct dahdi_transcoder_channel *channel);
+	/* Set for software transcoders: only given channels when no
+	   other transcoder for the formats has one free */
+	int fallback;
+	/* Maintained by DAHDI: channels not in use, least recently used
+	   first, and how many are */
+	struct list_head free;
+	int busy;
+	struct dahdi_tc_stats *stats;	/* For /proc/dahdi/transcoders */
 	/* Transcoder channels */
 	struct dahdi_transcoder_channel channels[0];
 };
@@ -1666,6 +1871,10 @@ void dahdi_dynamic_unregister(struct dahdi_dynamic_driver *driver);
    all member channels of the span, pulling the data from the readchunk buffer */
 int dahdi_receive(struct dahdi_span *span);
 
+/* dahdi_ec_span() and dahdi_receive() in one pass, taking each channel's
+   lock once */
+int dahdi_ec_receive(struct dahdi_span *span);
+
 /* Prepare writechunk buffers on all channels for this span */
 int dahdi_transmit(struct dahdi_span *span);
 
@@ -1683,6 +1892,10 @@ void dahdi_hdlc_putbuf(struct dahdi_chan *ss, unsigned char *rxb, int bytes);
  * and 1 if the currently transmitted message is now done */
 int dahdi_hdlc_getbuf(struct dahdi_chan *ss, unsigned char *bufptr, unsigned int *size);
 
+/* Run the HDLC FCS (CRC-16/CCITT, as PPP_FCS()) over len bytes of data,
+   starting from fcs.  Start a frame with PPP_INITFCS */
+unsigned int dahdi_fcs(unsigned int fcs, const unsigned char *data, int len);
+
 
 /* Register a span.  Returns 0 on success, -1 on failure.  Pref-master is non-zero if
    we should have preference in being the master device */
@@ -1808,6 +2021,90 @@ static inline short dahdi_txtone_nextsample(struct dahdi_chan *ss)
 	return ss->v3_1;
 }
 
+/*
+ * Buffer rings.  The head and tail of each ring count from 0 to
+ * 2 * numbufs - 1, so that a full ring (numbufs apart) can be told from
+ * an empty one (equal).  The producer fills the buffer at the head and
+ * then moves the head on; the consumer empties the buffer at the tail
+ * and then moves the tail on.  The barriers in dahdi_ring_push() and
+ * dahdi_ring_pop() make sure the other side never sees an index move
+ * before the buffer contents it covers.
+ */
+static inline int dahdi_ring_used(const struct dahdi_chan *chan, int head, int tail)
+{
+	int used = head - tail;
+	if (used < 0)
+		used += chan->numbufs << 1;
+	return used;
+}
+
+static inline int dahdi_ring_next(const struct dahdi_chan *chan, int idx)
+{
+	if (++idx >= (chan->numbufs << 1))
+		idx = 0;
+	return idx;
+}
+
+static inline int dahdi_ring_buf(const struct dahdi_chan *chan, int idx)
+{
+	return (idx >= chan->numbufs) ? idx - chan->numbufs : idx;
+}
+
+/* Returns the buffer at the producer's end, or -1 if the ring is full
+ * (or the channel has no buffers yet) */
+static inline int dahdi_ring_in(const struct dahdi_chan *chan, int head, int tail)
+{
+	if (!chan->readbuf[0] || (dahdi_ring_used(chan, head, tail) >= chan->numbufs))
+		return -1;
+	smp_mb();
+	return dahdi_ring_buf(chan, head);
+}
+
+/* Returns the buffer at the consumer's end, or -1 if the ring is empty */
+static inline int dahdi_ring_out(const struct dahdi_chan *chan, int head, int tail)
+{
+	if (head == tail)
+		return -1;
+	smp_rmb();
+	return dahdi_ring_buf(chan, tail);
+}
+
+static inline void dahdi_ring_push(const struct dahdi_chan *chan, int *head)
+{
+	smp_wmb();
+	*head = dahdi_ring_next(chan, *head);
+}
+
+static inline void dahdi_ring_pop(const struct dahdi_chan *chan, int *tail)
+{
+	smp_mb();
+	*tail = dahdi_ring_next(chan, *tail);
+}
+
+/* The read buffer the span is filling, or -1 if read() has fallen behind */
+static inline int dahdi_inreadbuf(const struct dahdi_chan *chan)
+{
+	return dahdi_ring_in(chan, chan->readhead, chan->readtail);
+}
+
+/* The oldest full read buffer, or -1 if there is nothing to read */
+static inline int dahdi_outreadbuf(const struct dahdi_chan *chan)
+{
+	return dahdi_ring_out(chan, chan->readhead, chan->readtail);
+}
+
+/* The write buffer write() fills next, or -1 if they are all pending */
+static inline int dahdi_inwritebuf(const struct dahdi_chan *chan)
+{
+	return dahdi_ring_in(chan, chan->writehead, chan->writetail);
+}
+
+/* The write buffer the span is sending, or -1 if there is nothing to send */
+static inline int dahdi_outwritebuf(const struct dahdi_chan *chan)
+{
+	return dahdi_ring_out(chan, chan->writehead, chan->writetail);
+}
+
 /* These are the right functions to use.  */
 
 #define DAHDI_MULAW(a) (__dahdi_mulaw[(a)])